@@ -7,12 +7,17 @@
 #include <map>
 #include <iostream>
 #include <atomic>
+#include <memory>
 #include <boost/functional/hash.hpp>
 #include <boost/container/flat_map.hpp>
 #include <vector>
 #include <protozero/data_view.hpp>
 #include "pooled_string.h"
-#include "deque_map.h"
+#include "mmap_allocator.h"
+#include "concurrent_dedup_table.h"
+
+class IndexFileWriter;
+class IndexFileReader;
 
 /* AttributeStore - global dictionary for attributes */
 
@@ -175,31 +180,20 @@ struct AttributePair {
 #pragma pack(pop)
 
 
-// We shard the cold pools to reduce the odds of lock contention on
-// inserting/retrieving the "cold" pairs.
-//
-// It should be at least 2x the number of your cores -- 256 shards is probably
-// reasonable for most people.
-//
-// We also reserve the bottom shard for the hot pool.
-#define SHARD_BITS 14
-#define ATTRIBUTE_SHARDS (1 << SHARD_BITS)
+// Pairs are referred to by index. Hot pairs have indices below 64K, so that
+// an AttributeSet can store them as shorts; cold pairs are numbered from 64K.
+#define HOT_PAIRS (1 << 16)
 
 class AttributeStore;
 class AttributePairStore {
 public:
 	AttributePairStore():
 		finalized(false),
-		pairsMutex(ATTRIBUTE_SHARDS),
-		lookups(0),
-		lookupsUncached(0)
+		hotPairs(HOT_PAIRS),
+		lookups(0)
 	{
-		// The "hot" shard has a capacity of 64K, the others are unbounded.
-		pairs.push_back(DequeMap<AttributePair>(1 << 16));
 		// Reserve offset 0 as a sentinel
-		pairs[0].add(AttributePair(0, false, 0));
-		for (size_t i = 1; i < ATTRIBUTE_SHARDS; i++)
-			pairs.push_back(DequeMap<AttributePair>());
+		hotPairs.add(AttributePair(0, false, 0));
 	}
 
 	void finalize() { finalized = true; }
@@ -210,17 +204,14 @@ public:
 
 private:
 	friend class AttributeStore;
-	std::vector<DequeMap<AttributePair>> pairs;
 	bool finalized;
-	// We refer to all attribute pairs by index.
+	// Both tables are lock-free, so getPair and addPair can be called from
+	// any thread without synchronization.
 	//
-	// Each shard is responsible for a portion of the key space.
-	// 
-	// The 0th shard is special: it's the hot shard, for pairs
-	// we suspect will be popular. It only ever has 64KB items,
-	// so that we can reference it with a short.
-	mutable std::vector<std::mutex> pairsMutex;
-	std::atomic<uint64_t> lookupsUncached;
+	// The hot table is for pairs we suspect will be popular. It only ever has
+	// 64K items, so that we can reference it with a short.
+	ConcurrentDedupTable<AttributePair> hotPairs;
+	ConcurrentDedupTable<AttributePair> coldPairs;
 	std::atomic<uint64_t> lookups;
 };
 
@@ -401,33 +392,70 @@ private:
 struct AttributeStore {
 	AttributeIndex add(AttributeSet &attributes);
 	std::vector<const AttributePair*> getUnsafe(AttributeIndex index) const;
+
+	// The pairs of a set that are visible at a zoom level (minzoom <= zoom),
+	// computed by finalize(). Sets with the same visible pairs at a zoom
+	// share a slice ID, so it can be used as a cache key when writing tiles.
+	uint32_t zoomSliceId(AttributeIndex index, char zoom) const;
+	std::vector<const AttributePair*> getZoomSliceUnsafe(AttributeIndex index, char zoom) const;
 	void reset(); // used for testing
 	size_t size() const;
 	void reportSize() const;
 	void finalize();
 
+	// Write the finalized store to a tile index, or read it back into an
+	// empty store, which is then finalized. Keys, pairs and sets all keep
+	// their indexes, including the gaps left by concurrent adds.
+	void save(IndexFileWriter& writer) const;
+	void load(IndexFileReader& reader);
+
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, const protozero::data_view v, char minzoom);
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, float v, char minzoom);
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, bool v, char minzoom);
 	
 	AttributeStore():
 		finalized(false),
-		sets(ATTRIBUTE_SHARDS),
-		setsMutex(ATTRIBUTE_SHARDS),
-		lookups(0),
-		lookupsUncached(0) {
+		sets(new ConcurrentDedupTable<AttributeSet>()),
+		packedSetCount(0),
+		lookups(0) {
 	}
 
 	AttributeKeyStore keyStore;
 	AttributePairStore pairStore;
 
 private:
+	// The pairs of a set with minzoom <= `minzoom` are the first `count`
+	// entries of zoomOrderedPairs from `pairs`
+	struct ZoomSlice {
+		uint8_t minzoom;
+		uint32_t count;
+		uint32_t pairs;
+		uint32_t id;
+	};
+	const ZoomSlice* findZoomSlice(AttributeIndex index, char zoom) const;
+	void finalizeZoomSlices();
+	void packSets();
+	void unpackSet(AttributeIndex index, std::vector<uint32_t>& pairs) const;
+
 	bool finalized;
-	std::vector<DequeMap<AttributeSet>> sets;
-	mutable std::vector<std::mutex> setsMutex;
+	// Lock-free; an AttributeIndex is the set's index in the table. Freed by
+	// finalize(), once the sets have been packed.
+	std::unique_ptr<ConcurrentDedupTable<AttributeSet>> sets;
+
+	// After finalize(), each set is a varint count followed by its ascending
+	// pair indices, delta-encoded, starting at packedSetOffsets[index]. Both
+	// use mmap_allocator, so they spill to disk with --store.
+	std::vector<char, mmap_allocator<char>> packedSets;
+	std::vector<uint64_t, mmap_allocator<uint64_t>> packedSetOffsets;
+	size_t packedSetCount;
+
+	// Per set, a range of zoomSlices in ascending minzoom. An empty range
+	// means every pair has minzoom 0, so the slice is the set itself.
+	std::vector<uint32_t, mmap_allocator<uint32_t>> zoomSliceStart;
+	std::vector<ZoomSlice, mmap_allocator<ZoomSlice>> zoomSlices;
+	std::vector<uint32_t, mmap_allocator<uint32_t>> zoomOrderedPairs;
+	uint32_t emptySliceId;
 
-	mutable std::mutex mutex;
-	std::atomic<uint64_t> lookupsUncached;
 	std::atomic<uint64_t> lookups;
 };
 
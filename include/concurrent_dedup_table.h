@@ -0,0 +1,381 @@
+#ifndef CONCURRENT_DEDUP_TABLE_H
+#define CONCURRENT_DEDUP_TABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+
+// Calls T::hash()
+struct MemberHash {
+	template <class T>
+	size_t operator()(const T& value) const { return value.hash(); }
+};
+
+// A lock-free, insert-only set, which assigns each distinct entry a stable
+// 32-bit index. Like DequeMap, but safe to use from many threads at once.
+//
+// Entries live in an append-only arena of fixed-size chunks, so they never
+// move, and an entry's index is its position in the arena.
+//
+// They're found through a split-ordered list (Shalev & Shavit): all entries
+// sit in one linked list sorted by their bit-reversed hash, and buckets are
+// shortcuts into that list. Doubling the number of buckets doesn't move any
+// entries; new buckets are spliced into the list the first time they're
+// used. Since entries are never removed, every update is a single CAS.
+//
+// If two threads add the same entry at the same time, one of them may lose
+// the race after copying it into the arena. That copy is never returned by
+// add(), but it does use up an index, so indices can have (rare) gaps.
+template <class T, class Hash = MemberHash, class Equal = std::equal_to<T>>
+class ConcurrentDedupTable {
+public:
+	// maxSize = 0 means unbounded (up to 2^31 - 2 entries)
+	ConcurrentDedupTable(uint32_t maxSize = 0):
+		maxSize(maxSize == 0 ? MAX_SLOTS : maxSize),
+		allocatedSlots(0),
+		entries(0),
+		allocatedDummies(0),
+		bucketCount(INITIAL_BUCKETS),
+		slotChunks(new std::atomic<Slot*>[slotChunkCount(this->maxSize)]),
+		dummyChunks(new std::atomic<Dummy*>[MAX_DUMMY_CHUNKS]),
+		bucketSegments(new std::atomic<std::atomic<uint32_t>*>[MAX_BUCKET_SEGMENTS])
+	{
+		for (size_t i = 0; i < slotChunkCount(this->maxSize); i++) slotChunks[i] = nullptr;
+		for (size_t i = 0; i < MAX_DUMMY_CHUNKS; i++) dummyChunks[i] = nullptr;
+		for (size_t i = 0; i < MAX_BUCKET_SEGMENTS; i++) bucketSegments[i] = nullptr;
+
+		// Bucket 0 is the head of the list
+		const uint32_t head = allocateDummy(0);
+		bucket(0).store(head, std::memory_order_release);
+	}
+
+	ConcurrentDedupTable(const ConcurrentDedupTable&) = delete;
+	ConcurrentDedupTable& operator=(const ConcurrentDedupTable&) = delete;
+
+	~ConcurrentDedupTable() {
+		const uint32_t n = allocated();
+		for (uint32_t i = 0; i < n; i++)
+			slot(i).value.~T();
+		for (size_t i = 0; i < slotChunkCount(maxSize); i++)
+			::operator delete(slotChunks[i].load());
+		for (size_t i = 0; i < MAX_DUMMY_CHUNKS; i++)
+			delete[] dummyChunks[i].load();
+		for (size_t i = 0; i < MAX_BUCKET_SEGMENTS; i++)
+			delete[] bucketSegments[i].load();
+	}
+
+	// If `entry` is already in the table, return its index. Otherwise, add it
+	// and return its new index, or -1 if the table is full.
+	//
+	// `prepare` is called on the table's copy of a new entry before other
+	// threads can see it.
+	template <class Prepare>
+	int32_t add(const T& entry, Prepare prepare) {
+		const uint32_t h = hash32(entry);
+		const uint32_t key = regularKey(h);
+		uint32_t prev = bucketLink(h & (bucketCount.load(std::memory_order_acquire) - 1));
+		uint32_t newLink = 0;
+
+		while (true) {
+			uint32_t cur = 0;
+			const int32_t existing = search(prev, cur, key, entry);
+			if (existing >= 0)
+				return existing;
+
+			if (newLink == 0) {
+				const uint32_t index = allocateSlot();
+				if (index == NONE) return -1;
+
+				Slot& s = slot(index);
+				new (&s.value) T(entry);
+				prepare(s.value);
+				s.key = key;
+				newLink = index + 1;
+			}
+
+			slot(newLink - 1).next.store(cur, std::memory_order_relaxed);
+			if (next(prev).compare_exchange_strong(cur, newLink, std::memory_order_release, std::memory_order_relaxed)) {
+				grow(entries.fetch_add(1, std::memory_order_relaxed) + 1);
+				return newLink - 1;
+			}
+
+			// Someone else inserted after `prev`: search again from there.
+		}
+	}
+
+	int32_t add(const T& entry) {
+		return add(entry, [](T&) {});
+	}
+
+	// Copy `entry` to the next index without linking it into the list, like
+	// an add() that lost its race: it can be read by index, but find() and
+	// add() never return it. Used to restore a table with its gaps. Returns
+	// the index, or -1 if the table is full.
+	template <class Prepare>
+	int32_t addUnlisted(const T& entry, Prepare prepare) {
+		const uint32_t index = allocateSlot();
+		if (index == NONE) return -1;
+
+		Slot& s = slot(index);
+		new (&s.value) T(entry);
+		prepare(s.value);
+		s.key = regularKey(hash32(entry));
+		return index;
+	}
+
+	// Returns the index of `entry` if present, -1 otherwise.
+	int32_t find(const T& entry) const {
+		const uint32_t h = hash32(entry);
+		uint32_t b = h & (bucketCount.load(std::memory_order_acquire) - 1);
+
+		// Start from the closest bucket that has been spliced into the list
+		uint32_t prev = 0;
+		while ((prev = bucketIfInitialized(b)) == 0)
+			b = parentBucket(b);
+
+		uint32_t cur = 0;
+		return search(prev, cur, regularKey(h), entry);
+	}
+
+	inline const T& operator[](uint32_t index) const {
+		return slot(index).value;
+	}
+
+	inline const T& at(uint32_t index) const {
+		if (index >= allocated())
+			throw std::out_of_range("ConcurrentDedupTable index out of range");
+		return slot(index).value;
+	}
+
+	// Number of distinct entries
+	size_t size() const { return entries.load(std::memory_order_relaxed); }
+
+	// Number of indices used, including any gaps
+	uint32_t allocated() const {
+		const uint32_t n = allocatedSlots.load(std::memory_order_acquire);
+		return n > maxSize ? maxSize : n;
+	}
+
+	bool full() const {
+		return allocatedSlots.load(std::memory_order_relaxed) >= maxSize;
+	}
+
+private:
+	struct Slot {
+		T value;
+		uint32_t key;
+		std::atomic<uint32_t> next;
+	};
+
+	struct Dummy {
+		uint32_t key;
+		std::atomic<uint32_t> next;
+	};
+
+	// Links are 0 for the end of the list, DUMMY_BIT | (dummy index + 1) for
+	// a bucket's dummy node, and (slot index + 1) for an entry.
+	static constexpr uint32_t DUMMY_BIT = 1u << 31;
+	static constexpr uint32_t NONE = ~0u;
+	static constexpr uint32_t MAX_SLOTS = DUMMY_BIT - 2;
+
+	static constexpr uint32_t CHUNK_BITS = 16;
+	static constexpr uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+	static constexpr uint32_t BUCKET_SEGMENT_BITS = 16;
+	static constexpr uint32_t MAX_BUCKET_SEGMENTS = 1024;
+	static constexpr uint32_t MAX_BUCKETS = MAX_BUCKET_SEGMENTS << BUCKET_SEGMENT_BITS;
+	static constexpr uint32_t MAX_DUMMY_CHUNKS = 2 * MAX_BUCKETS / CHUNK_SIZE;
+	static constexpr uint32_t INITIAL_BUCKETS = 16;
+	static constexpr uint32_t LOAD_FACTOR = 2;
+
+	static size_t slotChunkCount(uint32_t maxSize) {
+		return (size_t(maxSize) + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	}
+
+	static uint32_t reverseBits(uint32_t v) {
+		v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+		v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+		v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+		v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+		return (v >> 16) | (v << 16);
+	}
+
+	// Entries have odd keys, and buckets' dummy nodes even keys, so a bucket
+	// sorts before all the entries that hash into it.
+	static uint32_t regularKey(uint32_t h) { return reverseBits(h | DUMMY_BIT); }
+	static uint32_t dummyKey(uint32_t b) { return reverseBits(b); }
+
+	static uint32_t parentBucket(uint32_t b) {
+		uint32_t msb = 1u << 31;
+		while (msb != 0 && !(b & msb)) msb >>= 1;
+		return b & ~msb;
+	}
+
+	uint32_t hash32(const T& entry) const {
+		uint64_t h = hasher(entry);
+		// Mix down to 32 bits (the murmur3 finalizer)
+		uint32_t x = static_cast<uint32_t>(h ^ (h >> 32));
+		x ^= x >> 16;
+		x *= 0x85ebca6bu;
+		x ^= x >> 13;
+		x *= 0xc2b2ae35u;
+		x ^= x >> 16;
+		return x;
+	}
+
+	// Walk the list from `prev` past every node with a key <= `key`. Returns
+	// the index of an entry equal to `entry`, or -1, leaving prev/cur either
+	// side of where it should be inserted.
+	int32_t search(uint32_t& prev, uint32_t& cur, uint32_t key, const T& entry) const {
+		cur = next(prev).load(std::memory_order_acquire);
+		while (cur != 0) {
+			const uint32_t curKey = keyOf(cur);
+			if (curKey > key) break;
+			if (curKey == key && !(cur & DUMMY_BIT) && equal(slot(cur - 1).value, entry))
+				return cur - 1;
+			prev = cur;
+			cur = next(prev).load(std::memory_order_acquire);
+		}
+		return -1;
+	}
+
+	void grow(size_t n) {
+		uint32_t buckets = bucketCount.load(std::memory_order_relaxed);
+		if (n > size_t(buckets) * LOAD_FACTOR && buckets < MAX_BUCKETS)
+			bucketCount.compare_exchange_strong(buckets, buckets * 2, std::memory_order_release, std::memory_order_relaxed);
+	}
+
+	// ----	Buckets
+
+	std::atomic<uint32_t>& bucket(uint32_t b) {
+		std::atomic<std::atomic<uint32_t>*>& segmentPtr = bucketSegments[b >> BUCKET_SEGMENT_BITS];
+		std::atomic<uint32_t>* segment = segmentPtr.load(std::memory_order_acquire);
+		if (segment == nullptr) {
+			std::atomic<uint32_t>* newSegment = new std::atomic<uint32_t>[1u << BUCKET_SEGMENT_BITS];
+			for (size_t i = 0; i < (1u << BUCKET_SEGMENT_BITS); i++)
+				newSegment[i].store(0, std::memory_order_relaxed);
+			if (segmentPtr.compare_exchange_strong(segment, newSegment, std::memory_order_acq_rel))
+				segment = newSegment;
+			else
+				delete[] newSegment;
+		}
+		return segment[b & ((1u << BUCKET_SEGMENT_BITS) - 1)];
+	}
+
+	uint32_t bucketIfInitialized(uint32_t b) const {
+		const std::atomic<uint32_t>* segment = bucketSegments[b >> BUCKET_SEGMENT_BITS].load(std::memory_order_acquire);
+		if (segment == nullptr) return 0;
+		return segment[b & ((1u << BUCKET_SEGMENT_BITS) - 1)].load(std::memory_order_acquire);
+	}
+
+	// The dummy node for bucket `b`, splicing it into the list if needed
+	uint32_t bucketLink(uint32_t b) {
+		std::atomic<uint32_t>& entry = bucket(b);
+		const uint32_t existing = entry.load(std::memory_order_acquire);
+		if (existing != 0) return existing;
+
+		uint32_t prev = bucketLink(parentBucket(b));
+		const uint32_t key = dummyKey(b);
+		uint32_t newLink = 0;
+		uint32_t result = 0;
+		while (result == 0) {
+			uint32_t cur = next(prev).load(std::memory_order_acquire);
+			while (cur != 0 && keyOf(cur) < key) {
+				prev = cur;
+				cur = next(prev).load(std::memory_order_acquire);
+			}
+
+			if (cur != 0 && keyOf(cur) == key) {
+				// Another thread has spliced in this bucket
+				result = cur;
+				break;
+			}
+
+			if (newLink == 0)
+				newLink = allocateDummy(key);
+			dummy(newLink).next.store(cur, std::memory_order_relaxed);
+			if (next(prev).compare_exchange_strong(cur, newLink, std::memory_order_release, std::memory_order_relaxed))
+				result = newLink;
+		}
+
+		entry.store(result, std::memory_order_release);
+		return result;
+	}
+
+	// ----	Arena
+
+	Slot& slot(uint32_t index) const {
+		return slotChunks[index >> CHUNK_BITS].load(std::memory_order_acquire)[index & (CHUNK_SIZE - 1)];
+	}
+
+	Dummy& dummy(uint32_t link) const {
+		const uint32_t index = (link & ~DUMMY_BIT) - 1;
+		return dummyChunks[index >> CHUNK_BITS].load(std::memory_order_acquire)[index & (CHUNK_SIZE - 1)];
+	}
+
+	uint32_t keyOf(uint32_t link) const {
+		return (link & DUMMY_BIT) ? dummy(link).key : slot(link - 1).key;
+	}
+
+	std::atomic<uint32_t>& next(uint32_t link) const {
+		return (link & DUMMY_BIT) ? dummy(link).next : slot(link - 1).next;
+	}
+
+	uint32_t allocateSlot() {
+		// Check first, so that a full table's counter doesn't keep growing
+		if (full()) return NONE;
+
+		const uint32_t index = allocatedSlots.fetch_add(1, std::memory_order_relaxed);
+		if (index >= maxSize)
+			return NONE;
+
+		std::atomic<Slot*>& chunkPtr = slotChunks[index >> CHUNK_BITS];
+		Slot* chunk = chunkPtr.load(std::memory_order_acquire);
+		if (chunk == nullptr) {
+			Slot* newChunk = static_cast<Slot*>(::operator new(sizeof(Slot) * CHUNK_SIZE));
+			for (size_t i = 0; i < CHUNK_SIZE; i++)
+				new (&newChunk[i].next) std::atomic<uint32_t>(0);
+			if (!chunkPtr.compare_exchange_strong(chunk, newChunk, std::memory_order_acq_rel))
+				::operator delete(newChunk);
+		}
+		return index;
+	}
+
+	uint32_t allocateDummy(uint32_t key) {
+		const uint32_t index = allocatedDummies.fetch_add(1, std::memory_order_relaxed);
+		if (index >= MAX_DUMMY_CHUNKS * CHUNK_SIZE)
+			throw std::out_of_range("ConcurrentDedupTable has too many buckets");
+
+		std::atomic<Dummy*>& chunkPtr = dummyChunks[index >> CHUNK_BITS];
+		Dummy* chunk = chunkPtr.load(std::memory_order_acquire);
+		if (chunk == nullptr) {
+			Dummy* newChunk = new Dummy[CHUNK_SIZE];
+			if (chunkPtr.compare_exchange_strong(chunk, newChunk, std::memory_order_acq_rel))
+				chunk = newChunk;
+			else
+				delete[] newChunk;
+		}
+
+		Dummy& d = chunk[index & (CHUNK_SIZE - 1)];
+		d.key = key;
+		d.next.store(0, std::memory_order_relaxed);
+		return DUMMY_BIT | (index + 1);
+	}
+
+	const uint32_t maxSize;
+	Hash hasher;
+	Equal equal;
+
+	std::atomic<uint32_t> allocatedSlots;
+	std::atomic<size_t> entries;
+	std::atomic<uint32_t> allocatedDummies;
+	std::atomic<uint32_t> bucketCount;
+
+	std::unique_ptr<std::atomic<Slot*>[]> slotChunks;
+	std::unique_ptr<std::atomic<Dummy*>[]> dummyChunks;
+	std::unique_ptr<std::atomic<std::atomic<uint32_t>*>[]> bucketSegments;
+};
+
+#endif
@@ -0,0 +1,114 @@
+/*! \file */
+#ifndef _INDEX_FILE_H
+#define _INDEX_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// A tile index saved with --save-index, and read back with --load-index so
+// that tiles can be rendered again without re-reading the .pbf.
+//
+// The file is a sequence of sections, each starting with a 4-character tag.
+// Arrays are written as a 64-bit count followed by the raw bytes of their
+// elements, so an index can only be read by the same build of tilemaker on
+// the same architecture; the version in the header guards against the rest.
+
+#define INDEX_FILE_VERSION 3
+
+class IndexFileWriter {
+public:
+	IndexFileWriter(const std::string& filename);
+
+	void section(const char* tag);
+
+	template<typename T> void write(const T& value) {
+		static_assert(std::is_trivially_copyable<T>::value, "IndexFileWriter can only write trivially copyable values");
+		writeBytes(&value, sizeof(T));
+	}
+
+	template<typename T> void writeValues(const T* values, size_t count) {
+		static_assert(std::is_trivially_copyable<T>::value, "IndexFileWriter can only write trivially copyable values");
+		writeBytes(values, count * sizeof(T));
+	}
+
+	// A contiguous container of trivially copyable values, and its size
+	template<typename Container> void writeArray(const Container& values) {
+		write<uint64_t>(values.size());
+		if (!values.empty())
+			writeValues(&values[0], values.size());
+	}
+
+	void writeString(const std::string& s);
+	void close();
+
+private:
+	void writeBytes(const void* data, size_t size);
+
+	std::string filename;
+	std::ofstream out;
+};
+
+class IndexFileReader {
+public:
+	IndexFileReader(const std::string& filename);
+
+	// Throws if the next section isn't `tag`
+	void section(const char* tag);
+
+	template<typename T> T read() {
+		static_assert(std::is_trivially_copyable<T>::value, "IndexFileReader can only read trivially copyable values");
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+		readBytes(&value, sizeof(T));
+		return *reinterpret_cast<const T*>(&value);
+	}
+
+	// Read `count` values, passing them to `f(const T* values, size_t n)` in
+	// batches. T needn't be default constructible.
+	template<typename T, typename F> void readBatches(uint64_t count, F f) {
+		static_assert(std::is_trivially_copyable<T>::value, "IndexFileReader can only read trivially copyable values");
+		std::vector<typename std::aligned_storage<sizeof(T), alignof(T)>::type> buffer(std::min<uint64_t>(count, 8192));
+		while (count > 0) {
+			const size_t n = std::min<uint64_t>(count, buffer.size());
+			readBytes(buffer.data(), n * sizeof(T));
+			f(reinterpret_cast<const T*>(buffer.data()), n);
+			count -= n;
+		}
+	}
+
+	template<typename T, typename Allocator> void readArray(std::vector<T, Allocator>& values) {
+		const uint64_t count = read<uint64_t>();
+		values.clear();
+		values.reserve(count);
+		readBatches<T>(count, [&values](const T* batch, size_t n) {
+			values.insert(values.end(), batch, batch + n);
+		});
+	}
+
+	std::string readString();
+
+private:
+	void readBytes(void* data, size_t size);
+
+	std::string filename;
+	std::ifstream in;
+};
+
+// What tilemaker needs to know about an index before loading its contents
+struct IndexFileHeader {
+	bool hasClippingBox;
+	double minLon, minLat, maxLon, maxLat;
+	unsigned int indexZoom;
+	std::vector<std::string> layerNames;
+	// Each tile's objects are saved sorted by z_order in these directions
+	std::vector<bool> sortOrders;
+
+	void write(IndexFileWriter& writer) const;
+	void read(IndexFileReader& reader);
+};
+
+#endif //_INDEX_FILE_H
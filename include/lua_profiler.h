@@ -0,0 +1,72 @@
+/*! \file */
+#ifndef _LUA_PROFILER_H
+#define _LUA_PROFILER_H
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+struct lua_State;
+struct lua_Debug;
+
+// Profiler for Lua processing, enabled with --profile-lua.
+//
+// Each OsmLuaProcessing owns a LuaProfiler for its thread. It records:
+// - calls into Lua (node_function, way_function, ...) and how long they took
+// - calls from Lua into tilemaker (Layer, Attribute, FindIntersecting, ...)
+// - samples of the currently-executing Lua source line, via a count hook
+//
+// When a LuaProfiler is destroyed (typically when its worker thread exits),
+// its stats are merged into a global profile, which report() prints. The
+// calling thread's profiler, which may still be alive, is merged first.
+//
+// Note that LuaJIT doesn't call count hooks from compiled traces, so line
+// samples there only cover interpreted code.
+
+struct LuaCallStats {
+	uint64_t calls = 0;
+	uint64_t nanoseconds = 0;
+};
+
+class LuaProfiler {
+public:
+	LuaProfiler();
+	~LuaProfiler();
+
+	static void enable();
+	static bool enabled();
+
+	// Install the sampling hook on a Lua state
+	void install(lua_State* L);
+
+	// Merge the calling thread's stats, and print the stats merged so far
+	static void report(std::ostream& out);
+
+	// Times a call, if profiling is enabled on this thread.
+	// `name` must be a string literal, as it's used as a key.
+	class Timer {
+	public:
+		Timer(const char* name, bool entryPoint = false);
+		~Timer();
+
+	private:
+		LuaProfiler* profiler;
+		const char* name;
+		bool entryPoint;
+		std::chrono::steady_clock::time_point start;
+	};
+
+private:
+	static void hook(lua_State* L, lua_Debug* ar);
+
+	// Add this profiler's stats to the global profile, and reset them
+	void flush();
+
+	std::unordered_map<const char*, LuaCallStats> entryPoints;
+	std::unordered_map<const char*, LuaCallStats> nativeCalls;
+	std::unordered_map<std::string, uint64_t> lineSamples;
+};
+
+#endif //_LUA_PROFILER_H
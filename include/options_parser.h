@@ -35,10 +35,13 @@ namespace OptionsParser {
 	struct Options {
 		std::vector<std::string> inputFiles;
 		std::string luaFile;
+		std::string rulesFile;
 		std::string jsonFile;
 		uint32_t threadNum = 0;
 		std::string outputFile;
 		std::string bbox;
+		std::string saveIndex;
+		std::string loadIndex;
 
 		OsmOptions osm;
 		bool showHelp = false;
@@ -46,6 +49,7 @@ namespace OptionsParser {
 		bool mergeSqlite = false;
 		OutputMode outputMode = OutputMode::File;
 		bool logTileTimings = false;
+		bool profileLua = false;
 	};
 
 	Options parse(const int argc, const char* argv[]);
@@ -14,12 +14,16 @@
 #include "osm_mem_tiles.h"
 #include "helpers.h"
 #include "pbf_reader.h"
+#include "lua_profiler.h"
+#include "tag_map.h"
 #include <protozero/data_view.hpp>
+#include <memory>
 
 #include <boost/container/flat_map.hpp>
 
-class TagMap;
 class SignificantTags;
+class TagRules;
+struct TagRule;
 
 // Lua
 extern "C" {
@@ -56,7 +60,8 @@ public:
 		const class ShpMemTiles &shpMemTiles, 
 		class OsmMemTiles &osmMemTiles,
 		AttributeStore &attributeStore,
-		bool materializeGeometries
+		bool materializeGeometries,
+		const TagRules* tagRules
 	);
 	~OsmLuaProcessing();
 
@@ -92,6 +97,31 @@ public:
 	/// \brief We are now processing a way
 	bool setWay(WayID wayId, LatpLonVec const &llVec, const TagMap& tags);
 
+	// Batch processing: node_batch_function/way_batch_function are called once
+	// per PrimitiveGroup, and select each object in turn before calling Layer etc.
+	struct BatchNode {
+		NodeID id;
+		LatpLon node;
+		const TagMap* tags;
+	};
+	struct BatchWay {
+		WayID id;
+		const LatpLonVec* llVec;
+		const TagMap* tags;
+	};
+	bool canProcessNodeBatches();
+	bool canProcessWayBatches();
+
+	/// \brief Process a group of significant nodes; emitted[i] is set if nodes[i] was output
+	void setNodeBatch(const std::vector<BatchNode>& nodes, std::vector<char>& emitted);
+
+	/// \brief Process a group of ways; emitted[i] is set if ways[i] needs to be kept in the way store
+	void setWayBatch(const std::vector<BatchWay>& ways, std::vector<char>& emitted);
+
+	// Called from Lua via the batch object
+	size_t BatchSize() const;
+	void SelectBatchObject(size_t index);
+
 	/** \brief We are now processing a relation
 	 * (note that we store relations as ways with artificial IDs, and that
 	 *  we use decrementing positive IDs to give a bit more space for way IDs)
@@ -116,32 +146,37 @@ public:
 
 	// Get an OSM tag for a given key (or return empty string if none)
 	const std::string Find(const std::string& key) const;
+	const std::string* findPostScanTag(const std::string& key) const;
 
 	// Check if an object has any tags
 	bool HasTags() const;
 
+	// Intern a tag key, for Key("highway")
+	uint32_t InternKey(const std::string& key) { return internedKeys.intern(key); }
+	const InternedTagKeys& getInternedKeys() const { return internedKeys; }
+
 	// ----	Spatial queries called from Lua
 
 	// Find intersecting shapefile layer
 	std::vector<std::string> FindIntersecting(const std::string &layerName);
 	double AreaIntersecting(const std::string &layerName);
 	bool Intersects(const std::string &layerName);
-	template <typename GeometryT> double intersectsArea(const std::string &layerName, GeometryT &geom) const;
-	template <typename GeometryT> std::vector<uint> intersectsQuery(const std::string &layerName, bool once, GeometryT &geom) const;
+	template <typename GeometryT> double intersectsArea(const std::string &layerName, GeometryT &geom);
+	template <typename GeometryT> std::vector<uint> intersectsQuery(const std::string &layerName, bool once, GeometryT &geom);
 
 	std::vector<std::string> FindCovering(const std::string &layerName);
 	bool CoveredBy(const std::string &layerName);
-	template <typename GeometryT> std::vector<uint> coveredQuery(const std::string &layerName, bool once, GeometryT &geom) const;
+	template <typename GeometryT> std::vector<uint> coveredQuery(const std::string &layerName, bool once, GeometryT &geom);
 		
 	// Returns whether it is closed polygon
 	bool IsClosed() const;
 
-	// Returns area
-	double Area();
+	// Returns area; Area("planar") uses a cheaper local approximation
+	double Area(kaguya::VariadicArgType mode);
 	double multiPolygonArea(const MultiPolygon &mp) const;
 
-	// Returns length
-	double Length();
+	// Returns length; Length("planar") uses a cheaper local approximation
+	double Length(kaguya::VariadicArgType mode);
 	
 	// Return centroid lat/lon
 	kaguya::optional<std::vector<double>> Centroid(kaguya::VariadicArgType algorithm);
@@ -151,6 +186,9 @@ public:
 	CentroidAlgorithm parseCentroidAlgorithm(const std::string& algorithm) const;
 	Point calculateCentroid(CentroidAlgorithm algorithm);
 
+	enum class MeasureMode: char { Geodesic = 0, Planar = 1 };
+	MeasureMode parseMeasureMode(kaguya::VariadicArgType mode) const;
+
 	enum class CorrectGeometryResult: char { Invalid = 0, Valid = 1, Corrected = 2 };
 	// ----	Requests from Lua to write this way/node to a vector tile's Layer
 	template<class GeometryT>
@@ -224,6 +262,16 @@ public:
 
 	const MultiPolygon &multiPolygonCached();
 
+	// ---- Cached measurements of the current object, shared by Lua calls and Layer/LayerAsCentroid
+
+	double areaCached(MeasureMode mode);
+
+	double lengthCached(MeasureMode mode);
+
+	Point centroidCached(CentroidAlgorithm algorithm);
+
+	const Box &bboxCached();
+
 	inline AttributeStore &getAttributeStore() { return attributeStore; }
 
 	struct luaProcessingException :std::exception {};
@@ -243,6 +291,10 @@ private:
 		multiLinestringInited = false;
 		polygonInited = false;
 		multiPolygonInited = false;
+		areaInited[0] = areaInited[1] = false;
+		lengthInited[0] = lengthInited[1] = false;
+		centroidInited[0] = centroidInited[1] = false;
+		bboxInited = false;
 		relationAccepted = false;
 		relationList.clear();
 		relationSubscript = -1;
@@ -254,6 +306,23 @@ private:
 
 	void removeAttributeIfNeeded(const std::string& key);
 
+	// setNode/setWay are split so that batches can select objects one at a time
+	void beginNode(NodeID id, LatpLon node, const TagMap& tags);
+	bool finishNode();
+	void beginWay(WayID wayId, LatpLonVec const &llVec, const TagMap& tags);
+	bool finishWay();
+	void prepareBatch(size_t size);
+	void beginBatchObject(size_t i);
+	void finishBatchObject();
+
+	// Apply --rules to the current object; returns true if Lua needn't be called
+	bool applyTagRules();
+	// Find the rules matching the current object, without outputting it;
+	// returns true if they handle it without Lua
+	bool matchTagRules();
+	// Output the current object as the matched rules say
+	void outputTagRules();
+
 	const inline Point getPoint() {
 		return Point(lon/10000000.0,latp/10000000.0);
 	}
@@ -261,10 +330,14 @@ private:
 	OSMStore &osmStore;	// global OSM store
 
 	kaguya::State luaState;
+	std::unique_ptr<LuaProfiler> profiler;	// only with --profile-lua
+	InternedTagKeys internedKeys;
 	bool supportsRemappingShapefiles;
 	bool supportsReadingRelations;
 	bool supportsPostScanRelations;
 	bool supportsWritingRelations;
+	bool supportsNodeBatches;
+	bool supportsWayBatches;
 	const class ShpMemTiles &shpMemTiles;
 	class OsmMemTiles &osmMemTiles;
 	AttributeStore &attributeStore;			// key/value store
@@ -290,6 +363,16 @@ private:
 	MultiPolygon multiPolygonCache;
 	bool multiPolygonInited;
 
+	// Indexed by MeasureMode/CentroidAlgorithm
+	double areaCache[2];
+	bool areaInited[2];
+	double lengthCache[2];
+	bool lengthInited[2];
+	Point centroidCache[2];
+	bool centroidInited[2];
+	Box bboxCache;
+	bool bboxInited;
+
 	NodeID lastStoredGeometryId;
 	OutputGeometryType lastStoredGeometryType;
 
@@ -306,6 +389,15 @@ private:
 
 	bool materializeGeometries;
 	bool wayEmitted;
+
+	const TagRules* tagRules;
+	std::vector<const TagRule*> matchedRules;
+
+	const std::vector<BatchNode>* nodeBatch = nullptr;
+	const std::vector<BatchWay>* wayBatch = nullptr;
+	std::vector<char>* batchEmitted = nullptr;
+	std::vector<size_t> batchIndices;	// objects visible to the batch function
+	int batchSelected = -1;				// index of the object selected by the batch function, or -1
 };
 
 #endif //_OSM_LUA_PROCESSING_H
@@ -49,6 +49,11 @@ public:
 
 	void Clear();
 
+	// Write the nodes and ways that objects read their geometry from to a
+	// tile index, or read them back into (empty) stores
+	void saveReferencedGeometries(IndexFileWriter& writer) const;
+	static void loadReferencedGeometries(IndexFileReader& reader, NodeStore& nodeStore, WayStore& wayStore, size_t threadNum);
+
 private:
 	void populateLinestring(Linestring& ls, NodeID objectID) const;
 	Linestring& getOrBuildLinestring(NodeID objectID) const;
@@ -6,6 +6,7 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <unordered_map>
 #include "geom.h"
 #include "coordinates.h"
 #include "attribute_store.h"
@@ -17,6 +18,19 @@ enum OutputGeometryType : unsigned int { POINT_, LINESTRING_, MULTILINESTRING_,
 //\brief Display the geometry type
 std::ostream& operator<<(std::ostream& os, OutputGeometryType geomType);
 
+/**
+ * \brief Key/value indices already added to one vtzero layer at one zoom level
+ *
+ * Features in a layer often share attribute sets, so writeAttributes resolves
+ * each set into vtzero's key/value table indices once per layer, rather than
+ * adding (and so hashing) every key and value string for every feature.
+*/
+struct LayerAttributeCache {
+	std::vector<vtzero::index_value> keys;										// by key index
+	std::unordered_map<const AttributePair*, vtzero::index_value> values;		// by pair
+	std::unordered_map<uint32_t, std::vector<vtzero::index_value_pair>> sets;	// by zoom slice ID
+};
+
 /**
  * \brief OutputObject - any object (node, linestring, polygon) to be outputted to tiles
 */
@@ -73,6 +87,8 @@ public:
 
 	void writeAttributes(
 		const AttributeStore& attributeStore,
+		vtzero::layer_builder& vtLayer,
+		LayerAttributeCache& cache,
 		vtzero::feature_builder& fbuilder,
 		char zoom
 	) const;
@@ -91,4 +107,33 @@ struct OutputObjectID {
 bool operator==(const OutputObject& x, const OutputObject& y);
 bool operator==(const OutputObjectID& x, const OutputObjectID& y);
 
+/**
+ * \brief The order in which objects are written to a tile
+ *
+ * Lexicographic, by layer, z_order (ascending or descending as set for the
+ * layer in sortOrders), geomType, attributes and objectID. Attributes come
+ * before objectID so that objects with identical attributes are adjacent,
+ * and can be merged into one feature.
+*/
+struct OutputObjectOrder {
+	const std::vector<bool>& sortOrders;
+
+	bool operator()(const OutputObject& x, const OutputObject& y) const {
+		if (x.layer < y.layer) return true;
+		if (x.layer > y.layer) return false;
+		if (x.z_order < y.z_order) return  sortOrders[x.layer];
+		if (x.z_order > y.z_order) return !sortOrders[x.layer];
+		if (x.geomType < y.geomType) return true;
+		if (x.geomType > y.geomType) return false;
+		if (x.attributes < y.attributes) return true;
+		if (x.attributes > y.attributes) return false;
+		if (x.objectID < y.objectID) return true;
+		return false;
+	}
+
+	bool operator()(const OutputObjectID& x, const OutputObjectID& y) const {
+		return (*this)(x.oo, y.oo);
+	}
+};
+
 #endif //_OUTPUT_OBJECT_H
@@ -67,14 +67,23 @@ public:
 
 	// Read tags into a map from a way/node/relation
 	template<typename T>
-	void readTags(T &pbfObject, PbfReader::PrimitiveBlock const &pb, TagMap& tags) {
+	void readTags(T &pbfObject, PbfReader::PrimitiveBlock const &pb, const BlockInternedKeys& internedKeys, TagMap& tags) {
+		tags.useInternedKeys(internedKeys.keyCount());
 		for (uint n=0; n < pbfObject.keys.size(); n++) {
 			auto keyIndex = pbfObject.keys[n];
 			auto valueIndex = pbfObject.vals[n];
-			tags.addTag(pb.stringTable[keyIndex], pb.stringTable[valueIndex]);
+			tags.addTag(pb.stringTable[keyIndex], pb.stringTable[valueIndex], internedKeys.keyHash(keyIndex), internedKeys[keyIndex]);
 		}
 	}
 
+	// Filter an object on its string table indices, without building a TagMap
+	template<class T>
+	static bool tagsSignificant(const T &pbfObject, const BlockSignificantTags& significantTags) {
+		return significantTags.anyPossible() && significantTags.filter(pbfObject.keys.size(), [&](size_t n) {
+			return std::make_pair(pbfObject.keys[n], pbfObject.vals[n]);
+		});
+	}
+
 private:
 	bool ReadBlock(
 		std::istream &infile,
@@ -87,18 +96,18 @@ private:
 		uint shard,
 		uint effectiveShard
 	);
-	bool ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const SignificantTags& nodeKeys);
+	bool ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const BlockSignificantTags& nodeKeys);
 
 	bool ReadWays(
 		OsmLuaProcessing& output,
 		PbfReader::PrimitiveGroup& pg,
 		const PbfReader::PrimitiveBlock& pb,
-		const SignificantTags& wayKeys,
+		const BlockSignificantTags& wayKeys,
 		bool locationsOnWays,
 		uint shard,
 		uint effectiveShards
 	);
-	bool ScanWays(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const SignificantTags& wayKeys);
+	bool ScanWays(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const BlockSignificantTags& wayKeys);
 	bool ScanRelations(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const SignificantTags& wayKeys);
 	bool ReadRelations(
 		OsmLuaProcessing& output,
@@ -19,7 +19,9 @@
 // strings of size 24 or less fit in 15 bytes.)
 //
 // If it needs to allocate memory, it does so from a shared pool. It is unable
-// to free the memory once allocated.
+// to free the memory once allocated. Each thread allocates from its own 64K
+// table, and strings longer than 15 bytes are deduplicated, so equal long
+// strings share storage.
 
 // PooledString has one of three modes:
 // - [126:127] = 00: small-string, length is in [120:125], lower 15 bytes are string
@@ -54,6 +56,9 @@ namespace PooledStringNS {
       void ensureStringIsOwned();
 
     private:
+      // Copy into this thread's table, as a pooled string
+      void allocate(const char* str, size_t size);
+
       // 0..3 is index into table, 4..5 is offset, 6..7 is length
       uint8_t storage[16];
   };
@@ -0,0 +1,70 @@
+/*! \file */
+#ifndef _SHAPE_CELL_INDEX_H
+#define _SHAPE_CELL_INDEX_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "geom.h"
+
+// Grid classification of indexed polygons (from shapefiles/GeoJSON), used to
+// answer Intersects/CoveredBy/FindIntersecting/FindCovering queries.
+//
+// Each polygon is classified against the tile grid with a quadtree: cells
+// wholly covered by the polygon are stored as Inside at the coarsest zoom
+// where that holds, and cells crossed by its edges are stored as Boundary at
+// the index zoom. Cells not stored are outside the polygon.
+//
+// A geometry that lies within a single index-zoom cell then intersects, and is
+// covered by, every polygon that the cell is Inside; only Boundary polygons
+// need an exact test.
+//
+// Coordinates are (lon, latp), as used by ShpMemTiles.
+
+class ShapeCellIndex {
+public:
+	enum class CellState : char { Boundary = 0, Inside = 1 };
+
+	struct Cell {
+		uint8_t z;
+		uint32_t x;
+		uint32_t y;
+		CellState state;
+	};
+
+	ShapeCellIndex(unsigned int zoom);
+
+	// Classify a polygon. This doesn't modify the index, so can run
+	// concurrently; add the result with add(). May throw if boost::geometry
+	// can't process the polygon.
+	std::vector<Cell> classify(const MultiPolygon& mp) const;
+	void add(uint id, const std::vector<Cell>& cells);
+
+	// A shape that couldn't be classified (e.g. a linestring), and which
+	// must be found through the r-tree instead
+	void addUnclassified(uint id);
+	bool isUnclassified(uint id) const;
+	bool hasUnclassified() const { return !unclassified.empty(); }
+
+	// If the box lies within a single index-zoom cell, set x/y and return true
+	bool cellFor(const Box& box, uint32_t& x, uint32_t& y) const;
+
+	// Add the classified shapes that touch the index-zoom cell (x, y) to `out`
+	void shapesInCell(uint32_t x, uint32_t y, std::vector<std::pair<uint, CellState>>& out) const;
+
+	unsigned int zoom() const { return zoom_; }
+
+private:
+	static uint64_t cellKey(uint8_t z, uint32_t x, uint32_t y) {
+		return (uint64_t(z) << 58) | (uint64_t(x) << 29) | y;
+	}
+
+	void classifyCell(const MultiPolygon& mp, const Box& shapeBox, uint8_t z, uint32_t x, uint32_t y, std::vector<Cell>& out) const;
+
+	unsigned int zoom_;
+	uint32_t levels;	// bit z is set if any cell at zoom z is stored
+	std::unordered_map<uint64_t, std::vector<std::pair<uint, CellState>>> cells;
+	std::vector<uint> unclassified;		// sorted
+};
+
+#endif //_SHAPE_CELL_INDEX_H
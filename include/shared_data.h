@@ -62,6 +62,9 @@ public:
 			const std::string &indexName,
 			const std::string &writeTo);
 	std::vector<bool> getSortOrders();
+	// Each layer's feature limit at the zoom, or 0 if it has none there
+	std::vector<uint> getFeatureLimits(uint zoom) const;
+	std::vector<std::string> getLayerNames() const;
 	rapidjson::Value serialiseToJSONValue(rapidjson::Document::AllocatorType &allocator) const;
 	std::string serialiseToJSON() const;
 };
@@ -3,6 +3,7 @@
 #define _SHP_MEM_TILES
 
 #include "tile_data.h"
+#include "shape_cell_index.h"
 
 extern bool verbose;
 
@@ -35,6 +36,16 @@ public:
 		std::function<std::vector<IndexValue>(const RTree& rtree)> indexQuery, 
 		std::function<bool(const OutputObject& oo)> checkQuery
 	) const;
+
+	// Find shapes that intersect, or cover, a geometry with bounding box `box`.
+	// checkQuery is the exact test, and is only called for shapes which the
+	// layer's cell index can't decide.
+	std::vector<uint> QueryMatchingGeometries(
+		const std::string& layerName,
+		bool once,
+		Box& box,
+		std::function<bool(const OutputObject& oo)> checkQuery
+	) const;
 	bool mayIntersect(const std::string& layerName, const Box& box) const;
 	std::vector<std::string> namesOfGeometries(const std::vector<uint>& ids) const;
 
@@ -66,6 +77,7 @@ private:
 	std::map<uint, std::string> indexedGeometryNames;			//  | optional names for each one
 	std::map<std::string, RTree> indices;			// Spatial indices, boost::geometry::index objects for shapefile indices
 	std::mutex indexMutex;
+	std::map<std::string, ShapeCellIndex> cellIndices;	// Inside/boundary classification of each shape at the index zoom
 	std::map<std::string, std::vector<bool>> bitIndices; // A bit it set if the z14 (or base zoom) tiles at x*width + y contains a shape. This lets us quickly reject negative Intersects queryes
 };
 
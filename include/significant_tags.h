@@ -1,8 +1,10 @@
 #ifndef SIGNIFICANT_TAGS_H
 #define SIGNIFICANT_TAGS_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <protozero/data_view.hpp>
 
 class TagMap;
 // Data structures to permit users to express filters on which nodes/ways
@@ -32,8 +34,70 @@ public:
 	bool enabled() const;
 
 private:
+	friend class BlockSignificantTags;
+
 	bool enabled_;
 	std::vector<TagFilter> filters;
+
+	// Sorted lookups used to resolve the filters against a string table
+	std::vector<std::string> anyValueKeys;		// keys of filters with no value
+	std::vector<std::string> valueKeys;			// keys of filters with a value
+	std::vector<std::string> filterValues;		// values of filters
+};
+
+// SignificantTags resolved against a PBF block's string table, so that
+// objects can be filtered by comparing string indices rather than strings.
+//
+// resolve() is called once per block; the buffers are reused between blocks.
+class BlockSignificantTags {
+public:
+	void resolve(const SignificantTags& tags, const std::vector<protozero::data_view>& stringTable);
+
+	// Could any object in this block pass the filter? Only filters that
+	// accept on a match can rule out a block.
+	bool anyPossible() const {
+		return !enabled || (!filtersEmpty && (!accept || hasSignificantKey));
+	}
+
+	// Does the tag with these string table indices match any filter?
+	bool tagMatches(uint32_t key, uint32_t value) const {
+		const uint8_t flags = keyFlags[key];
+		if (flags & ANY_VALUE) return true;
+		if ((flags & HAS_VALUES) && (keyFlags[value] & IS_VALUE))
+			return matchesValue(key, value);
+		return false;
+	}
+
+	// As SignificantTags::filter. `tag(i)` returns the i'th tag's (key, value)
+	// string table indices.
+	template<typename TagAccessor>
+	bool filter(size_t count, TagAccessor tag) const {
+		if (!enabled) return true;
+		if (filtersEmpty) return false;
+
+		for (size_t i = 0; i < count; i++) {
+			const std::pair<uint32_t, uint32_t> kv = tag(i);
+			// Accept filters: there must be at least one tag matched by the filters.
+			// Reject filters: there must be at least one tag not matched by any filters.
+			if (tagMatches(kv.first, kv.second) == accept)
+				return true;
+		}
+		return false;
+	}
+
+private:
+	enum : uint8_t { ANY_VALUE = 1, HAS_VALUES = 2, IS_VALUE = 4 };
+
+	bool matchesValue(uint32_t key, uint32_t value) const;
+
+	bool enabled = false;
+	bool filtersEmpty = false;
+	bool accept = true;
+	bool hasSignificantKey = false;
+	std::vector<uint8_t> keyFlags;
+	std::vector<uint64_t> valuePairs;		// key << 32 | value, sorted
+	std::vector<uint32_t> valueKeyIndices;
+	std::vector<uint32_t> valueIndices;
 };
 
 #endif
@@ -10,7 +10,8 @@
 // doing Lua interop.
 //
 // The alternative is a std::map - but often, our map is quite small.
-// It's preferable to have a small set of vectors and do linear search.
+// It's preferable to keep the tags in vectors, found through a small
+// open-addressing index that is rebuilt cheaply for each object.
 //
 // Further, we can avoid passing std::string from Lua -> C++ in some cases
 // by first checking to see if the string we would have passed is already
@@ -28,6 +29,48 @@ struct Tag {
 	protozero::data_view value;
 };
 
+// Tag keys that Lua code has interned with Key("highway"), numbered from 0 in
+// the order they were interned. Each OsmLuaProcessing has its own.
+class InternedTagKeys {
+public:
+	uint32_t intern(const std::string& key);
+	size_t size() const { return keys.size(); }
+	const std::string& operator[](uint32_t id) const { return keys[id]; }
+
+	// Return -1 if key isn't interned, else its ID.
+	int32_t find(const protozero::data_view& key) const;
+
+private:
+	std::vector<std::string> keys;		// by ID
+	std::vector<uint32_t> sorted;		// IDs, sorted by key
+};
+
+// InternedTagKeys resolved against a PBF block's string table, so that tags
+// can be added to a TagMap with their interned key ID. Also remembers the
+// TagMap hash of each string used as a key, so that it's only computed once
+// per block, not once per tag.
+//
+// resolve() is called once per block; the buffers are reused between blocks.
+class BlockInternedKeys {
+public:
+	void resolve(const InternedTagKeys& keys, const std::vector<protozero::data_view>& stringTable);
+
+	// Return -1 if the string isn't an interned key, else its ID.
+	int32_t operator[](uint32_t stringIndex) const { return keyCount_ == 0 ? -1 : ids[stringIndex]; }
+
+	// Keys interned when the block was resolved; later keys aren't in `ids`
+	uint32_t keyCount() const { return keyCount_; }
+
+	// TagMap::hashKey of a string in the block
+	uint32_t keyHash(uint32_t stringIndex) const;
+
+private:
+	std::vector<int32_t> ids;
+	uint32_t keyCount_ = 0;
+	const std::vector<protozero::data_view>* stringTable = nullptr;
+	mutable std::vector<uint32_t> hashes;		// 0 until computed
+};
+
 class TagMap {
 public:
 	TagMap();
@@ -36,9 +79,20 @@ public:
 	bool empty() const;
 	void addTag(const protozero::data_view& key, const protozero::data_view& value);
 
+	// Tags added after this (and before the next reset) must be added with
+	// their ID among the first `count` interned keys, or -1 if none.
+	void useInternedKeys(uint32_t count);
+
+	// As addTag, with the key's hashKey() already computed
+	void addTag(const protozero::data_view& key, const protozero::data_view& value, uint32_t keyHash, int32_t internedKey = -1);
+
 	// Return -1 if key not found, else return its keyLoc.
 	int64_t getKey(const char* key, size_t size) const;
 
+	// As getKey, for an interned key. This is an array lookup if the tags
+	// were added with interned key IDs, else a search by the key's string.
+	int64_t getInternedKey(uint32_t id, const InternedTagKeys& keys) const;
+
 	// Return -1 if value not found, else return its keyLoc.
 	int64_t getValue(const char* key, size_t size) const;
 
@@ -47,9 +101,11 @@ public:
 
 	boost::container::flat_map<std::string, std::string> exportToBoostMap() const;
 
+	// The hash used to find keys; never 0
+	static uint32_t hashKey(const char* key, size_t size);
+
 	struct Iterator {
 		const TagMap& map;
-		size_t shard = 0;
 		size_t offset = 0;
 
 		bool operator!=(const Iterator& other) const;
@@ -61,15 +117,26 @@ public:
 	Iterator end() const;
 
 private:
-	uint32_t ensureString(
-		std::vector<std::vector<const protozero::data_view*>>& vector,
-		const protozero::data_view& value
-	);
+	// A slot in the open-addressing index of keys. Candidates are compared
+	// by hash, then by their first 8 bytes as one word, before memcmp.
+	struct Slot {
+		uint32_t hash;		// 0 if empty
+		uint32_t keyLoc;
+		uint64_t prefix;
+	};
+
+	static uint64_t keyPrefix(const char* key, size_t size);
+	size_t findSlot(const char* key, size_t size, uint32_t hash) const;
+	void growIndex();
 
+	// keyLoc is the position in keys/values
+	std::vector<const protozero::data_view*> keys;
+	std::vector<const protozero::data_view*> values;
+	std::vector<Slot> index;
 
-	std::vector<std::vector<const protozero::data_view*>> keys;
-	std::vector<std::vector<uint32_t>> key2value;
-	std::vector<std::vector<const protozero::data_view*>> values;
+	uint32_t internedKeyCount;
+	std::vector<int32_t> internedKeyLocs;		// by interned key ID, -1 if absent
+	std::vector<uint32_t> internedKeysAdded;	// to clear internedKeyLocs on reset
 };
 
 #endif _TAG_MAP_H
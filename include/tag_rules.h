@@ -0,0 +1,77 @@
+/*! \file */
+#ifndef _TAG_RULES_H
+#define _TAG_RULES_H
+
+#include <string>
+#include <vector>
+
+class TagMap;
+
+// Declarative tag->layer rules, read from a JSON file given with --rules.
+//
+// Rules are evaluated natively against each node/way's tags before Lua is
+// called. If an object matches at least one rule, and none of its matching
+// rules ask for Lua (`"call_lua": true`), the Lua node/way function isn't
+// called for it at all.
+//
+//   { "rules": [
+//     { "match": { "highway": ["motorway", "trunk"] },
+//       "objects": ["way"],
+//       "layer": "transportation", "minzoom": 4,
+//       "attributes": { "class": "$highway", "oneway": { "value": true, "minzoom": 12 } } }
+//   ] }
+//
+// `match` maps a key to a value, a list of values, `true` (key present with
+// any value) or `false` (key absent). Attribute values starting with `$` copy
+// the value of that tag.
+
+struct TagRuleCondition {
+	std::string key;
+	bool present;						// false: the key must be absent
+	std::vector<std::string> values;	// empty: any value
+};
+
+struct TagRuleAttribute {
+	enum class Type: char { String = 0, Tag = 1, Number = 2, Boolean = 3 };
+
+	std::string key;
+	Type type;
+	std::string stringValue;			// for String; the tag key for Tag
+	double numberValue;
+	bool booleanValue;
+	char minzoom;
+};
+
+struct TagRule {
+	std::vector<TagRuleCondition> match;
+	bool nodes;
+	bool ways;
+	std::string layer;
+	bool area;
+	double minzoom;						// <0 if not set
+	double zorder;
+	bool hasZOrder;
+	std::vector<TagRuleAttribute> attributes;
+	bool callLua;
+};
+
+class TagRules {
+public:
+	TagRules();
+
+	void load(const std::string& filename);
+	void parse(const std::string& json);
+
+	bool empty() const { return rules.empty(); }
+	const std::vector<TagRule>& getRules() const { return rules; }
+
+	// Add the rules matching an object's tags to `out`, in file order
+	void matching(const TagMap& tags, bool isWay, std::vector<const TagRule*>& out) const;
+
+	static bool matches(const TagRule& rule, const TagMap& tags);
+
+private:
+	std::vector<TagRule> rules;
+};
+
+#endif //_TAG_RULES_H
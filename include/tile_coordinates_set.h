@@ -2,6 +2,11 @@
 #define TILE_COORDINATES_SET_H
 
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
 #include "coordinates.h"
 
 // Interface representing a bitmap of tiles of interest at a given zoom.
@@ -11,6 +16,11 @@ public:
 	virtual void set(TileCoordinate x, TileCoordinate y) = 0;
 	virtual size_t size() const = 0;
 	virtual size_t zoom() const = 0;
+
+	// Call f(x, y) for each tile in the set whose x is in [minX, maxX), in
+	// order of x then y. Sets aren't modified while this runs, so disjoint
+	// row bands can be visited from different threads.
+	virtual void forEach(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const = 0;
 };
 
 // Read-write implementation for precise sets; maximum zoom is
@@ -22,10 +32,54 @@ public:
 	size_t size() const override;
 	size_t zoom() const override;
 	void set(TileCoordinate x, TileCoordinate y) override;
+	void forEach(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const override;
 
 private:
+	// One bit per tile, x-major, so that each row of the set is a run of
+	// whole words from z6 upwards
+	unsigned int zoom_;
+	std::vector<uint64_t> tiles;
+};
+
+// Read-write implementation for high zooms (up to z20). Like a lossy set,
+// every tile under a tile of `covered` (a set at a lower zoom) is in the set;
+// tiles can also be set individually, e.g. for points, and use memory in
+// proportion to their number rather than to the zoom.
+//
+// Individual tiles are grouped into blocks of 256x256. Like a roaring bitmap,
+// a block holds a sorted array of its tiles while it has few of them, and
+// becomes a bitmap once it has enough that the bitmap is smaller.
+class SparseTileCoordinatesSet : public TileCoordinatesSet {
+public:
+	SparseTileCoordinatesSet(unsigned int zoom, const TileCoordinatesSet& covered);
+	bool test(TileCoordinate x, TileCoordinate y) const override;
+	size_t size() const override;
+	size_t zoom() const override;
+	void set(TileCoordinate x, TileCoordinate y) override;
+	void forEach(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const override;
+
+private:
+	struct Block {
+		// Offsets of the tiles in the block, (x << 8) | y, while it's sparse
+		std::vector<uint16_t> offsets;
+		// 1024 words, once it's dense
+		std::vector<uint64_t> bitmap;
+
+		bool test(uint16_t offset) const;
+		void set(uint16_t offset);
+		size_t size() const;
+		void forEachInRow(TileCoordinate x, const std::function<void(TileCoordinate y)>& f) const;
+		void makeBitmap();
+	};
+
+	// The individually set tiles with x in [minX, maxX), in order
+	void forEachSet(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const;
+
 	unsigned int zoom_;
-	std::vector<bool> tiles;
+	const TileCoordinatesSet& covered;
+	unsigned int scale;
+	// By block x, then block y, so rows of blocks are adjacent
+	std::map<std::pair<TileCoordinate, TileCoordinate>, Block> blocks;
 };
 
 // Read-only implementation for a lossy set. Used when zoom is
@@ -37,6 +91,7 @@ public:
 	size_t size() const override;
 	size_t zoom() const override;
 	void set(TileCoordinate x, TileCoordinate y) override;
+	void forEach(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const override;
 
 private:
 	unsigned int zoom_;
@@ -44,4 +99,50 @@ private:
 	unsigned int scale;
 };
 
+// Walks the tiles to be written, in the order they should be written:
+// breadth-first below clusterZoom, then depth-first (parent before children,
+// x before y) within each clusterZoom tile, so that tiles sharing a cluster
+// are written together.
+//
+// Tiles are generated one at a time as the walk proceeds, so nothing is
+// materialized. `zooms` must have a set for each zoom up to endZoom, in which
+// every set tile's parent is also set; includeTile must likewise exclude all
+// children of a tile it excludes. Subtrees are skipped on that basis.
+class TileEnumerator {
+public:
+	using IncludeTile = std::function<bool(unsigned int zoom, TileCoordinate x, TileCoordinate y)>;
+
+	TileEnumerator(
+		const std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+		unsigned int clusterZoom,
+		unsigned int startZoom,
+		unsigned int endZoom,
+		IncludeTile includeTile
+	);
+
+	// Returns false once all tiles have been generated
+	bool next(unsigned int& zoom, TileCoordinates& coordinates);
+
+private:
+	struct Frame {
+		unsigned int zoom;
+		TileCoordinate x, y;
+		unsigned int child;
+	};
+
+	bool visible(unsigned int zoom, TileCoordinate x, TileCoordinate y) const;
+
+	const std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms;
+	const unsigned int clusterZoom, startZoom, endZoom;
+	const IncludeTile includeTile;
+
+	// Position of the breadth-first walk below clusterZoom
+	unsigned int lowZoom;
+	uint64_t lowIndex;
+
+	// Position of the depth-first walk
+	uint64_t clusterIndex;
+	std::vector<Frame> stack;
+};
+
 #endif
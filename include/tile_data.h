@@ -7,6 +7,8 @@
 #include <vector>
 #include <memory>
 #include <boost/sort/sort.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
 #include "output_object.h"
 #include "append_vector.h"
 #include "clip_cache.h"
@@ -18,6 +20,8 @@
 typedef std::vector<class TileDataSource *> SourceList;
 
 class TileBbox;
+class IndexFileWriter;
+class IndexFileReader;
 
 // We cluster output objects by z6 tile
 #define CLUSTER_ZOOM 6
@@ -39,109 +43,290 @@ class TileBbox;
 // out the false positives.
 typedef uint8_t Z6Offset;
 
-struct OutputObjectXY {
-	OutputObject oo;
-	Z6Offset x;
-	Z6Offset y;
+// An object's x/y offset within its z6 tile, as a Morton code: the bits of x
+// and y interleaved, x first, from the most significant down.
+//
+// Sorting by this code clusters objects by their parent tile at every zoom
+// from z6 to the index zoom, so the objects in any tile at zoom 6 or higher
+// form one contiguous run of codes (see z6TileRange).
+typedef uint16_t Z6XY;
+
+inline uint16_t spreadZ6Bits(uint16_t v) {
+	v = (v | (v << 4)) & 0x0f0f;
+	v = (v | (v << 2)) & 0x3333;
+	v = (v | (v << 1)) & 0x5555;
+	return v;
+}
+
+inline uint16_t compactZ6Bits(uint16_t v) {
+	v &= 0x5555;
+	v = (v | (v >> 1)) & 0x3333;
+	v = (v | (v >> 2)) & 0x0f0f;
+	v = (v | (v >> 4)) & 0x00ff;
+	return v;
+}
+
+inline Z6XY packZ6XY(Z6Offset x, Z6Offset y) { return (spreadZ6Bits(x) << 1) | spreadZ6Bits(y); }
+inline Z6Offset z6X(Z6XY xy) { return compactZ6Bits(xy >> 1); }
+inline Z6Offset z6Y(Z6XY xy) { return compactZ6Bits(xy); }
+
+// The codes [first, last) of the objects in the tile whose top-left offset is
+// (x, y), and which spans `width` index-zoom tiles (a power of two)
+inline void z6TileRange(Z6Offset x, Z6Offset y, uint32_t width, uint32_t& first, uint32_t& last) {
+	first = packZ6XY(x, y);
+	last = first + width * width;
+}
+
+// Payloads are OutputObject, or OutputObjectID when IDs are included
+inline const OutputObject& payloadObject(const OutputObject& oo) { return oo; }
+inline const OutputObject& payloadObject(const OutputObjectID& oo) { return oo.oo; }
+
+inline OutputObjectID outputObjectWithId(const OutputObject& oo) { return OutputObjectID({ oo, 0 }); }
+inline OutputObjectID outputObjectWithId(const OutputObjectID& oo) { return oo; }
+
+// The output objects in one z6 tile, held as two parallel arrays: the packed
+// x/y keys, and the OutputObject (or OutputObjectID) payloads. Sorting and
+// searching only need the keys, so they touch 2 bytes per object rather than
+// the whole record - which matters when the payloads have spilled to disk.
+template<typename OO> struct Z6Objects {
+	AppendVectorNS::AppendVector<Z6XY> xy;
+	AppendVectorNS::AppendVector<OO> payloads;
+
+	size_t size() const { return xy.size(); }
+
+	void push_back(Z6XY key, const OO& payload) {
+		xy.push_back(key);
+		payloads.push_back(payload);
+	}
+
+	void clear() {
+		xy.clear();
+		payloads.clear();
+	}
+
+	// Sort both arrays by Morton code, and each code's objects by `less`, so
+	// that every base zoom tile's objects are a run in output order. The
+	// codes are sorted as a permutation, which is then applied to the
+	// payloads in place.
+	//
+	// With one thread, the codes are radix sorted a byte at a time, and then
+	// each code's objects sorted; with more, they're handed to a parallel
+	// comparison sort.
+	template<typename Compare> void sort(size_t threadNum, Compare less) {
+		const size_t n = size();
+		std::vector<Z6XY> keys(xy.begin(), xy.end());
+		std::vector<uint32_t> order(n);
+		for (size_t i = 0; i < n; i++)
+			order[i] = i;
+
+		if (threadNum > 1) {
+			boost::sort::block_indirect_sort(
+				order.begin(),
+				order.end(),
+				[&](uint32_t a, uint32_t b) {
+					if (keys[a] != keys[b])
+						return keys[a] < keys[b];
+					return less(payloads[a], payloads[b]);
+				},
+				threadNum
+			);
+		} else {
+			std::vector<uint32_t> scratch(n);
+			for (unsigned int shift = 0; shift < 16; shift += 8) {
+				size_t counts[257] = { 0 };
+				for (size_t i = 0; i < n; i++)
+					counts[((keys[order[i]] >> shift) & 0xff) + 1]++;
+
+				// Already in order by this byte if every code shares it
+				if (std::find(counts + 1, counts + 257, n) != counts + 257)
+					continue;
+
+				for (size_t b = 1; b < 257; b++)
+					counts[b] += counts[b - 1];
+				for (size_t i = 0; i < n; i++)
+					scratch[counts[(keys[order[i]] >> shift) & 0xff]++] = order[i];
+				order.swap(scratch);
+			}
+
+			for (size_t start = 0, end = 0; start < n; start = end) {
+				while (end < n && keys[order[end]] == keys[order[start]])
+					end++;
+				if (end - start > 1)
+					std::sort(order.begin() + start, order.begin() + end, [&](uint32_t a, uint32_t b) {
+						return less(payloads[a], payloads[b]);
+					});
+			}
+		}
+
+		for (size_t i = 0; i < n; i++)
+			xy[i] = keys[order[i]];
+
+		// Follow each cycle of the permutation, so that each payload is
+		// read and written once, and no second copy of the array is needed.
+		for (size_t i = 0; i < n; i++) {
+			if (order[i] == i)
+				continue;
+
+			const OO first = payloads[i];
+			size_t j = i;
+			while (order[j] != i) {
+				const size_t next = order[j];
+				payloads[j] = payloads[next];
+				order[j] = j;
+				j = next;
+			}
+			payloads[j] = first;
+			order[j] = j;
+		}
+	}
 };
 
-struct OutputObjectXYID {
-	OutputObject oo;
-	Z6Offset x;
-	Z6Offset y;
-	uint64_t id;
+// The objects shown below CLUSTER_ZOOM, held in one array ordered by the
+// Morton code of their z6 tile. The z6 tiles within any z0-z5 tile have
+// consecutive codes, so each low-zoom tile's objects are one contiguous
+// range of the array, found from the per-z6 offsets. Each z6 tile's objects
+// are already sorted in output order when they're built.
+template<typename OO> struct LowZoomIndex {
+	std::vector<OO> objects;
+	std::vector<size_t> offsets;	// by z6 Morton code; CLUSTER_ZOOM_AREA + 1 entries
+
+	LowZoomIndex(): offsets(CLUSTER_ZOOM_AREA + 1, 0) {}
+
+	static uint16_t z6Code(size_t z6x, size_t z6y) {
+		return (spreadZ6Bits(z6x) << 1) | spreadZ6Bits(z6y);
+	}
+
+	// Build from the objects in each z6 tile, indexed by x*64 + y. When the
+	// index zoom is below z6, the objects are bucketed by their index zoom
+	// tile instead, and are placed at the code of its top-left z6 tile.
+	void build(std::vector<std::vector<OO>>& byZ6, unsigned int indexZoom) {
+		const unsigned int shift = indexZoom < CLUSTER_ZOOM ? CLUSTER_ZOOM - indexZoom : 0;
+		std::vector<size_t> tileAtCode(CLUSTER_ZOOM_AREA, byZ6.size());
+		size_t total = 0;
+		for (size_t i = 0; i < byZ6.size(); i++) {
+			if (byZ6[i].empty())
+				continue;
+			tileAtCode[z6Code((i / CLUSTER_ZOOM_WIDTH) << shift, (i % CLUSTER_ZOOM_WIDTH) << shift)] = i;
+			total += byZ6[i].size();
+		}
+
+		objects.clear();
+		objects.reserve(total);
+		for (size_t code = 0; code < CLUSTER_ZOOM_AREA; code++) {
+			offsets[code] = objects.size();
+			if (tileAtCode[code] == byZ6.size())
+				continue;
+			auto& tile = byZ6[tileAtCode[code]];
+			objects.insert(objects.end(), tile.begin(), tile.end());
+			std::vector<OO>().swap(tile);
+		}
+		offsets[CLUSTER_ZOOM_AREA] = objects.size();
+	}
+
+	// Append the tile's objects to output, starting a run for each z6 tile
+	void collect(unsigned int zoom, const TileCoordinates& dstIndex, std::vector<OutputObjectID>& output, std::vector<size_t>& runs) const {
+		if (zoom >= CLUSTER_ZOOM)
+			throw std::runtime_error("LowZoomIndex::collect should not be called for high zooms");
+		if (dstIndex.x >= (1u << zoom) || dstIndex.y >= (1u << zoom))
+			return;
+
+		const unsigned int shift = CLUSTER_ZOOM - zoom;
+		const size_t first = z6Code(dstIndex.x << shift, dstIndex.y << shift);
+		const size_t last = first + (1 << (2 * shift));
+		for (size_t code = first; code < last; code++) {
+			if (offsets[code] == offsets[code + 1])
+				continue;
+
+			runs.push_back(output.size());
+			for (size_t i = offsets[code]; i < offsets[code + 1]; i++)
+				if (payloadObject(objects[i]).minZoom <= zoom)
+					output.push_back(outputObjectWithId(objects[i]));
+		}
+	}
 };
 
 template<typename OO> void finalizeObjects(
 	const std::string& name,
 	const size_t& threadNum,
 	const unsigned int& indexZoom,
-	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator begin,
-	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator end,
-	typename std::vector<std::vector<OO>>& lowZoom
+	typename std::vector<Z6Objects<OO>>::iterator begin,
+	typename std::vector<Z6Objects<OO>>::iterator end,
+	LowZoomIndex<OO>& lowZoom,
+	const OutputObjectOrder& order
 	) {
-	size_t z6OffsetDivisor = indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1;
 #ifdef CLOCK_MONOTONIC
 	timespec startTs, endTs;
 	clock_gettime(CLOCK_MONOTONIC, &startTs);
 #endif
 
-	int i = -1;
+	// Work on the largest z6 tiles first, so that the last few tasks to
+	// finish are small ones.
+	size_t total = 0;
+	std::vector<size_t> populated;
 	for (auto it = begin; it != end; it++) {
-		i++;
-		if (it->size() > 0 || i % 10 == 0 || i == 4095) {
-			std::cout << "\r" << name << ": finalizing z6 tile " << (i + 1) << "/" << CLUSTER_ZOOM_AREA;
-
-#ifdef CLOCK_MONOTONIC
-			clock_gettime(CLOCK_MONOTONIC, &endTs);
-			uint64_t elapsedNs = 1e9 * (endTs.tv_sec - startTs.tv_sec) + endTs.tv_nsec - startTs.tv_nsec;
-			std::cout << " (" << std::to_string((uint32_t)(elapsedNs / 1e6)) << " ms)";
-#endif
-			std::cout << std::flush;
-		}
 		if (it->size() == 0)
 			continue;
+		total += it->size();
+		populated.push_back(it - begin);
+	}
+	std::sort(populated.begin(), populated.end(), [&begin](size_t a, size_t b) {
+		return begin[a].size() > begin[b].size();
+	});
+
+	std::vector<std::vector<OO>> lowZoomByZ6(end - begin);
+	std::mutex progressMutex;
+	size_t finalized = 0;
+	auto finalizeTile = [&](size_t i, size_t sortThreads) {
+		auto& tile = begin[i];
 
 		// We track a separate copy of low zoom objects to avoid scanning large
 		// lists of objects that may be on slow disk storage.
-		for (auto objectIt = it->begin(); objectIt != it->end(); objectIt++)
-			if (objectIt->oo.minZoom < CLUSTER_ZOOM)
-				lowZoom[i].push_back(*objectIt);
-
-		// If the user is doing a a small extract, there are few populated
-		// entries in `object`.
-		//
-		// e.g. Colorado has ~9 z6 tiles, 1 of which has 95% of its output
-		// objects.
-		//
-		// This optimizes for the small extract case by doing:
-		// - for each vector in objects
-		//   - do a multi-threaded sort of vector
-		//
-		// For small extracts, this ensures that all threads are used even if
-		// only a handful of entries in `objects` are non-empty.
-		//
-		// For a global extract, this will have some overhead of repeatedly
-		// setting up/tearing down threads. In that case, it would be 
-		// better to assign chunks of `objects` to each thread.
-		//
-		// That's a future performance improvement, so deferring for now.
-		boost::sort::block_indirect_sort(
-			it->begin(),
-			it->end(), 
-			[indexZoom](const OO& a, const OO& b) {
-				// Cluster by parent zoom, so that a subsequent search
-				// can find a contiguous range of entries for any tile
-				// at zoom 6 or higher.
-				const size_t aX = a.x;
-				const size_t aY = a.y;
-				const size_t bX = b.x;
-				const size_t bY = b.y;
-				for (size_t z = CLUSTER_ZOOM; z <= indexZoom; z++) {
-					const auto aXz = aX / (1 << (indexZoom - z));
-					const auto bXz = bX / (1 << (indexZoom - z));
-					if (aXz != bXz)
-						return aXz < bXz;
-
-					const auto aYz = aY / (1 << (indexZoom - z));
-					const auto bYz = bY / (1 << (indexZoom - z));
-
-					if (aYz != bYz)
-						return aYz < bYz;
-				}
+		for (size_t j = 0; j < tile.size(); j++)
+			if (payloadObject(tile.payloads[j]).minZoom < CLUSTER_ZOOM)
+				lowZoomByZ6[i].push_back(tile.payloads[j]);
+		std::sort(lowZoomByZ6[i].begin(), lowZoomByZ6[i].end(), order);
+
+		// Sort by Morton code, so that each tile's objects are contiguous,
+		// and then in output order.
+		tile.sort(sortThreads, order);
+
+		std::lock_guard<std::mutex> lock(progressMutex);
+		finalized++;
+		std::cout << "\r" << name << ": finalized z6 tile " << finalized << "/" << populated.size();
+#ifdef CLOCK_MONOTONIC
+		clock_gettime(CLOCK_MONOTONIC, &endTs);
+		uint64_t elapsedNs = 1e9 * (endTs.tv_sec - startTs.tv_sec) + endTs.tv_nsec - startTs.tv_nsec;
+		std::cout << " (" << std::to_string((uint32_t)(elapsedNs / 1e6)) << " ms)";
+#endif
+		std::cout << std::flush;
+	};
 
-				return false;
-			},
-			threadNum
-		);
+	// e.g. Colorado has ~9 z6 tiles, 1 of which has 95% of its output
+	// objects, while a global extract has thousands of smaller ones.
+	//
+	// A z6 tile holding more than a thread's share of the objects is sorted
+	// on its own, using all threads. The rest are shared out between the
+	// threads, each sorting a whole z6 tile single-threaded.
+	size_t next = 0;
+	while (threadNum > 1 && next < populated.size() && begin[populated[next]].size() > total / threadNum) {
+		finalizeTile(populated[next], threadNum);
+		next++;
+	}
+
+	boost::asio::thread_pool pool(threadNum);
+	for (; next < populated.size(); next++) {
+		const size_t i = populated[next];
+		boost::asio::post(pool, [&finalizeTile, i]() { finalizeTile(i, 1); });
 	}
+	pool.join();
 
+	lowZoom.build(lowZoomByZ6, indexZoom);
 	std::cout << std::endl;
 }
 
 template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
 	const unsigned int& indexZoom,
-	const typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator objects,
+	const typename std::vector<Z6Objects<OO>>::iterator objects,
 	const size_t size,
 	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms
 ) {
@@ -153,10 +338,11 @@ template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
 		const size_t z6x = i / CLUSTER_ZOOM_WIDTH;
 		const size_t z6y = i % CLUSTER_ZOOM_WIDTH;
 
-		for (size_t j = 0; j < objects[i].size(); j++) {
+		auto& xy = objects[i].xy;
+		for (auto xyIt = xy.begin(); xyIt != xy.end(); xyIt++) {
 			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + objects[i][j].x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + objects[i][j].y;
+			TileCoordinate baseX = z6x * z6OffsetDivisor + z6X(*xyIt);
+			TileCoordinate baseY = z6y * z6OffsetDivisor + z6Y(*xyIt);
 
 			// Translate the x, y at the requested zoom level
 			TileCoordinate x = baseX / (1 << (indexZoom - maxZoom));
@@ -176,58 +362,15 @@ template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
 	}
 }
 
-template<typename OO>
-OutputObjectID outputObjectWithId(const OO& input) {
-	return OutputObjectID({ input.oo, 0 });
-}
-
-template<>
-inline OutputObjectID outputObjectWithId<OutputObjectXYID>(const OutputObjectXYID& input) {
-	return OutputObjectID({ input.oo, input.id });
-}
-
-template<typename OO> void collectLowZoomObjectsForTile(
-	const unsigned int& indexZoom,
-	typename std::vector<std::vector<OO>> objects,
-	unsigned int zoom,
-	const TileCoordinates& dstIndex,
-	std::vector<OutputObjectID>& output
-) {
-	if (zoom >= CLUSTER_ZOOM)
-		throw std::runtime_error("collectLowZoomObjectsForTile should not be called for high zooms");
-
-	uint16_t z6OffsetDivisor = indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1;
-
-	for (size_t i = 0; i < objects.size(); i++) {
-		const size_t z6x = i / CLUSTER_ZOOM_WIDTH;
-		const size_t z6y = i % CLUSTER_ZOOM_WIDTH;
-
-		for (size_t j = 0; j < objects[i].size(); j++) {
-			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + objects[i][j].x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + objects[i][j].y;
-
-			// Translate the x, y at the requested zoom level
-			TileCoordinate x = baseX / (1 << (indexZoom - zoom));
-			TileCoordinate y = baseY / (1 << (indexZoom - zoom));
-
-			if (dstIndex.x == x && dstIndex.y == y) {
-				if (objects[i][j].oo.minZoom <= zoom) {
-					output.push_back(outputObjectWithId(objects[i][j]));
-				}
-			}
-		}
-	}
-}
-
 template<typename OO> void collectObjectsForTileTemplate(
 	const unsigned int& indexZoom,
-	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator objects,
+	typename std::vector<Z6Objects<OO>>::iterator objects,
 	size_t iStart,
 	size_t iEnd,
 	unsigned int zoom,
 	TileCoordinates dstIndex,
-	std::vector<OutputObjectID>& output
+	std::vector<OutputObjectID>& output,
+	std::vector<size_t>& runs
 ) {
 	if (zoom < CLUSTER_ZOOM)
 		throw std::runtime_error("collectObjectsForTileTemplate should not be called for low zooms");
@@ -244,78 +387,43 @@ template<typename OO> void collectObjectsForTileTemplate(
 
 	for (size_t i = iStart; i < iEnd; i++) {
 		// If z >= 6, we can compute the exact bounds within the objects array.
-		// Translate to the base zoom, then do a binary search to find
-		// the starting point.
+		// Translate to the base zoom: the tile's objects are the run of
+		// Morton codes from its top-left corner, one per base zoom tile it
+		// covers, so two binary searches find them.
 		TileCoordinate z6x = dstIndex.x / (1 << (clampedZoom - CLUSTER_ZOOM));
 		TileCoordinate z6y = dstIndex.y / (1 << (clampedZoom - CLUSTER_ZOOM));
 
 		TileCoordinate baseX = dstIndex.x * (1 << (indexZoom - clampedZoom));
 		TileCoordinate baseY = dstIndex.y * (1 << (indexZoom - clampedZoom));
 
-		Z6Offset needleX = baseX - z6x * z6OffsetDivisor;
-		Z6Offset needleY = baseY - z6y * z6OffsetDivisor;
-
-		// Kind of gross that we have to do this. Might be better if we split
-		// into two arrays, one of x/y and one of OOs. Would have better locality for
-		// searching, too.
-		OutputObject dummyOo(POINT_, 0, 0, 0, 0);
-		const size_t bz = indexZoom;
-
-		const OO targetXY = {dummyOo, needleX, needleY };
-		auto iter = std::lower_bound(
-			objects[i].begin(),
-			objects[i].end(),
-			targetXY,
-			[bz](const OO& a, const OO& b) {
-				// Cluster by parent zoom, so that a subsequent search
-				// can find a contiguous range of entries for any tile
-				// at zoom 6 or higher.
-				const size_t aX = a.x;
-				const size_t aY = a.y;
-				const size_t bX = b.x;
-				const size_t bY = b.y;
-				for (size_t z = CLUSTER_ZOOM; z <= bz; z++) {
-					const auto aXz = aX / (1 << (bz - z));
-					const auto aYz = aY / (1 << (bz - z));
-					const auto bXz = bX / (1 << (bz - z));
-					const auto bYz = bY / (1 << (bz - z));
-
-					if (aXz != bXz)
-						return aXz < bXz;
-
-					if (aYz != bYz)
-						return aYz < bYz;
-				}
-				return false;
+		uint32_t first, last;
+		z6TileRange(baseX - z6x * z6OffsetDivisor, baseY - z6y * z6OffsetDivisor, 1 << (indexZoom - clampedZoom), first, last);
+
+		auto& xy = objects[i].xy;
+		auto xyIt = std::lower_bound(xy.begin(), xy.end(), first);
+		auto xyEnd = std::lower_bound(xyIt, xy.end(), last);
+		auto payloadIt = objects[i].payloads.begin() + (xyIt - xy.begin());
+
+		// Each base zoom tile's objects are a run in output order
+		Z6XY runKey = 0;
+		for (bool inRun = false; xyIt != xyEnd; xyIt++, payloadIt++) {
+			if (!inRun || *xyIt != runKey) {
+				inRun = true;
+				runKey = *xyIt;
+				runs.push_back(output.size());
 			}
-		);
-
-		for (; iter != objects[i].end(); iter++) {
-			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + iter->x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + iter->y;
-
-			// Translate the x, y at the requested zoom level
-			TileCoordinate x = baseX / (1 << (indexZoom - clampedZoom));
-			TileCoordinate y = baseY / (1 << (indexZoom - clampedZoom));
-
-			if (dstIndex.x == x && dstIndex.y == y) {
-				if (iter->oo.minZoom <= zoom) {
-					output.push_back(outputObjectWithId(*iter));
-				}
-			} else {
-				// Short-circuit when we're confident we'd no longer see relevant matches.
-				// We've ordered the entries in `objects` such that all objects that
-				// share the same tile at any zoom are in contiguous runs.
-				//
-				// Thus, as soon as we fail to find a match, we can stop looking.
-				break;
+			if (payloadObject(*payloadIt).minZoom <= zoom) {
+				output.push_back(outputObjectWithId(*payloadIt));
 			}
-
 		}
 	}
 }
 
+struct PendingLargeObjects {
+	std::vector<std::pair<Box, OutputObject>> objects;
+	std::vector<std::pair<Box, OutputObjectID>> objectsWithIds;
+};
+
 class TileDataSource {
 public:
 	// Store for generated geometries
@@ -356,16 +464,20 @@ protected:
 	//
 	// If config.include_ids is true, objectsWithIds will be populated.
 	// Otherwise, objects.
-	std::vector<AppendVectorNS::AppendVector<OutputObjectXY>> objects;
-	std::vector<std::vector<OutputObjectXY>> lowZoomObjects;
-	std::vector<AppendVectorNS::AppendVector<OutputObjectXYID>> objectsWithIds;
-	std::vector<std::vector<OutputObjectXYID>> lowZoomObjectsWithIds;
+	std::vector<Z6Objects<OutputObject>> objects;
+	LowZoomIndex<OutputObject> lowZoomObjects;
+	std::vector<Z6Objects<OutputObjectID>> objectsWithIds;
+	LowZoomIndex<OutputObjectID> lowZoomObjectsWithIds;
 	
-	// rtree index of large objects
+	// rtree index of large objects, bulk-loaded at finalize
 	using oo_rtree_param_type = boost::geometry::index::quadratic<128>;
 	boost::geometry::index::rtree< std::pair<Box,OutputObject>, oo_rtree_param_type> boxRtree;
 	boost::geometry::index::rtree< std::pair<Box,OutputObjectID>, oo_rtree_param_type> boxRtreeWithIds;
 
+	// Large objects added by each thread before finalize. Guarded by mutex,
+	// which is only taken when a thread first adds to this source.
+	std::deque<PendingLargeObjects> pendingLargeObjects;
+
 	unsigned int indexZoom;
 
 	std::vector<point_store_t> pointStores;
@@ -378,6 +490,13 @@ protected:
 
 	std::deque<std::vector<std::tuple<TileCoordinates, OutputObject, uint64_t>>> pendingSmallIndexObjects;
 
+	template<typename OO> void collectTilesAboveIndexZoomTemplate(
+		std::vector<Z6Objects<OO>>& tiles,
+		unsigned int firstZoom,
+		std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+		TileCoordinatesSet& covered
+	);
+
 public:
 	TileDataSource(size_t threadNum, unsigned int indexZoom, bool includeID);
 
@@ -385,8 +504,24 @@ public:
 
 	void collectTilesWithLargeObjectsAtZoom(std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms);
 
-	void collectObjectsForTile(uint zoom, TileCoordinates dstIndex, std::vector<OutputObjectID>& output);
-	void finalize(size_t threadNum);
+	// Set the tiles at zooms from firstZoom (above the index zoom) that
+	// points fall in, and set the index tiles of other objects in covered,
+	// whose tiles the high zoom sets include wholesale
+	void collectTilesAboveIndexZoom(
+		unsigned int firstZoom,
+		std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+		TileCoordinatesSet& covered
+	);
+
+	// Append the tile's objects to output, in runs that are each in output
+	// order; runs has the index in output where each starts
+	void collectObjectsForTile(uint zoom, TileCoordinates dstIndex, std::vector<OutputObjectID>& output, std::vector<size_t>& runs);
+	void finalize(size_t threadNum, const std::vector<bool>& sortOrders);
+
+	// Write the finalized index and generated geometries to a tile index, or
+	// read them back in place of adding objects and finalizing
+	void save(IndexFileWriter& writer) const;
+	void load(IndexFileReader& reader);
 
 	void addGeometryToIndex(
 		const Linestring& geom,
@@ -408,18 +543,15 @@ public:
 	void addObjectToSmallIndex(const TileCoordinates& index, const OutputObject& oo, uint64_t id, bool needsLock);
 	void addObjectToSmallIndexUnsafe(const TileCoordinates& index, const OutputObject& oo, uint64_t id);
 
-	void addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id) {
-		std::lock_guard<std::mutex> lock(mutex);
-		if (id == 0 || !includeID)
-			boxRtree.insert(std::make_pair(envelope, oo));
-		else
-			boxRtreeWithIds.insert(std::make_pair(envelope, OutputObjectID({oo, id})));
-	}
+	void addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id);
 
 	void collectLargeObjectsForTile(uint zoom, TileCoordinates dstIndex, std::vector<OutputObjectID>& output);
 
+	// The tile's objects in output order, without duplicates, and with at
+	// most featureLimits[layer] objects in each layer that has a limit
 	std::vector<OutputObjectID> getObjectsForTile(
 		const std::vector<bool>& sortOrders, 
+		const std::vector<uint>& featureLimits,
 		unsigned int zoom,
 		TileCoordinates coordinates
 	);
@@ -496,9 +628,12 @@ public:
 	}
 };
 
+// covered is the index zoom set that the zooms above it are built on, and
+// is only needed if there are any
 void populateTilesAtZoom(
 	const std::vector<class TileDataSource *>& sources,
-	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms
+	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+	TileCoordinatesSet* covered
 );
 
 #endif //_TILE_DATA_H
@@ -1,7 +1,10 @@
 #include "attribute_store.h"
+#include "index_file.h"
 
 #include <iostream>
 #include <algorithm>
+#include <iterator>
+#include <protozero/varint.hpp>
 
 // AttributeKeyStore
 thread_local std::map<const std::string*, uint16_t, string_ptr_less_than> tlsKeys2Index;
@@ -66,126 +69,45 @@ void AttributePair::ensureStringIsOwned() {
 }
 
 // AttributePairStore
-thread_local DequeMap<AttributePair> tlsHotShard(1 << 16);
 const AttributePair& AttributePairStore::getPair(uint32_t i) const {
-	uint32_t shard = i >> (32 - SHARD_BITS);
-	uint32_t offset = i & (~(~0u << (32 - SHARD_BITS)));
+	if (i < HOT_PAIRS)
+		return hotPairs[i];
 
-	if (shard == 0) {
-		if (offset < tlsHotShard.size())
-			return tlsHotShard[offset];
-
-		{
-			std::lock_guard<std::mutex> lock(pairsMutex[0]);
-			tlsHotShard = pairs[0];
-		}
-
-		return tlsHotShard[offset];
-	}
-
-	std::lock_guard<std::mutex> lock(pairsMutex[shard]);
-	return pairs[shard][offset];
+	return coldPairs[i - HOT_PAIRS];
 };
 
 const AttributePair& AttributePairStore::getPairUnsafe(uint32_t i) const {
-	// NB: This is unsafe if called before the PBF has been fully read.
-	// If called during the output phase, it's safe.
-
-	uint32_t shard = i >> (32 - SHARD_BITS);
-	uint32_t offset = i & (~(~0u << (32 - SHARD_BITS)));
-
-	return pairs[shard][offset];
+	// The tables are lock-free, so this is the same as getPair
+	return getPair(i);
 };
 
-// Remember recently queried/added pairs so that we can return them in the
-// future without taking a lock.
 thread_local uint64_t tlsPairLookups = 0;
-thread_local uint64_t tlsPairLookupsUncached = 0;
 
-thread_local std::vector<const AttributePair*> cachedAttributePairPointers(64);
-thread_local std::vector<uint32_t> cachedAttributePairIndexes(64);
 uint32_t AttributePairStore::addPair(AttributePair& pair, bool isHot) {
-	if (isHot) {
-		{
-			// First, check our thread-local map.
-			const auto& index = tlsHotShard.find(pair);
-			if (index != -1)
-				return index;
-		}
-
-		// Not found, ensure our local map is up-to-date for future calls,
-		// and fall through to the main map.
-		if (!tlsHotShard.full()) {
-			std::lock_guard<std::mutex> lock(pairsMutex[0]);
-			tlsHotShard = pairs[0];
-		}
-
-		// This might be a popular pair, worth re-using.
-		// Have we already assigned it a hot ID?
-		std::lock_guard<std::mutex> lock(pairsMutex[0]);
-		const auto& index = pairs[0].find(pair);
-		if (index != -1)
-			return index;
-
-		if (!pairs[0].full()) {
-			pair.ensureStringIsOwned();
-			uint32_t offset = pairs[0].add(pair);
-			uint32_t rv = (0 << (32 - SHARD_BITS)) + offset;
-			return rv;
-		}
-	}
-
-	// This is either not a hot key, or there's no room for in the hot shard.
-	// Throw it on the pile with the rest of the pairs.
-	size_t hash = pair.hash();
-
-	const size_t candidateIndex = hash % cachedAttributePairPointers.size();
-	// Before taking a lock, see if we've seen this attribute pair recently.
-
 	tlsPairLookups++;
 	if (tlsPairLookups % 1024 == 0) {
 		lookups += 1024;
 	}
 
+	// Before we store an AttributePair in our long-term storage, we need
+	// to make sure it's not pointing to a non-long-lived std::string.
+	auto ensureStringIsOwned = [](AttributePair& stored) { stored.ensureStringIsOwned(); };
 
-	{
-		const AttributePair* candidate = cachedAttributePairPointers[candidateIndex];
-
-		if (candidate != nullptr && *candidate == pair)
-			return cachedAttributePairIndexes[candidateIndex];
-	}
-
-
-	size_t shard = hash % ATTRIBUTE_SHARDS;
-	// Shard 0 is for hot pairs -- pick another shard if it gets selected.
-	if (shard == 0) shard = (hash >> 8) % ATTRIBUTE_SHARDS;
-	if (shard == 0) shard = (hash >> 16) % ATTRIBUTE_SHARDS;
-	if (shard == 0) shard = (hash >> 24) % ATTRIBUTE_SHARDS;
-	if (shard == 0) shard = 1;
-
-	std::lock_guard<std::mutex> lock(pairsMutex[shard]);
-
-	tlsPairLookupsUncached++;
-	if (tlsPairLookupsUncached % 1024 == 0)
-		lookupsUncached += 1024;
-
-	const auto& index = pairs[shard].find(pair);
-	if (index != -1) {
-		const uint32_t rv = (shard << (32 - SHARD_BITS)) + index;
-		cachedAttributePairPointers[candidateIndex] = &pairs[shard][index];
-		cachedAttributePairIndexes[candidateIndex] = rv;
-
-		return rv;
+	if (isHot) {
+		// This might be a popular pair, worth re-using. Returns -1 if the
+		// hot table is full.
+		const int32_t index = hotPairs.add(pair, ensureStringIsOwned);
+		if (index >= 0)
+			return index;
 	}
 
-	pair.ensureStringIsOwned();
-	uint32_t offset = pairs[shard].add(pair);
-
-	if (offset >= (1 << (32 - SHARD_BITS)))
-		throw std::out_of_range("pair shard overflow");
+	// This is either not a hot key, or there's no room for in the hot table.
+	// Throw it on the pile with the rest of the pairs.
+	const int32_t index = coldPairs.add(pair, ensureStringIsOwned);
+	if (index < 0 || uint64_t(index) + HOT_PAIRS > UINT32_MAX)
+		throw std::out_of_range("too many attribute pairs");
 
-	uint32_t rv = (shard << (32 - SHARD_BITS)) + offset;
-	return rv;
+	return HOT_PAIRS + index;
 };
 
 
@@ -294,55 +216,27 @@ void AttributeSet::finalize() {
 }
 
 
-// Remember recently queried/added sets so that we can return them in the
-// future without taking a lock.
-thread_local std::vector<const AttributeSet*> cachedAttributeSetPointers(64);
-thread_local std::vector<AttributeIndex> cachedAttributeSetIndexes(64);
-
 thread_local uint64_t tlsSetLookups = 0;
-thread_local uint64_t tlsSetLookupsUncached = 0;
 AttributeIndex AttributeStore::add(AttributeSet &attributes) {
 	// TODO: there's probably a way to use C++ types to distinguish a finalized
 	// and non-finalized AttributeSet, which would make this safer.
-	attributes.finalize();
+	if (finalized)
+		throw std::runtime_error("can't add attribute sets after finalize");
 
-	size_t hash = attributes.hash();
-
-	const size_t candidateIndex = hash % cachedAttributeSetPointers.size();
-	// Before taking a lock, see if we've seen this attribute set recently.
+	attributes.finalize();
 
 	tlsSetLookups++;
 	if (tlsSetLookups % 1024 == 0) {
 		lookups += 1024;
 	}
 
-
-	{
-		const AttributeSet* candidate = cachedAttributeSetPointers[candidateIndex];
-
-		if (candidate != nullptr && *candidate == attributes)
-			return cachedAttributeSetIndexes[candidateIndex];
-	}
-
-	size_t shard = hash % ATTRIBUTE_SHARDS;
+	const int32_t index = sets->add(attributes);
 
 	// We can't use the top 2 bits (see OutputObject's bitfields)
-	shard = shard >> 2;
+	if (index < 0 || index >= (1 << 30))
+		throw std::out_of_range("too many attribute sets");
 
-	std::lock_guard<std::mutex> lock(setsMutex[shard]);
-	tlsSetLookupsUncached++;
-	if (tlsSetLookupsUncached % 1024 == 0)
-		lookupsUncached += 1024;
-
-	const uint32_t offset = sets[shard].add(attributes);
-	if (offset >= (1 << (32 - SHARD_BITS)))
-		throw std::out_of_range("set shard overflow");
-
-	uint32_t rv = (shard << (32 - SHARD_BITS)) + offset;
-
-	cachedAttributeSetPointers[candidateIndex] = &sets[shard][offset];
-	cachedAttributeSetIndexes[candidateIndex] = rv;
-	return rv;
+	return index;
 }
 
 std::vector<const AttributePair*> AttributeStore::getUnsafe(AttributeIndex index) const {
@@ -350,14 +244,20 @@ std::vector<const AttributePair*> AttributeStore::getUnsafe(AttributeIndex index
 	// If called during the output phase, it's safe.
 
 	try {
-		uint32_t shard = index >> (32 - SHARD_BITS);
-		uint32_t offset = index & (~(~0u << (32 - SHARD_BITS)));
+		std::vector<const AttributePair*> rv;
+		if (finalized) {
+			thread_local std::vector<uint32_t> pairs;
+			unpackSet(index, pairs);
+			rv.reserve(pairs.size());
+			for (const uint32_t pair : pairs)
+				rv.push_back(&pairStore.getPairUnsafe(pair));
+			return rv;
+		}
 
-		const AttributeSet& attrSet = sets[shard].at(offset);
+		const AttributeSet& attrSet = sets->at(index);
 
 		const size_t n = attrSet.numPairs();
 
-		std::vector<const AttributePair*> rv;
 		for (size_t i = 0; i < n; i++) {
 			rv.push_back(&pairStore.getPairUnsafe(attrSet.getPair(i)));
 		}
@@ -368,49 +268,185 @@ std::vector<const AttributePair*> AttributeStore::getUnsafe(AttributeIndex index
 	}
 }
 
-size_t AttributeStore::size() const {
-	size_t numAttributeSets = 0;
-	for (int i = 0; i < ATTRIBUTE_SHARDS; i++)
-		numAttributeSets += sets[i].size();
+const AttributeStore::ZoomSlice* AttributeStore::findZoomSlice(AttributeIndex index, char zoom) const {
+	// Sets have few distinct minzooms, so a linear scan is fine
+	const ZoomSlice* rv = nullptr;
+	for (uint32_t i = zoomSliceStart[index]; i < zoomSliceStart[index + 1]; i++) {
+		if (zoomSlices[i].minzoom > zoom)
+			break;
+		rv = &zoomSlices[i];
+	}
+	return rv;
+}
+
+uint32_t AttributeStore::zoomSliceId(AttributeIndex index, char zoom) const {
+	if (!finalized || index + 1 >= zoomSliceStart.size())
+		throw std::runtime_error("No zoom slices for attributes at index "+std::to_string(index));
+	if (zoomSliceStart[index] == zoomSliceStart[index + 1])
+		return index;
+
+	const ZoomSlice* slice = findZoomSlice(index, zoom);
+	return slice ? slice->id : emptySliceId;
+}
+
+std::vector<const AttributePair*> AttributeStore::getZoomSliceUnsafe(AttributeIndex index, char zoom) const {
+	if (!finalized || index + 1 >= zoomSliceStart.size())
+		throw std::runtime_error("No zoom slices for attributes at index "+std::to_string(index));
+	if (zoomSliceStart[index] == zoomSliceStart[index + 1])
+		return getUnsafe(index);
+
+	std::vector<const AttributePair*> rv;
+	const ZoomSlice* slice = findZoomSlice(index, zoom);
+	if (!slice)
+		return rv;
+
+	rv.reserve(slice->count);
+	const uint32_t* pairs = &zoomOrderedPairs[slice->pairs];
+	for (uint32_t i = 0; i < slice->count; i++)
+		rv.push_back(&pairStore.getPairUnsafe(pairs[i]));
+	return rv;
+}
+
+void AttributeStore::finalizeZoomSlices() {
+	// Slices that aren't a whole set get IDs after the sets, deduplicated
+	// against the sets and each other.
+	const uint32_t n = sets->allocated();
+	ConcurrentDedupTable<AttributeSet> prefixes;
+	auto sliceId = [&](const uint32_t* begin, const uint32_t* end) -> uint32_t {
+		AttributeSet prefix;
+		for (const uint32_t* it = begin; it != end; it++)
+			prefix.addPair(*it);
+		prefix.finalize();
+
+		const int32_t index = sets->find(prefix);
+		if (index >= 0)
+			return index;
+		return n + prefixes.add(prefix);
+	};
+
+	zoomSliceStart.clear();
+	zoomSlices.clear();
+	zoomOrderedPairs.clear();
+	zoomSliceStart.reserve(n + 1);
+
+	std::vector<std::pair<uint8_t, uint32_t>> ordered;
+	for (uint32_t index = 0; index < n; index++) {
+		zoomSliceStart.push_back(zoomSlices.size());
+
+		const AttributeSet& attrSet = (*sets)[index];
+		const size_t numPairs = attrSet.numPairs();
+		ordered.clear();
+		for (size_t i = 0; i < numPairs; i++) {
+			const uint32_t pairIndex = attrSet.getPair(i);
+			ordered.push_back(std::pair<uint8_t, uint32_t>(pairStore.getPair(pairIndex).minzoom, pairIndex));
+		}
+		if (std::all_of(ordered.begin(), ordered.end(), [](const auto& p) { return p.first == 0; }))
+			continue;
+
+		std::sort(ordered.begin(), ordered.end());
+		const uint32_t offset = zoomOrderedPairs.size();
+		for (const auto& p : ordered)
+			zoomOrderedPairs.push_back(p.second);
+		const uint32_t* pairs = &zoomOrderedPairs[offset];
+
+		for (size_t i = 0; i < ordered.size(); i++) {
+			if (i + 1 < ordered.size() && ordered[i + 1].first == ordered[i].first)
+				continue;
+
+			const uint32_t count = i + 1;
+			const uint32_t id = count == ordered.size() ? index : sliceId(pairs, pairs + count);
+			zoomSlices.push_back({ ordered[i].first, count, offset, id });
+		}
+	}
+	zoomSliceStart.push_back(zoomSlices.size());
+
+	const uint32_t empty = 0;
+	emptySliceId = sliceId(&empty, &empty);
+}
+
+void AttributeStore::packSets() {
+	const uint32_t n = sets->allocated();
+	packedSetCount = sets->size();
+	packedSets.clear();
+	packedSetOffsets.clear();
+	packedSetOffsets.reserve(n + 1);
+
+	std::vector<uint32_t> pairs;
+	auto out = std::back_inserter(packedSets);
+	for (uint32_t index = 0; index < n; index++) {
+		packedSetOffsets.push_back(packedSets.size());
+
+		const AttributeSet& attrSet = (*sets)[index];
+		const size_t numPairs = attrSet.numPairs();
+		pairs.clear();
+		for (size_t i = 0; i < numPairs; i++)
+			pairs.push_back(attrSet.getPair(i));
+		std::sort(pairs.begin(), pairs.end());
+
+		protozero::write_varint(out, pairs.size());
+		uint32_t last = 0;
+		for (const uint32_t pair : pairs) {
+			protozero::write_varint(out, pair - last);
+			last = pair;
+		}
+	}
+	packedSetOffsets.push_back(packedSets.size());
+	packedSets.shrink_to_fit();
+
+	// The sets are only needed to deduplicate new ones, which we no longer accept
+	sets.reset();
+}
 
-	return numAttributeSets;
+void AttributeStore::unpackSet(AttributeIndex index, std::vector<uint32_t>& pairs) const {
+	if (index + 1 >= packedSetOffsets.size())
+		throw std::out_of_range("no packed attribute set at index " + std::to_string(index));
+
+	const char* data = packedSets.data() + packedSetOffsets[index];
+	const char* end = packedSets.data() + packedSetOffsets[index + 1];
+	const size_t n = protozero::decode_varint(&data, end);
+	pairs.resize(n);
+	uint32_t last = 0;
+	for (size_t i = 0; i < n; i++) {
+		last += protozero::decode_varint(&data, end);
+		pairs[i] = last;
+	}
+}
+
+size_t AttributeStore::size() const {
+	return finalized ? packedSetCount : sets->size();
 }
 
 void AttributeStore::reportSize() const {
-	std::cout << "Attributes: " << size() << " sets from " << lookups.load() << " objects (" << lookupsUncached.load() << " uncached), " << pairStore.lookups.load() << " pairs (" << pairStore.lookupsUncached.load() << " uncached)" << std::endl;
+	std::cout << "Attributes: " << size() << " sets from " << lookups.load() << " objects, " << (pairStore.hotPairs.size() + pairStore.coldPairs.size()) << " pairs from " << pairStore.lookups.load() << " attributes" << std::endl;
 
 	// Print detailed histogram of frequencies of attributes.
 	if (false) {
-		for (int i = 0; i < ATTRIBUTE_SHARDS; i++) {
-			std::cout << "pairs[" << i << "] has " << pairStore.pairs[i].size() << " entries" << std::endl;
-		}
+		std::cout << "hot pairs has " << pairStore.hotPairs.size() << " entries, cold pairs has " << pairStore.coldPairs.size() << " entries" << std::endl;
 
 		std::map<uint32_t, uint32_t> tagCountDist;
 
-		for (size_t i = 0; i < pairStore.pairs.size(); i++) {
-			std::cout << "pairs[" << i << "] has size " << pairStore.pairs[i].size() << std::endl;
-			size_t j = 0;
-			for (const auto& ap: pairStore.pairs[i]) {
-				std::cout << "pairs[" << i << "][" << j << "] keyIndex=" << ap.keyIndex << " minzoom=" << (65+ap.minzoom) << " stringValue=" << ap.stringValue() << " floatValue=" << ap.floatValue() << " boolValue=" << ap.boolValue() << " key=" << keyStore.getKey(ap.keyIndex) << std::endl;
-				j++;
-
-			}
+		for (uint32_t i = 0; i < pairStore.hotPairs.allocated() + pairStore.coldPairs.allocated(); i++) {
+			const uint32_t index = i < pairStore.hotPairs.allocated() ? i : HOT_PAIRS + i - pairStore.hotPairs.allocated();
+			const AttributePair& ap = pairStore.getPair(index);
+			std::cout << "pairs[" << index << "] keyIndex=" << ap.keyIndex << " minzoom=" << (65+ap.minzoom) << " stringValue=" << ap.stringValue() << " floatValue=" << ap.floatValue() << " boolValue=" << ap.boolValue() << " key=" << keyStore.getKey(ap.keyIndex) << std::endl;
 		}
 		size_t pairs = 0;
 		std::map<uint32_t, size_t> uniques;
-		for (const auto& attributeSetSet: sets) {
-			for (const auto& attrSet: attributeSetSet) {
-				pairs += attrSet.numPairs();
+		std::vector<uint32_t> setPairs;
+		for (uint32_t setIndex = 0; setIndex + 1 < packedSetOffsets.size(); setIndex++) {
+			{
+				unpackSet(setIndex, setPairs);
+				pairs += setPairs.size();
 
 				try {
-					tagCountDist[attrSet.numPairs()]++;
+					tagCountDist[setPairs.size()]++;
 				} catch (std::out_of_range &err) {
-					tagCountDist[attrSet.numPairs()] = 1;
+					tagCountDist[setPairs.size()] = 1;
 				}
 
-				const size_t n = attrSet.numPairs();
+				const size_t n = setPairs.size();
 				for (size_t i = 0; i < n; i++) {
-					uint32_t attr = attrSet.getPair(i);
+					uint32_t attr = setPairs[i];
 					try {
 						uniques[attr]++;
 					} catch (std::out_of_range &err) {
@@ -438,18 +474,116 @@ void AttributeStore::reset() {
 	// This is only used for tests.
 	tlsKeys2Index.clear();
 	tlsKeys2IndexSize = 0;
+}
 
-	tlsHotShard.clear();
+void AttributeStore::finalize() {
+	keyStore.finalize();
+	pairStore.finalize();
+	finalizeZoomSlices();
+	packSets();
+	finalized = true;
+}
 
-	for (int i = 0; i < cachedAttributeSetPointers.size(); i++)
-		cachedAttributeSetPointers[i] = nullptr;
+namespace {
+	// Every slot of a pair table, including the gaps left by lost races, so
+	// that the pairs keep their indexes
+	void savePairs(IndexFileWriter& writer, const ConcurrentDedupTable<AttributePair>& pairs) {
+		const uint32_t n = pairs.allocated();
+		writer.write<uint64_t>(n);
+		for (uint32_t index = 0; index < n; index++) {
+			const AttributePair& pair = pairs[index];
+			writer.write<uint8_t>(pairs.find(pair) == int32_t(index));
+			writer.write<uint16_t>(pair.keyIndex);
+			writer.write<uint8_t>(pair.minzoom);
+			writer.write<uint8_t>(static_cast<uint8_t>(pair.valueType));
+			if (pair.hasStringValue())
+				writer.writeString(pair.stringValue());
+			else
+				writer.write<float>(pair.floatValue());
+		}
+	}
 
-	for (int i = 0; i < cachedAttributePairPointers.size(); i++)
-		cachedAttributePairPointers[i] = nullptr;
+	// Restore the slots from `first`, which must be the table's next index
+	void loadPairs(IndexFileReader& reader, ConcurrentDedupTable<AttributePair>& pairs, uint32_t first) {
+		const uint64_t n = reader.read<uint64_t>();
+		if (n < first || pairs.allocated() != first)
+			throw std::runtime_error("index file has an unexpected attribute pair table");
+
+		auto ensureStringIsOwned = [](AttributePair& stored) { stored.ensureStringIsOwned(); };
+		for (uint64_t index = 0; index < n; index++) {
+			const bool listed = reader.read<uint8_t>();
+			const uint16_t keyIndex = reader.read<uint16_t>();
+			const char minzoom = reader.read<uint8_t>();
+			const AttributePairType type = static_cast<AttributePairType>(reader.read<uint8_t>());
+			std::string value;
+			float number = 0;
+			if (type == AttributePairType::String)
+				value = reader.readString();
+			else
+				number = reader.read<float>();
+			if (index < first)
+				continue;
+
+			const PooledString ps(value);
+			const AttributePair pair = type == AttributePairType::String ? AttributePair(keyIndex, ps, minzoom) :
+				type == AttributePairType::Bool ? AttributePair(keyIndex, number != 0, minzoom) :
+				AttributePair(keyIndex, number, minzoom);
+			const int32_t added = listed ? pairs.add(pair, ensureStringIsOwned) : pairs.addUnlisted(pair, ensureStringIsOwned);
+			if (added != int32_t(index))
+				throw std::runtime_error("index file has an unexpected attribute pair at " + std::to_string(index));
+		}
+	}
 }
 
-void AttributeStore::finalize() {
-	finalized = true;
+void AttributeStore::save(IndexFileWriter& writer) const {
+	if (!finalized)
+		throw std::logic_error("AttributeStore must be finalized before it is saved");
+
+	writer.section("ATTR");
+	writer.write<uint64_t>(keyStore.keys2indexSize);
+	for (uint32_t index = 1; index <= keyStore.keys2indexSize; index++)
+		writer.writeString(keyStore.getKeyUnsafe(index));
+
+	savePairs(writer, pairStore.hotPairs);
+	savePairs(writer, pairStore.coldPairs);
+
+	// The packed sets cover every index, gaps included, so are saved as is
+	writer.write<uint64_t>(packedSetCount);
+	writer.writeArray(packedSets);
+	writer.writeArray(packedSetOffsets);
+	writer.writeArray(zoomSliceStart);
+	writer.writeArray(zoomSlices);
+	writer.writeArray(zoomOrderedPairs);
+	writer.write<uint32_t>(emptySliceId);
+}
+
+void AttributeStore::load(IndexFileReader& reader) {
+	if (finalized || sets->allocated() != 0)
+		throw std::logic_error("AttributeStore must be empty before it is loaded");
+
+	reader.section("ATTR");
+	const uint64_t keys = reader.read<uint64_t>();
+	for (uint64_t index = 1; index <= keys; index++) {
+		if (keyStore.key2index(reader.readString()) != index)
+			throw std::runtime_error("index file has an unexpected attribute key at " + std::to_string(index));
+	}
+
+	// The hot table's sentinel pair is already in place
+	loadPairs(reader, pairStore.hotPairs, 1);
+	loadPairs(reader, pairStore.coldPairs, 0);
+
+	packedSetCount = reader.read<uint64_t>();
+	reader.readArray(packedSets);
+	reader.readArray(packedSetOffsets);
+	reader.readArray(zoomSliceStart);
+	reader.readArray(zoomSlices);
+	reader.readArray(zoomOrderedPairs);
+	emptySliceId = reader.read<uint32_t>();
+	if (packedSetOffsets.empty() || zoomSliceStart.size() != packedSetOffsets.size())
+		throw std::runtime_error("index file has unexpected attribute sets");
+
 	keyStore.finalize();
 	pairStore.finalize();
+	sets.reset();
+	finalized = true;
 }
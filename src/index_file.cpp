@@ -0,0 +1,97 @@
+#include "index_file.h"
+#include <cstring>
+
+#define INDEX_FILE_MAGIC "TMIX"
+
+IndexFileWriter::IndexFileWriter(const std::string& filename):
+	filename(filename),
+	out(filename, std::ios::out | std::ios::binary | std::ios::trunc) {
+	if (!out)
+		throw std::runtime_error("Couldn't open index file " + filename + " for writing");
+
+	section(INDEX_FILE_MAGIC);
+	write<uint32_t>(INDEX_FILE_VERSION);
+}
+
+void IndexFileWriter::section(const char* tag) {
+	writeBytes(tag, 4);
+}
+
+void IndexFileWriter::writeString(const std::string& s) {
+	write<uint64_t>(s.size());
+	writeBytes(s.data(), s.size());
+}
+
+void IndexFileWriter::close() {
+	out.close();
+	if (!out)
+		throw std::runtime_error("Couldn't write index file " + filename);
+}
+
+void IndexFileWriter::writeBytes(const void* data, size_t size) {
+	out.write(static_cast<const char*>(data), size);
+	if (!out)
+		throw std::runtime_error("Couldn't write index file " + filename);
+}
+
+IndexFileReader::IndexFileReader(const std::string& filename):
+	filename(filename),
+	in(filename, std::ios::in | std::ios::binary) {
+	if (!in)
+		throw std::runtime_error("Couldn't open index file " + filename);
+
+	section(INDEX_FILE_MAGIC);
+	const uint32_t version = read<uint32_t>();
+	if (version != INDEX_FILE_VERSION)
+		throw std::runtime_error("Index file " + filename + " has version " + std::to_string(version) + ", but this tilemaker reads version " + std::to_string(INDEX_FILE_VERSION));
+}
+
+void IndexFileReader::section(const char* tag) {
+	char actual[4];
+	readBytes(actual, 4);
+	if (memcmp(actual, tag, 4) != 0)
+		throw std::runtime_error("Index file " + filename + " is corrupt: expected section " + std::string(tag, 4));
+}
+
+std::string IndexFileReader::readString() {
+	std::string s(read<uint64_t>(), '\0');
+	readBytes(&s[0], s.size());
+	return s;
+}
+
+void IndexFileReader::readBytes(void* data, size_t size) {
+	in.read(static_cast<char*>(data), size);
+	if (!in)
+		throw std::runtime_error("Index file " + filename + " is truncated");
+}
+
+void IndexFileHeader::write(IndexFileWriter& writer) const {
+	writer.section("HEAD");
+	writer.write<uint8_t>(hasClippingBox);
+	writer.write(minLon);
+	writer.write(minLat);
+	writer.write(maxLon);
+	writer.write(maxLat);
+	writer.write<uint32_t>(indexZoom);
+	writer.write<uint64_t>(layerNames.size());
+	for (const auto& name : layerNames)
+		writer.writeString(name);
+	for (bool ascending : sortOrders)
+		writer.write<uint8_t>(ascending);
+}
+
+void IndexFileHeader::read(IndexFileReader& reader) {
+	reader.section("HEAD");
+	hasClippingBox = reader.read<uint8_t>();
+	minLon = reader.read<double>();
+	minLat = reader.read<double>();
+	maxLon = reader.read<double>();
+	maxLat = reader.read<double>();
+	indexZoom = reader.read<uint32_t>();
+	layerNames.resize(reader.read<uint64_t>());
+	for (auto& name : layerNames)
+		name = reader.readString();
+	sortOrders.resize(layerNames.size());
+	for (size_t i = 0; i < sortOrders.size(); i++)
+		sortOrders[i] = reader.read<uint8_t>();
+}
@@ -0,0 +1,132 @@
+#include "lua_profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+	#include "lua.h"
+}
+
+namespace {
+	// How many VM instructions between line samples
+	const int SAMPLE_INSTRUCTIONS = 1000;
+	const size_t TOP_LINES = 30;
+
+	bool profilingEnabled = false;
+	thread_local LuaProfiler* currentProfiler = nullptr;
+
+	std::mutex globalMutex;
+	std::map<std::string, LuaCallStats> globalEntryPoints;
+	std::map<std::string, LuaCallStats> globalNativeCalls;
+	std::map<std::string, uint64_t> globalLineSamples;
+
+	void merge(std::map<std::string, LuaCallStats>& into, const std::unordered_map<const char*, LuaCallStats>& from) {
+		for (const auto& entry : from) {
+			LuaCallStats& stats = into[entry.first];
+			stats.calls += entry.second.calls;
+			stats.nanoseconds += entry.second.nanoseconds;
+		}
+	}
+
+	void printCalls(std::ostream& out, const std::map<std::string, LuaCallStats>& calls) {
+		std::vector<std::pair<std::string, LuaCallStats>> sorted(calls.begin(), calls.end());
+		std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+			return a.second.nanoseconds > b.second.nanoseconds;
+		});
+
+		for (const auto& entry : sorted) {
+			const double ms = entry.second.nanoseconds / 1e6;
+			const double avgUs = entry.second.calls == 0 ? 0 : entry.second.nanoseconds / 1e3 / entry.second.calls;
+			out << "  " << std::left << std::setw(28) << entry.first << std::right
+				<< std::setw(14) << entry.second.calls
+				<< std::setw(14) << std::fixed << std::setprecision(1) << ms << " ms"
+				<< std::setw(12) << std::setprecision(2) << avgUs << " us/call" << std::endl;
+		}
+	}
+}
+
+LuaProfiler::LuaProfiler() {
+	currentProfiler = this;
+}
+
+LuaProfiler::~LuaProfiler() {
+	if (currentProfiler == this)
+		currentProfiler = nullptr;
+
+	flush();
+}
+
+void LuaProfiler::flush() {
+	std::lock_guard<std::mutex> lock(globalMutex);
+	merge(globalEntryPoints, entryPoints);
+	merge(globalNativeCalls, nativeCalls);
+	for (const auto& entry : lineSamples)
+		globalLineSamples[entry.first] += entry.second;
+
+	entryPoints.clear();
+	nativeCalls.clear();
+	lineSamples.clear();
+}
+
+void LuaProfiler::enable() { profilingEnabled = true; }
+bool LuaProfiler::enabled() { return profilingEnabled; }
+
+void LuaProfiler::install(lua_State* L) {
+	lua_sethook(L, &LuaProfiler::hook, LUA_MASKCOUNT, SAMPLE_INSTRUCTIONS);
+}
+
+void LuaProfiler::hook(lua_State* L, lua_Debug* ar) {
+	if (currentProfiler == nullptr) return;
+
+	if (lua_getinfo(L, "Sl", ar) == 0 || ar->currentline < 0) return;
+
+	std::string key(ar->short_src);
+	key += ":";
+	key += std::to_string(ar->currentline);
+	currentProfiler->lineSamples[key]++;
+}
+
+LuaProfiler::Timer::Timer(const char* name, bool entryPoint):
+	profiler(currentProfiler), name(name), entryPoint(entryPoint) {
+	if (profiler != nullptr)
+		start = std::chrono::steady_clock::now();
+}
+
+LuaProfiler::Timer::~Timer() {
+	if (profiler == nullptr) return;
+
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	LuaCallStats& stats = (entryPoint ? profiler->entryPoints : profiler->nativeCalls)[name];
+	stats.calls++;
+	stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+void LuaProfiler::report(std::ostream& out) {
+	// e.g. the main thread's profiler, which covers shapefile processing
+	if (currentProfiler != nullptr)
+		currentProfiler->flush();
+
+	std::lock_guard<std::mutex> lock(globalMutex);
+
+	out << "Lua profile (times summed across threads):" << std::endl;
+	out << "Calls into Lua:" << std::endl;
+	printCalls(out, globalEntryPoints);
+	out << "Calls from Lua into tilemaker:" << std::endl;
+	printCalls(out, globalNativeCalls);
+
+	uint64_t totalSamples = 0;
+	for (const auto& entry : globalLineSamples)
+		totalSamples += entry.second;
+
+	out << "Top Lua lines (" << totalSamples << " samples, one per " << SAMPLE_INSTRUCTIONS << " instructions):" << std::endl;
+	std::vector<std::pair<std::string, uint64_t>> lines(globalLineSamples.begin(), globalLineSamples.end());
+	std::sort(lines.begin(), lines.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+	for (size_t i = 0; i < lines.size() && i < TOP_LINES; i++) {
+		out << "  " << std::left << std::setw(40) << lines[i].first << std::right
+			<< std::setw(10) << lines[i].second
+			<< std::setw(8) << std::fixed << std::setprecision(1) << (100.0 * lines[i].second / totalSamples) << "%" << std::endl;
+	}
+}
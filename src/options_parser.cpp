@@ -25,9 +25,13 @@ po::options_description getParser(OptionsParser::Options& options) {
 		("merge"  ,po::bool_switch(&options.mergeSqlite),                                "merge with existing .mbtiles (overwrites otherwise)")
 		("config", po::value< string >(&options.jsonFile)->default_value("config.json"), "config JSON file")
 		("process",po::value< string >(&options.luaFile)->default_value("process.lua"),  "tag-processing Lua file")
+		("rules",  po::value< string >(&options.rulesFile),                              "JSON file of tag rules, applied before Lua")
+		("save-index", po::value< string >(&options.saveIndex),                          "save the tile index to this file, to render again with --load-index")
+		("load-index", po::value< string >(&options.loadIndex),                          "render from a tile index saved with --save-index, instead of reading input files")
 		("verbose",po::bool_switch(&options.verbose),                                   "verbose error output")
 		("skip-integrity",po::bool_switch(&options.osm.skipIntegrity),                       "don't enforce way/node integrity")
-		("log-tile-timings", po::bool_switch(&options.logTileTimings), "log how long each tile takes");
+		("log-tile-timings", po::bool_switch(&options.logTileTimings), "log how long each tile takes")
+		("profile-lua", po::bool_switch(&options.profileLua), "report time spent in Lua functions and calls");
 	po::options_description performance("Performance options");
 	performance.add_options()
 		("store",  po::value< string >(&options.osm.storeFile),  "temporary storage for node/ways/relations data")
@@ -83,7 +87,19 @@ OptionsParser::Options OptionsParser::parse(const int argc, const char* argv[])
 		options.showHelp = true;
 		return options;
 	}
-	if (vm.count("output") == 0) {
+	if (!options.loadIndex.empty()) {
+		if (!options.inputFiles.empty())
+			throw OptionException{ "--load-index can't be used with input files. Run with --help to find out more." };
+		if (!options.saveIndex.empty())
+			throw OptionException{ "--load-index can't be used with --save-index." };
+
+		// Node and way stores are rebuilt from the referenced geometries alone,
+		// which always needs a single unsharded, sparse store
+		options.osm.shardStores = false;
+		options.osm.compact = false;
+	}
+
+	if (vm.count("output") == 0 && options.saveIndex.empty()) {
 		throw OptionException{ "You must specify an output file or directory. Run with --help to find out more." };
 	}
 
@@ -101,9 +117,12 @@ OptionsParser::Options OptionsParser::parse(const int argc, const char* argv[])
 	if (!boost::filesystem::exists(options.jsonFile)) {
 		throw OptionException{ "Couldn't open .json config: " + options.jsonFile };
 	}
-	if (!boost::filesystem::exists(options.luaFile)) {
+	if (options.loadIndex.empty() && !boost::filesystem::exists(options.luaFile)) {
 		throw OptionException{"Couldn't open .lua script: " + options.luaFile };
 	}
+	if (options.loadIndex.empty() && !options.rulesFile.empty() && !boost::filesystem::exists(options.rulesFile)) {
+		throw OptionException{"Couldn't open rules file: " + options.rulesFile };
+	}
 
 	// The lazy geometry code has assumptions that break when more than one
 	// input file is used.
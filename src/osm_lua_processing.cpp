@@ -1,3 +1,4 @@
+#include <cmath>
 #include <iostream>
 
 #include "osm_lua_processing.h"
@@ -7,6 +8,8 @@
 #include "osm_mem_tiles.h"
 #include "significant_tags.h"
 #include "tag_map.h"
+#include "tag_rules.h"
+#include "lua_profiler.h"
 #include "node_store.h"
 #include "polylabel.h"
 #include <signal.h>
@@ -49,21 +52,70 @@ struct KnownTagKey {
 	std::string stringValue;
 };
 
+// A key interned by Key("highway"). Lua sees it as a light userdata holding
+// the interned ID + 1, so it can't be mistaken for a string or number.
+struct TagKeyHandle {
+	uint32_t id;
+};
+
+template<>  struct kaguya::lua_type_traits<TagKeyHandle> {
+	typedef TagKeyHandle get_type;
+	typedef const TagKeyHandle& push_type;
+
+	static bool strictCheckType(lua_State* l, int index)
+	{
+		return lua_type(l, index) == LUA_TLIGHTUSERDATA;
+	}
+	static bool checkType(lua_State* l, int index)
+	{
+		return strictCheckType(l, index);
+	}
+	static get_type get(lua_State* l, int index)
+	{
+		const uintptr_t handle = reinterpret_cast<uintptr_t>(lua_touserdata(l, index));
+		if (handle == 0 || handle > osmLuaProcessing->getInternedKeys().size())
+			throw std::runtime_error("Invalid tag key; use Key() to create one");
+		return TagKeyHandle{ static_cast<uint32_t>(handle - 1) };
+	}
+	static int push(lua_State* l, push_type s)
+	{
+		lua_pushlightuserdata(l, reinterpret_cast<void*>(static_cast<uintptr_t>(s.id) + 1));
+		return 1;
+	}
+};
+
 template<>  struct kaguya::lua_type_traits<KnownTagKey> {
 	typedef KnownTagKey get_type;
 	typedef const KnownTagKey& push_type;
 
 	static bool strictCheckType(lua_State* l, int index)
 	{
-		return lua_type(l, index) == LUA_TSTRING;
+		return lua_type(l, index) == LUA_TSTRING || lua_type(l, index) == LUA_TLIGHTUSERDATA;
 	}
 	static bool checkType(lua_State* l, int index)
 	{
-		return lua_isstring(l, index) != 0;
+		return lua_isstring(l, index) != 0 || lua_type(l, index) == LUA_TLIGHTUSERDATA;
 	}
 	static get_type get(lua_State* l, int index)
 	{
 		KnownTagKey rv = { false, 0 };
+
+		if (lua_type(l, index) == LUA_TLIGHTUSERDATA) {
+			// An interned key: no string to marshal or search for
+			const TagKeyHandle key = kaguya::lua_type_traits<TagKeyHandle>::get(l, index);
+			if (osmLuaProcessing->isPostScanRelation) {
+				rv.stringValue = osmLuaProcessing->getInternedKeys()[key.id];
+				return rv;
+			}
+
+			int64_t tagLoc = osmLuaProcessing->currentTags->getInternedKey(key.id, osmLuaProcessing->getInternedKeys());
+			if (tagLoc >= 0) {
+				rv.found = true;
+				rv.index = tagLoc;
+			}
+			return rv;
+		}
+
 		size_t size = 0;
 		const char* buffer = lua_tolstring(l, index, &size);
 
@@ -117,17 +169,20 @@ template<>  struct kaguya::lua_type_traits<protozero::data_view> {
 	}
 };
 
-std::string rawId() { return osmLuaProcessing->Id(); }
+std::string rawId() { LuaProfiler::Timer timer("Id"); return osmLuaProcessing->Id(); }
+TagKeyHandle rawKey(const std::string& key) { return TagKeyHandle{ osmLuaProcessing->InternKey(key) }; }
 bool rawHolds(const KnownTagKey& key) {
+	LuaProfiler::Timer timer("Holds");
 	if (osmLuaProcessing->isPostScanRelation) {
 		return osmLuaProcessing->Holds(key.stringValue);
 	}
 
 	return key.found;
 }
-bool rawHasTags() { return osmLuaProcessing->HasTags(); }
-void rawSetTag(const std::string &key, const std::string &value) { return osmLuaProcessing->SetTag(key, value); }
+bool rawHasTags() { LuaProfiler::Timer timer("HasTags"); return osmLuaProcessing->HasTags(); }
+void rawSetTag(const std::string &key, const std::string &value) { LuaProfiler::Timer timer("SetTag"); return osmLuaProcessing->SetTag(key, value); }
 const std::string rawFind(const KnownTagKey& key) {
+	LuaProfiler::Timer timer("Find");
 	if (osmLuaProcessing->isPostScanRelation)
 		return osmLuaProcessing->Find(key.stringValue);
 
@@ -138,23 +193,289 @@ const std::string rawFind(const KnownTagKey& key) {
 
 	return EMPTY_STRING;
 }
-std::vector<std::string> rawFindIntersecting(const std::string &layerName) { return osmLuaProcessing->FindIntersecting(layerName); }
-bool rawIntersects(const std::string& layerName) { return osmLuaProcessing->Intersects(layerName); }
-std::vector<std::string> rawFindCovering(const std::string& layerName) { return osmLuaProcessing->FindCovering(layerName); }
-bool rawCoveredBy(const std::string& layerName) { return osmLuaProcessing->CoveredBy(layerName); }
-bool rawIsClosed() { return osmLuaProcessing->IsClosed(); }
-double rawArea() { return osmLuaProcessing->Area(); }
-double rawLength() { return osmLuaProcessing->Length(); }
-kaguya::optional<std::vector<double>> rawCentroid(kaguya::VariadicArgType algorithm) { return osmLuaProcessing->Centroid(algorithm); }
-void rawLayer(const std::string& layerName, bool area) { return osmLuaProcessing->Layer(layerName, area); }
-void rawLayerAsCentroid(const std::string &layerName, kaguya::VariadicArgType nodeSources) { return osmLuaProcessing->LayerAsCentroid(layerName, nodeSources); }
-void rawMinZoom(const double z) { return osmLuaProcessing->MinZoom(z); }
-void rawZOrder(const double z) { return osmLuaProcessing->ZOrder(z); }
-OsmLuaProcessing::OptionalRelation rawNextRelation() { return osmLuaProcessing->NextRelation(); }
-void rawRestartRelations() { return osmLuaProcessing->RestartRelations(); }
-std::string rawFindInRelation(const std::string& key) { return osmLuaProcessing->FindInRelation(key); }
-void rawAccept() { return osmLuaProcessing->Accept(); }
-double rawAreaIntersecting(const std::string& layerName) { return osmLuaProcessing->AreaIntersecting(layerName); }
+std::vector<std::string> rawFindIntersecting(const std::string &layerName) { LuaProfiler::Timer timer("FindIntersecting"); return osmLuaProcessing->FindIntersecting(layerName); }
+bool rawIntersects(const std::string& layerName) { LuaProfiler::Timer timer("Intersects"); return osmLuaProcessing->Intersects(layerName); }
+std::vector<std::string> rawFindCovering(const std::string& layerName) { LuaProfiler::Timer timer("FindCovering"); return osmLuaProcessing->FindCovering(layerName); }
+bool rawCoveredBy(const std::string& layerName) { LuaProfiler::Timer timer("CoveredBy"); return osmLuaProcessing->CoveredBy(layerName); }
+bool rawIsClosed() { LuaProfiler::Timer timer("IsClosed"); return osmLuaProcessing->IsClosed(); }
+double rawArea(kaguya::VariadicArgType mode) { LuaProfiler::Timer timer("Area"); return osmLuaProcessing->Area(mode); }
+double rawLength(kaguya::VariadicArgType mode) { LuaProfiler::Timer timer("Length"); return osmLuaProcessing->Length(mode); }
+kaguya::optional<std::vector<double>> rawCentroid(kaguya::VariadicArgType algorithm) { LuaProfiler::Timer timer("Centroid"); return osmLuaProcessing->Centroid(algorithm); }
+void rawLayer(const std::string& layerName, bool area) { LuaProfiler::Timer timer("Layer"); return osmLuaProcessing->Layer(layerName, area); }
+void rawLayerAsCentroid(const std::string &layerName, kaguya::VariadicArgType nodeSources) { LuaProfiler::Timer timer("LayerAsCentroid"); return osmLuaProcessing->LayerAsCentroid(layerName, nodeSources); }
+void rawMinZoom(const double z) { LuaProfiler::Timer timer("MinZoom"); return osmLuaProcessing->MinZoom(z); }
+void rawZOrder(const double z) { LuaProfiler::Timer timer("ZOrder"); return osmLuaProcessing->ZOrder(z); }
+OsmLuaProcessing::OptionalRelation rawNextRelation() { LuaProfiler::Timer timer("NextRelation"); return osmLuaProcessing->NextRelation(); }
+void rawRestartRelations() { LuaProfiler::Timer timer("RestartRelations"); return osmLuaProcessing->RestartRelations(); }
+std::string rawFindInRelation(const std::string& key) { LuaProfiler::Timer timer("FindInRelation"); return osmLuaProcessing->FindInRelation(key); }
+void rawAccept() { LuaProfiler::Timer timer("Accept"); return osmLuaProcessing->Accept(); }
+double rawAreaIntersecting(const std::string& layerName) { LuaProfiler::Timer timer("AreaIntersecting"); return osmLuaProcessing->AreaIntersecting(layerName); }
+
+// The `batch` argument of node_batch_function/way_batch_function. It has no
+// state of its own: the objects live in the thread's OsmLuaProcessing.
+struct OsmObjectBatch {
+	size_t size() { return osmLuaProcessing->BatchSize(); }
+	void select(size_t index) { osmLuaProcessing->SelectBatchObject(index); }
+};
+
+#ifdef LUAJIT
+// ----	LuaJIT FFI fast paths
+//
+// kaguya's generic dispatch goes through the Lua C API, which LuaJIT can't
+// compile through: every Holds/Find/Layer/Attribute call aborts the trace.
+// These functions take plain pointer/length arguments so that process.lua can
+// call them via the FFI from inside a trace. They return 0 on success and -1
+// if an exception was thrown; the message is kept for the Lua side to raise.
+//
+// We pass them to Lua as lightuserdata and ffi.cast them there, rather than
+// relying on ffi.C symbol lookup, which would need the binary to be linked
+// with -rdynamic.
+
+thread_local std::string ffiLastError;
+
+extern "C" {
+
+static const char* ffiGetLastError() { return ffiLastError.c_str(); }
+
+static int ffiHolds(const char* key, size_t len) {
+	LuaProfiler::Timer timer("Holds");
+	if (osmLuaProcessing->isPostScanRelation)
+		return osmLuaProcessing->Holds(std::string(key, len)) ? 1 : 0;
+	return osmLuaProcessing->currentTags->getKey(key, len) >= 0 ? 1 : 0;
+}
+
+// Key handles are light userdata holding the interned ID + 1; returns false
+// (and sets the last error) if `handle` isn't one.
+static bool ffiKeyId(const void* handle, uint32_t& id) {
+	const uintptr_t value = reinterpret_cast<uintptr_t>(handle);
+	if (value == 0 || value > osmLuaProcessing->getInternedKeys().size()) {
+		ffiLastError = "Invalid tag key; use Key() to create one";
+		return false;
+	}
+	id = value - 1;
+	return true;
+}
+
+// As ffiHolds/ffiFind, for a key handle. Return -1 if it isn't one.
+static int ffiHoldsKey(const void* handle) {
+	LuaProfiler::Timer timer("Holds");
+	uint32_t id;
+	if (!ffiKeyId(handle, id)) return -1;
+	if (osmLuaProcessing->isPostScanRelation)
+		return osmLuaProcessing->Holds(osmLuaProcessing->getInternedKeys()[id]) ? 1 : 0;
+	return osmLuaProcessing->currentTags->getInternedKey(id, osmLuaProcessing->getInternedKeys()) >= 0 ? 1 : 0;
+}
+
+// Returns 1 and sets value/valueLen if the key is present, 0 if not.
+// The value points into the block's string table (or the relation's tag map
+// in the post-scan phase), so it's valid for the duration of the callback.
+static int ffiFind(const char* key, size_t len, const char** value, size_t* valueLen) {
+	LuaProfiler::Timer timer("Find");
+	if (osmLuaProcessing->isPostScanRelation) {
+		const std::string* found = osmLuaProcessing->findPostScanTag(std::string(key, len));
+		if (found == nullptr) return 0;
+		*value = found->data();
+		*valueLen = found->size();
+		return 1;
+	}
+
+	int64_t tagLoc = osmLuaProcessing->currentTags->getKey(key, len);
+	if (tagLoc < 0) return 0;
+	const protozero::data_view* found = osmLuaProcessing->currentTags->getValueFromKey(tagLoc);
+	*value = found->data();
+	*valueLen = found->size();
+	return 1;
+}
+
+static int ffiFindKey(const void* handle, const char** value, size_t* valueLen) {
+	LuaProfiler::Timer timer("Find");
+	uint32_t id;
+	if (!ffiKeyId(handle, id)) return -1;
+	if (osmLuaProcessing->isPostScanRelation) {
+		const std::string* found = osmLuaProcessing->findPostScanTag(osmLuaProcessing->getInternedKeys()[id]);
+		if (found == nullptr) return 0;
+		*value = found->data();
+		*valueLen = found->size();
+		return 1;
+	}
+
+	int64_t tagLoc = osmLuaProcessing->currentTags->getInternedKey(id, osmLuaProcessing->getInternedKeys());
+	if (tagLoc < 0) return 0;
+	const protozero::data_view* found = osmLuaProcessing->currentTags->getValueFromKey(tagLoc);
+	*value = found->data();
+	*valueLen = found->size();
+	return 1;
+}
+
+static int ffiLayer(const char* name, size_t len, int area) {
+	LuaProfiler::Timer timer("Layer");
+	try {
+		osmLuaProcessing->Layer(std::string(name, len), area != 0);
+		return 0;
+	} catch (std::exception &err) {
+		ffiLastError = err.what();
+		return -1;
+	}
+}
+
+static int ffiAttribute(const char* key, size_t keyLen, const char* val, size_t valLen, int minzoom) {
+	LuaProfiler::Timer timer("Attribute");
+	try {
+		osmLuaProcessing->Attribute(std::string(key, keyLen), protozero::data_view(val, valLen), minzoom);
+		return 0;
+	} catch (std::exception &err) {
+		ffiLastError = err.what();
+		return -1;
+	}
+}
+
+static int ffiAttributeNumeric(const char* key, size_t keyLen, double val, int minzoom) {
+	LuaProfiler::Timer timer("AttributeNumeric");
+	try {
+		osmLuaProcessing->AttributeNumeric(std::string(key, keyLen), val, minzoom);
+		return 0;
+	} catch (std::exception &err) {
+		ffiLastError = err.what();
+		return -1;
+	}
+}
+
+static int ffiAttributeBoolean(const char* key, size_t keyLen, int val, int minzoom) {
+	LuaProfiler::Timer timer("AttributeBoolean");
+	try {
+		osmLuaProcessing->AttributeBoolean(std::string(key, keyLen), val != 0, minzoom);
+		return 0;
+	} catch (std::exception &err) {
+		ffiLastError = err.what();
+		return -1;
+	}
+}
+
+static void ffiMinZoom(double z) { LuaProfiler::Timer timer("MinZoom"); osmLuaProcessing->MinZoom(z); }
+static void ffiZOrder(double z) { LuaProfiler::Timer timer("ZOrder"); osmLuaProcessing->ZOrder(z); }
+
+}
+
+// Replaces the kaguya-bound globals with FFI wrappers. Arguments the fast
+// paths don't handle (e.g. numbers passed to Attribute) fall back to the
+// original kaguya functions, so behaviour is unchanged.
+const char* luaJitFfiPrelude = R"LUA(
+local fns = ...
+local ffi = require("ffi")
+
+local lastError = ffi.cast("const char* (*)(void)", fns.lastError)
+local holds = ffi.cast("int (*)(const char*, size_t)", fns.holds)
+local find = ffi.cast("int (*)(const char*, size_t, const char**, size_t*)", fns.find)
+local holdsKey = ffi.cast("int (*)(const void*)", fns.holdsKey)
+local findKey = ffi.cast("int (*)(const void*, const char**, size_t*)", fns.findKey)
+local layer = ffi.cast("int (*)(const char*, size_t, int)", fns.layer)
+local attribute = ffi.cast("int (*)(const char*, size_t, const char*, size_t, int)", fns.attribute)
+local attributeNumeric = ffi.cast("int (*)(const char*, size_t, double, int)", fns.attributeNumeric)
+local attributeBoolean = ffi.cast("int (*)(const char*, size_t, int, int)", fns.attributeBoolean)
+local minZoom = ffi.cast("void (*)(double)", fns.minZoom)
+local zOrder = ffi.cast("void (*)(double)", fns.zOrder)
+
+local findValue = ffi.new("const char*[1]")
+local findLen = ffi.new("size_t[1]")
+local type = type
+
+local kaguyaHolds, kaguyaFind, kaguyaLayer = Holds, Find, Layer
+local kaguyaAttribute, kaguyaAttributeNumeric, kaguyaAttributeBoolean = Attribute, AttributeNumeric, AttributeBoolean
+local kaguyaMinZoom, kaguyaZOrder = MinZoom, ZOrder
+
+local function check(rv)
+	if rv ~= 0 then error(ffi.string(lastError()), 3) end
+end
+
+-- Key handles (from Key()) are light userdata
+Holds = function(key)
+	local t = type(key)
+	if t == "userdata" then
+		local rv = holdsKey(key)
+		if rv < 0 then error(ffi.string(lastError()), 2) end
+		return rv ~= 0
+	end
+	if t ~= "string" then return kaguyaHolds(key) end
+	return holds(key, #key) ~= 0
+end
+
+Find = function(key)
+	local t = type(key)
+	if t == "userdata" then
+		local rv = findKey(key, findValue, findLen)
+		if rv < 0 then error(ffi.string(lastError()), 2) end
+		if rv == 0 then return "" end
+		return ffi.string(findValue[0], findLen[0])
+	end
+	if t ~= "string" then return kaguyaFind(key) end
+	if find(key, #key, findValue, findLen) == 0 then return "" end
+	return ffi.string(findValue[0], findLen[0])
+end
+
+Layer = function(name, area)
+	if type(name) ~= "string" then return kaguyaLayer(name, area) end
+	check(layer(name, #name, area and 1 or 0))
+end
+
+Attribute = function(key, val, minzoom)
+	if type(key) ~= "string" or type(val) ~= "string" then return kaguyaAttribute(key, val, minzoom) end
+	check(attribute(key, #key, val, #val, minzoom or 0))
+end
+
+AttributeNumeric = function(key, val, minzoom)
+	if type(key) ~= "string" or type(val) ~= "number" then return kaguyaAttributeNumeric(key, val, minzoom) end
+	check(attributeNumeric(key, #key, val, minzoom or 0))
+end
+
+AttributeBoolean = function(key, val, minzoom)
+	if type(key) ~= "string" or type(val) ~= "boolean" then return kaguyaAttributeBoolean(key, val, minzoom) end
+	check(attributeBoolean(key, #key, val and 1 or 0, minzoom or 0))
+end
+
+MinZoom = function(z)
+	if type(z) ~= "number" then return kaguyaMinZoom(z) end
+	minZoom(z)
+end
+
+ZOrder = function(z)
+	if type(z) ~= "number" then return kaguyaZOrder(z) end
+	zOrder(z)
+end
+)LUA";
+
+template<typename F>
+void setFfiFunction(lua_State* L, const char* name, F* fn) {
+	lua_pushlightuserdata(L, reinterpret_cast<void*>(fn));
+	lua_setfield(L, -2, name);
+}
+
+// Install the FFI wrappers; if the FFI isn't available, keep the kaguya bindings.
+void registerLuaJitFfi(lua_State* L) {
+	if (luaL_loadbuffer(L, luaJitFfiPrelude, strlen(luaJitFfiPrelude), "=tilemaker_ffi") != 0) {
+		if (verbose) std::cerr << "LuaJIT FFI bindings not loaded: " << lua_tostring(L, -1) << std::endl;
+		lua_pop(L, 1);
+		return;
+	}
+
+	lua_createtable(L, 0, 11);
+	setFfiFunction(L, "lastError", &ffiGetLastError);
+	setFfiFunction(L, "holds", &ffiHolds);
+	setFfiFunction(L, "find", &ffiFind);
+	setFfiFunction(L, "holdsKey", &ffiHoldsKey);
+	setFfiFunction(L, "findKey", &ffiFindKey);
+	setFfiFunction(L, "layer", &ffiLayer);
+	setFfiFunction(L, "attribute", &ffiAttribute);
+	setFfiFunction(L, "attributeNumeric", &ffiAttributeNumeric);
+	setFfiFunction(L, "attributeBoolean", &ffiAttributeBoolean);
+	setFfiFunction(L, "minZoom", &ffiMinZoom);
+	setFfiFunction(L, "zOrder", &ffiZOrder);
+
+	if (lua_pcall(L, 1, 0, 0) != 0) {
+		if (verbose) std::cerr << "LuaJIT FFI bindings not loaded: " << lua_tostring(L, -1) << std::endl;
+		lua_pop(L, 1);
+	}
+}
+#endif
 
 
 bool supportsRemappingShapefiles = false;
@@ -177,7 +498,8 @@ OsmLuaProcessing::OsmLuaProcessing(
 	const class ShpMemTiles &shpMemTiles, 
 	class OsmMemTiles &osmMemTiles,
 	AttributeStore &attributeStore,
-	bool materializeGeometries):
+	bool materializeGeometries,
+	const TagRules* tagRules):
 	osmStore(osmStore),
 	shpMemTiles(shpMemTiles),
 	osmMemTiles(osmMemTiles),
@@ -185,13 +507,23 @@ OsmLuaProcessing::OsmLuaProcessing(
 	config(configIn),
 	currentTags(NULL),
 	layers(layers),
-	materializeGeometries(materializeGeometries) {
+	materializeGeometries(materializeGeometries),
+	tagRules(tagRules) {
 
 	sigusr1Handler.initialize();
 
 	// ----	Initialise Lua
+	if (LuaProfiler::enabled()) {
+		profiler.reset(new LuaProfiler());
+		profiler->install(luaState.state());
+	}
 	g_luaState = &luaState;
 	luaState.setErrorHandler(lua_error_handler);
+
+	// Key() is available while the profile loads, so that keys can be
+	// interned once, e.g. `local HIGHWAY = Key("highway")`
+	osmLuaProcessing = this;
+	luaState["Key"] = &rawKey;
 	luaState.dofile(luaFile.c_str());
 
 	osmLuaProcessing = this;
@@ -212,16 +544,16 @@ OsmLuaProcessing::OsmLuaProcessing(
 	luaState["Layer"] = &rawLayer;
 	luaState["LayerAsCentroid"] = &rawLayerAsCentroid;
 	luaState["Attribute"] = kaguya::overload(
-			[](const std::string &key, const protozero::data_view val) { osmLuaProcessing->Attribute(key, val, 0); },
-			[](const std::string &key, const protozero::data_view val, const char minzoom) { osmLuaProcessing->Attribute(key, val, minzoom); }
+			[](const std::string &key, const protozero::data_view val) { LuaProfiler::Timer timer("Attribute"); osmLuaProcessing->Attribute(key, val, 0); },
+			[](const std::string &key, const protozero::data_view val, const char minzoom) { LuaProfiler::Timer timer("Attribute"); osmLuaProcessing->Attribute(key, val, minzoom); }
 	);
 	luaState["AttributeNumeric"] = kaguya::overload(
-			[](const std::string &key, const float val) { osmLuaProcessing->AttributeNumeric(key, val, 0); },
-			[](const std::string &key, const float val, const char minzoom) { osmLuaProcessing->AttributeNumeric(key, val, minzoom); }
+			[](const std::string &key, const float val) { LuaProfiler::Timer timer("AttributeNumeric"); osmLuaProcessing->AttributeNumeric(key, val, 0); },
+			[](const std::string &key, const float val, const char minzoom) { LuaProfiler::Timer timer("AttributeNumeric"); osmLuaProcessing->AttributeNumeric(key, val, minzoom); }
 	);
 	luaState["AttributeBoolean"] = kaguya::overload(
-			[](const std::string &key, const bool val) { osmLuaProcessing->AttributeBoolean(key, val, 0); },
-			[](const std::string &key, const bool val, const char minzoom) { osmLuaProcessing->AttributeBoolean(key, val, minzoom); }
+			[](const std::string &key, const bool val) { LuaProfiler::Timer timer("AttributeBoolean"); osmLuaProcessing->AttributeBoolean(key, val, 0); },
+			[](const std::string &key, const bool val, const char minzoom) { LuaProfiler::Timer timer("AttributeBoolean"); osmLuaProcessing->AttributeBoolean(key, val, minzoom); }
 	);
 
 	luaState["MinZoom"] = &rawMinZoom;
@@ -230,14 +562,25 @@ OsmLuaProcessing::OsmLuaProcessing(
 	luaState["NextRelation"] = &rawNextRelation;
 	luaState["RestartRelations"] = &rawRestartRelations;
 	luaState["FindInRelation"] = &rawFindInRelation;
+	luaState["OsmObjectBatch"].setClass(kaguya::UserdataMetatable<OsmObjectBatch>()
+		.addFunction("size", &OsmObjectBatch::size)
+		.addFunction("select", &OsmObjectBatch::select)
+		.addFunction("__len", &OsmObjectBatch::size)
+	);
+#ifdef LUAJIT
+	registerLuaJitFfi(luaState.state());
+#endif
 	supportsRemappingShapefiles = !!luaState["attribute_function"];
 	supportsReadingRelations    = !!luaState["relation_scan_function"];
 	supportsPostScanRelations   = !!luaState["relation_postscan_function"];
 	supportsWritingRelations    = !!luaState["relation_function"];
+	supportsNodeBatches         = !!luaState["node_batch_function"];
+	supportsWayBatches          = !!luaState["way_batch_function"];
 
 	// ---- Call init_function of Lua logic
 
 	if (!!luaState["init_function"]) {
+		LuaProfiler::Timer timer("init_function", true);
 		luaState["init_function"](this->config.projectName);
 	}
 }
@@ -274,11 +617,20 @@ bool OsmLuaProcessing::canWriteRelations() {
 	return supportsWritingRelations;
 }
 
+bool OsmLuaProcessing::canProcessNodeBatches() {
+	return supportsNodeBatches;
+}
+
+bool OsmLuaProcessing::canProcessWayBatches() {
+	return supportsWayBatches;
+}
+
 kaguya::LuaTable OsmLuaProcessing::newTable() {
 	return luaState.newTable();//kaguya::LuaTable(luaState);
 }
 
 kaguya::LuaTable OsmLuaProcessing::remapAttributes(kaguya::LuaTable& in_table, const std::string &layerName) {
+	LuaProfiler::Timer timer("attribute_function", true);
 	kaguya::LuaTable out_table = luaState["attribute_function"].call<kaguya::LuaTable>(in_table, layerName);
 	return out_table;
 }
@@ -304,6 +656,13 @@ const string OsmLuaProcessing::Find(const string& key) const {
 	return it->second;
 }
 
+// As Find, but without copying the value (nullptr if absent)
+const string* OsmLuaProcessing::findPostScanTag(const string& key) const {
+	auto it = currentPostScanTags->find(key);
+	if (it == currentPostScanTags->end()) return nullptr;
+	return &it->second;
+}
+
 // Check if an object has any tags
 bool OsmLuaProcessing::HasTags() const {
 	return isPostScanRelation ? !currentPostScanTags->empty() : !currentTags->empty();
@@ -351,17 +710,12 @@ double OsmLuaProcessing::AreaIntersecting(const string &layerName) {
 
 
 template <typename GeometryT>
-std::vector<uint> OsmLuaProcessing::intersectsQuery(const string &layerName, bool once, GeometryT &geom) const {
-	Box box; geom::envelope(geom, box);
+std::vector<uint> OsmLuaProcessing::intersectsQuery(const string &layerName, bool once, GeometryT &geom) {
+	Box box = bboxCached();
 	if (!shpMemTiles.mayIntersect(layerName, box))
 		return std::vector<uint>();
 
 	std::vector<uint> ids = shpMemTiles.QueryMatchingGeometries(layerName, once, box,
-		[&](const RTree &rtree) { // indexQuery
-			vector<IndexValue> results;
-			rtree.query(geom::index::intersects(box), back_inserter(results));
-			return results;
-		},
 		[&](OutputObject const &oo) { // checkQuery
 			return geom::intersects(geom, shpMemTiles.retrieveMultiPolygon(oo.objectID));
 		}
@@ -370,8 +724,8 @@ std::vector<uint> OsmLuaProcessing::intersectsQuery(const string &layerName, boo
 }
 
 template <typename GeometryT>
-double OsmLuaProcessing::intersectsArea(const string &layerName, GeometryT &geom) const {
-	Box box; geom::envelope(geom, box);
+double OsmLuaProcessing::intersectsArea(const string &layerName, GeometryT &geom) {
+	Box box = bboxCached();
 	double area = 0.0;
 	std::vector<uint> ids = shpMemTiles.QueryMatchingGeometries(layerName, false, box,
 		[&](const RTree &rtree) { // indexQuery
@@ -390,14 +744,9 @@ double OsmLuaProcessing::intersectsArea(const string &layerName, GeometryT &geom
 }
 
 template <typename GeometryT>
-std::vector<uint> OsmLuaProcessing::coveredQuery(const string &layerName, bool once, GeometryT &geom) const {
-	Box box; geom::envelope(geom, box);
+std::vector<uint> OsmLuaProcessing::coveredQuery(const string &layerName, bool once, GeometryT &geom) {
+	Box box = bboxCached();
 	std::vector<uint> ids = shpMemTiles.QueryMatchingGeometries(layerName, once, box,
-		[&](const RTree &rtree) { // indexQuery
-			vector<IndexValue> results;
-			rtree.query(geom::index::intersects(box), back_inserter(results));
-			return results;
-		},
 		[&](OutputObject const &oo) { // checkQuery
 			if (oo.geomType!=POLYGON_) return false; // can only be covered by a polygon!
 			return geom::covered_by(geom, shpMemTiles.retrieveMultiPolygon(oo.objectID));
@@ -417,30 +766,8 @@ void reverse_project(DegPoint& p) {
 }
 
 // Returns area
-double OsmLuaProcessing::Area() {
-	if (!IsClosed()) return 0;
-
-#if BOOST_VERSION >= 106700
-	geom::strategy::area::spherical<> sph_strategy(RadiusMeter);
-	if (isRelation) {
-		// Boost won't calculate area of a multipolygon, so we just total up the member polygons
-		return multiPolygonArea(multiPolygonCached());
-	} else if (isWay) {
-		// Reproject back into lat/lon and then run Boo
-		geom::model::polygon<DegPoint> p;
-		geom::assign(p,polygonCached());
-		geom::for_each_point(p, reverse_project);
-		return geom::area(p, sph_strategy);
-	}
-#else
-	if (isRelation) {
-		return geom::area(multiPolygonCached());
-	} else if (isWay) {
-		return geom::area(polygonCached());
-	}
-#endif
-
-	return 0;
+double OsmLuaProcessing::Area(kaguya::VariadicArgType mode) {
+	return areaCached(parseMeasureMode(mode));
 }
 
 double OsmLuaProcessing::multiPolygonArea(const MultiPolygon &mp) const {
@@ -456,15 +783,18 @@ double OsmLuaProcessing::multiPolygonArea(const MultiPolygon &mp) const {
 }
 
 // Returns length
-double OsmLuaProcessing::Length() {
-	if (isWay && !isRelation) {
-		geom::model::linestring<DegPoint> l;
-		geom::assign(l, linestringCached());
-		geom::for_each_point(l, reverse_project);
-		return geom::length(l, geom::strategy::distance::haversine<float>(RadiusMeter));
+double OsmLuaProcessing::Length(kaguya::VariadicArgType mode) {
+	return lengthCached(parseMeasureMode(mode));
+}
+
+OsmLuaProcessing::MeasureMode OsmLuaProcessing::parseMeasureMode(kaguya::VariadicArgType mode) const {
+	for (auto modeRef : mode) {
+		const std::string name = modeRef.get<std::string>();
+		if (name == "planar") return MeasureMode::Planar;
+		if (name == "geodesic") return MeasureMode::Geodesic;
+		throw std::runtime_error("unknown measurement mode " + name);
 	}
-	// multi_polygon would be calculated as zero
-	return 0;
+	return MeasureMode::Geodesic;
 }
 
 // Cached geometries creation
@@ -502,6 +832,106 @@ const MultiPolygon &OsmLuaProcessing::multiPolygonCached() {
 	return multiPolygonCache;
 }
 
+// Cached measurements
+//
+// The planar approximations measure in projected (spherical Mercator)
+// coordinates, and correct for Mercator's scale factor at the object's
+// latitude. They're close to the geodesic values for objects that don't span
+// much latitude, which is nearly all of them.
+
+// Metres per degree of longitude at the equator, and so per projected degree
+const double MetresPerDegree = RadiusMeter * M_PI / 180.0;
+
+double OsmLuaProcessing::areaCached(MeasureMode mode) {
+	const int slot = static_cast<int>(mode);
+	if (areaInited[slot]) return areaCache[slot];
+
+	double area = 0;
+	if (!IsClosed()) {
+		// not an area
+	} else if (mode == MeasureMode::Planar) {
+		const double projected = isRelation ? geom::area(multiPolygonCached()) : geom::area(polygonCached());
+		const Box &box = bboxCached();
+		const double scale = MetresPerDegree * cos(latp2lat((box.min_corner().y() + box.max_corner().y()) / 2) * M_PI / 180.0);
+		area = fabs(projected) * scale * scale;
+	} else {
+#if BOOST_VERSION >= 106700
+		geom::strategy::area::spherical<> sph_strategy(RadiusMeter);
+		if (isRelation) {
+			// Boost won't calculate area of a multipolygon, so we just total up the member polygons
+			area = multiPolygonArea(multiPolygonCached());
+		} else if (isWay) {
+			// Reproject back into lat/lon and then run Boo
+			geom::model::polygon<DegPoint> p;
+			geom::assign(p,polygonCached());
+			geom::for_each_point(p, reverse_project);
+			area = geom::area(p, sph_strategy);
+		}
+#else
+		if (isRelation) {
+			area = geom::area(multiPolygonCached());
+		} else if (isWay) {
+			area = geom::area(polygonCached());
+		}
+#endif
+	}
+
+	areaInited[slot] = true;
+	areaCache[slot] = area;
+	return area;
+}
+
+double OsmLuaProcessing::lengthCached(MeasureMode mode) {
+	const int slot = static_cast<int>(mode);
+	if (lengthInited[slot]) return lengthCache[slot];
+
+	double length = 0;
+	// multi_polygon would be calculated as zero
+	if (isWay && !isRelation) {
+		const Linestring &ls = linestringCached();
+		if (mode == MeasureMode::Planar) {
+			for (size_t i = 1; i < ls.size(); i++) {
+				const double midLat = latp2lat((ls[i - 1].y() + ls[i].y()) / 2);
+				length += geom::distance(ls[i - 1], ls[i]) * MetresPerDegree * cos(midLat * M_PI / 180.0);
+			}
+		} else {
+			geom::model::linestring<DegPoint> l;
+			geom::assign(l, ls);
+			geom::for_each_point(l, reverse_project);
+			length = geom::length(l, geom::strategy::distance::haversine<float>(RadiusMeter));
+		}
+	}
+
+	lengthInited[slot] = true;
+	lengthCache[slot] = length;
+	return length;
+}
+
+Point OsmLuaProcessing::centroidCached(CentroidAlgorithm algorithm) {
+	const int slot = static_cast<int>(algorithm);
+	if (!centroidInited[slot]) {
+		centroidCache[slot] = calculateCentroid(algorithm);
+		centroidInited[slot] = true;
+	}
+	return centroidCache[slot];
+}
+
+const Box &OsmLuaProcessing::bboxCached() {
+	if (!bboxInited) {
+		if (isRelation) {
+			if (isClosed) geom::envelope(multiPolygonCached(), bboxCache);
+			else geom::envelope(multiLinestringCached(), bboxCache);
+		} else if (isWay) {
+			geom::envelope(linestringCached(), bboxCache);
+		} else {
+			const Point p = getPoint();
+			bboxCache = Box(p, p);
+		}
+		bboxInited = true;
+	}
+	return bboxCache;
+}
+
 // ----	Requests from Lua to write this way/node to a vector tile's Layer
 
 // Add object to specified layer from Lua
@@ -691,7 +1121,7 @@ void OsmLuaProcessing::LayerAsCentroid(const string &layerName, kaguya::Variadic
 		}
 
 		if (!centroidFound)
-			geomp = calculateCentroid(algorithm);
+			geomp = centroidCached(algorithm);
 
 		// TODO: I think geom::is_empty always returns false for Points?
 		// See https://github.com/boostorg/geometry/blob/fa3623528ea27ba2c3c1327e4b67408a2b567038/include/boost/geometry/algorithms/is_empty.hpp#L103
@@ -797,7 +1227,7 @@ kaguya::optional<std::vector<double>> OsmLuaProcessing::Centroid(kaguya::Variadi
 		break;
 	}
 	try {
-		Point c = calculateCentroid(algorithm);
+		Point c = centroidCached(algorithm);
 		return std::vector<double> { latp2lat(c.y()/10000000.0), c.x()/10000000.0 };
 	} catch (geom::centroid_exception &err) {
 		if (verbose) cerr << "Problem geometry " << (isRelation ? "relation " : isWay ? "way " : "node " ) << originalOsmID << ": " << err.what() << endl;
@@ -924,6 +1354,7 @@ bool OsmLuaProcessing::scanRelation(WayID id, const TagMap& tags) {
 	isRelation = true;
 	currentTags = &tags;
 	try {
+		LuaProfiler::Timer timer("relation_scan_function", true);
 		luaState["relation_scan_function"]();
 	} catch(luaProcessingException &e) {
 		std::cerr << "Lua error on scanning relation " << originalOsmID << std::endl;
@@ -948,11 +1379,12 @@ void OsmLuaProcessing::postScanRelations() {
 		originalOsmID = id;
 		currentPostScanTags = &(osmStore.scannedRelations.relation_tags(id));
 		relationList = osmStore.scannedRelations.relations_for_relation_with_parents(id);
+		LuaProfiler::Timer timer("relation_postscan_function", true);
 		luaState["relation_postscan_function"](this);
 	}
 }
 
-bool OsmLuaProcessing::setNode(NodeID id, LatpLon node, const TagMap& tags) {
+void OsmLuaProcessing::beginNode(NodeID id, LatpLon node, const TagMap& tags) {
 	reset();
 	originalOsmID = id;
 	lon = node.lon;
@@ -962,17 +1394,11 @@ bool OsmLuaProcessing::setNode(NodeID id, LatpLon node, const TagMap& tags) {
 	if (supportsReadingRelations && osmStore.scannedRelations.node_in_any_relations(id)) {
 		relationList = osmStore.scannedRelations.relations_for_node(id);
 	}
+}
 
-	//Start Lua processing for node
-	try {
-		luaState["node_function"]();
-	} catch(luaProcessingException &e) {
-		std::cerr << "Lua error on node " << originalOsmID << std::endl;
-		exit(1);
-	}
-
+bool OsmLuaProcessing::finishNode() {
 	if (!this->empty()) {
-		TileCoordinates index = latpLon2index(node, this->config.baseZoom);
+		TileCoordinates index = latpLon2index(LatpLon{latp, lon}, this->config.baseZoom);
 
 		for (auto &output : finalizeOutputs()) {
 			osmMemTiles.addObjectToSmallIndex(index, output, originalOsmID);
@@ -984,8 +1410,23 @@ bool OsmLuaProcessing::setNode(NodeID id, LatpLon node, const TagMap& tags) {
 	return false;
 }
 
-// We are now processing a way
-bool OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const TagMap& tags) {
+bool OsmLuaProcessing::setNode(NodeID id, LatpLon node, const TagMap& tags) {
+	beginNode(id, node, tags);
+	if (applyTagRules()) return finishNode();
+
+	//Start Lua processing for node
+	try {
+		LuaProfiler::Timer timer("node_function", true);
+		luaState["node_function"]();
+	} catch(luaProcessingException &e) {
+		std::cerr << "Lua error on node " << originalOsmID << std::endl;
+		exit(1);
+	}
+
+	return finishNode();
+}
+
+void OsmLuaProcessing::beginWay(WayID wayId, LatpLonVec const &llVec, const TagMap& tags) {
 	reset();
 	wayEmitted = false;
 	originalOsmID = wayId;
@@ -1009,26 +1450,204 @@ bool OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const TagMap
 	}
 
 	currentTags = &tags;
+}
+
+bool OsmLuaProcessing::finishWay() {
+	if (!this->empty()) {
+		osmMemTiles.addGeometryToIndex(linestringCached(), finalizeOutputs(), originalOsmID);
+		return wayEmitted;
+	}
+
+	return false;
+}
+
+// We are now processing a way
+bool OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const TagMap& tags) {
+	beginWay(wayId, llVec, tags);
+	if (applyTagRules()) return finishWay();
+
+	//Start Lua processing for way
+	try {
+		LuaProfiler::Timer timer("way_function", true);
+		kaguya::LuaFunction way_function = luaState["way_function"];
+		kaguya::LuaRef ret = way_function();
+		assert(!ret);
+	} catch(luaProcessingException &e) {
+		std::cerr << "Lua error on way " << originalOsmID << std::endl;
+		exit(1);
+	}
 
-	bool ok = true;
-	if (ok) {
-		//Start Lua processing for way
+	return finishWay();
+}
+
+// ----	Declarative rules
+
+bool OsmLuaProcessing::applyTagRules() {
+	const bool handled = matchTagRules();
+	outputTagRules();
+	return handled;
+}
+
+bool OsmLuaProcessing::matchTagRules() {
+	matchedRules.clear();
+	if (tagRules == nullptr || tagRules->empty()) return false;
+
+	tagRules->matching(*currentTags, isWay, matchedRules);
+	if (matchedRules.empty()) return false;
+
+	for (const TagRule* rule : matchedRules)
+		if (rule->callLua) return false;
+	return true;
+}
+
+void OsmLuaProcessing::outputTagRules() {
+	for (const TagRule* rule : matchedRules) {
+		if (rule->layer.empty()) continue;
+
+		// Layer() doesn't add an output if the geometry is invalid
+		size_t outputCount = outputs.size();
+		Layer(rule->layer, rule->area);
+		if (outputs.size() == outputCount) continue;
+		if (rule->minzoom >= 0) MinZoom(rule->minzoom);
+		if (rule->hasZOrder) ZOrder(rule->zorder);
+
+		for (const auto& attribute : rule->attributes) {
+			switch (attribute.type) {
+				case TagRuleAttribute::Type::String:
+					Attribute(attribute.key, protozero::data_view(attribute.stringValue.data(), attribute.stringValue.size()), attribute.minzoom);
+					break;
+				case TagRuleAttribute::Type::Tag: {
+					int64_t keyLoc = currentTags->getKey(attribute.stringValue.data(), attribute.stringValue.size());
+					if (keyLoc >= 0) Attribute(attribute.key, *currentTags->getValueFromKey(keyLoc), attribute.minzoom);
+					break;
+				}
+				case TagRuleAttribute::Type::Number:
+					AttributeNumeric(attribute.key, attribute.numberValue, attribute.minzoom);
+					break;
+				case TagRuleAttribute::Type::Boolean:
+					AttributeBoolean(attribute.key, attribute.booleanValue, attribute.minzoom);
+					break;
+			}
+		}
+	}
+}
+
+// ----	Batch processing
+
+void OsmLuaProcessing::setNodeBatch(const std::vector<BatchNode>& nodes, std::vector<char>& emitted) {
+	reset();
+	emitted.assign(nodes.size(), false);
+	nodeBatch = &nodes;
+	batchEmitted = &emitted;
+	prepareBatch(nodes.size());
+
+	if (!batchIndices.empty()) {
+		OsmObjectBatch batch;
 		try {
-			kaguya::LuaFunction way_function = luaState["way_function"];
-			kaguya::LuaRef ret = way_function();
-			assert(!ret);
+			LuaProfiler::Timer timer("node_batch_function", true);
+			luaState["node_batch_function"](&batch);
 		} catch(luaProcessingException &e) {
-			std::cerr << "Lua error on way " << originalOsmID << std::endl;
+			std::cerr << "Lua error on node " << originalOsmID << " in batch" << std::endl;
 			exit(1);
 		}
+		finishBatchObject();
 	}
 
-	if (!this->empty()) {
-		osmMemTiles.addGeometryToIndex(linestringCached(), finalizeOutputs(), originalOsmID);
-		return wayEmitted;
+	nodeBatch = nullptr;
+	batchEmitted = nullptr;
+}
+
+void OsmLuaProcessing::setWayBatch(const std::vector<BatchWay>& ways, std::vector<char>& emitted) {
+	reset();
+	emitted.assign(ways.size(), false);
+	wayBatch = &ways;
+	batchEmitted = &emitted;
+	prepareBatch(ways.size());
+
+	if (!batchIndices.empty()) {
+		OsmObjectBatch batch;
+		try {
+			LuaProfiler::Timer timer("way_batch_function", true);
+			luaState["way_batch_function"](&batch);
+		} catch(luaProcessingException &e) {
+			std::cerr << "Lua error on way " << originalOsmID << " in batch" << std::endl;
+			exit(1);
+		}
+		finishBatchObject();
 	}
 
-	return false;
+	wayBatch = nullptr;
+	batchEmitted = nullptr;
+}
+
+// Objects handled entirely by --rules are output straight away; the batch
+// that Lua sees only contains the rest. Rules are only matched here, not
+// output, for objects that go to Lua, as Layer() may store their geometry.
+void OsmLuaProcessing::prepareBatch(size_t size) {
+	batchIndices.clear();
+	batchSelected = -1;
+
+	if (tagRules == nullptr || tagRules->empty()) {
+		for (size_t i = 0; i < size; i++)
+			batchIndices.push_back(i);
+		return;
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		beginBatchObject(i);
+		if (matchTagRules()) {
+			outputTagRules();
+			batchSelected = i;
+			finishBatchObject();
+		} else {
+			batchIndices.push_back(i);
+		}
+	}
+	reset();
+}
+
+void OsmLuaProcessing::beginBatchObject(size_t i) {
+	if (nodeBatch) {
+		const BatchNode& node = (*nodeBatch)[i];
+		beginNode(node.id, node.node, *node.tags);
+	} else {
+		const BatchWay& way = (*wayBatch)[i];
+		beginWay(way.id, *way.llVec, *way.tags);
+	}
+}
+
+size_t OsmLuaProcessing::BatchSize() const {
+	return batchIndices.size();
+}
+
+// Select the i'th (1-based) object of the batch, storing the outputs of the previous one
+void OsmLuaProcessing::SelectBatchObject(size_t index) {
+	if (index < 1 || index > BatchSize())
+		throw std::out_of_range("batch:select(" + to_string(index) + ") is out of range, batch size is " + to_string(BatchSize()));
+
+	finishBatchObject();
+	batchSelected = batchIndices[index - 1];
+	beginBatchObject(batchSelected);
+	// Objects with call_lua rules get the rules' outputs as well as Lua's
+	applyTagRules();
+}
+
+void OsmLuaProcessing::finishBatchObject() {
+	if (batchSelected < 0) return;
+	int i = batchSelected;
+	batchSelected = -1;
+
+	if (nodeBatch) {
+		(*batchEmitted)[i] = finishNode();
+		return;
+	}
+
+	try {
+		(*batchEmitted)[i] = finishWay();
+	} catch (std::out_of_range &err) {
+		// Way is missing a node?
+		cerr << endl << err.what() << endl;
+	}
 }
 
 // We are now processing a relation
@@ -1060,8 +1679,12 @@ void OsmLuaProcessing::setRelation(
 
 	// Start Lua processing for relation
 	if (!isNativeMP && !supportsWritingRelations) return;
+	bool handledByRules = isNativeMP && applyTagRules();
 	try {
-		luaState[isNativeMP ? "way_function" : "relation_function"]();
+		if (!handledByRules) {
+			LuaProfiler::Timer timer(isNativeMP ? "way_function (multipolygon)" : "relation_function", true);
+			luaState[isNativeMP ? "way_function" : "relation_function"]();
+		}
 	} catch(luaProcessingException &e) {
 		std::cerr << "Lua error on relation " << originalOsmID << std::endl;
 		exit(1);
@@ -1,6 +1,7 @@
 #include "osm_mem_tiles.h"
 #include "node_store.h"
 #include "way_store.h"
+#include "index_file.h"
 using namespace std;
 
 thread_local GeometryCache<Linestring> linestringCache;
@@ -132,3 +133,74 @@ void OsmMemTiles::Clear() {
 	for (auto& entry : objectsWithIds)
 		entry.clear();
 }
+
+void OsmMemTiles::saveReferencedGeometries(IndexFileWriter& writer) const {
+	std::vector<NodeID> nodes;
+	std::vector<WayID> ways;
+	auto addReference = [&](const OutputObject& oo) {
+		if (IS_NODE(oo.objectID))
+			nodes.push_back(OSM_ID(oo.objectID));
+		else if (IS_WAY(oo.objectID))
+			ways.push_back(OSM_ID(oo.objectID));
+	};
+
+	for (const auto& tile : objects)
+		for (const auto& chunk : tile.payloads.vecs)
+			for (const auto& oo : chunk)
+				addReference(oo);
+	for (const auto& tile : objectsWithIds)
+		for (const auto& chunk : tile.payloads.vecs)
+			for (const auto& oo : chunk)
+				addReference(oo.oo);
+	for (const auto& entry : boxRtree)
+		addReference(entry.second);
+	for (const auto& entry : boxRtreeWithIds)
+		addReference(entry.second.oo);
+
+	std::sort(nodes.begin(), nodes.end());
+	nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+	std::sort(ways.begin(), ways.end());
+	ways.erase(std::unique(ways.begin(), ways.end()), ways.end());
+
+	writer.section("NODE");
+	writer.write<uint64_t>(nodes.size());
+	for (const NodeID id : nodes) {
+		writer.write(id);
+		writer.write(nodeStore.at(id));
+	}
+
+	writer.section("WAYS");
+	writer.write<uint64_t>(ways.size());
+	for (const WayID id : ways) {
+		writer.write(id);
+		writer.writeArray(wayStore.at(id));
+	}
+}
+
+void OsmMemTiles::loadReferencedGeometries(IndexFileReader& reader, NodeStore& nodeStore, WayStore& wayStore, size_t threadNum) {
+	reader.section("NODE");
+	std::vector<NodeStore::element_t> nodes;
+	const uint64_t nodeCount = reader.read<uint64_t>();
+	for (uint64_t i = 0; i < nodeCount; i++) {
+		const NodeID id = reader.read<NodeID>();
+		nodes.push_back(std::make_pair(id, reader.read<LatpLon>()));
+		if (nodes.size() == 65536 || i + 1 == nodeCount) {
+			nodeStore.insert(nodes);
+			nodes.clear();
+		}
+	}
+	nodeStore.finalize(threadNum);
+
+	reader.section("WAYS");
+	std::vector<WayStore::ll_element_t> ways;
+	const uint64_t wayCount = reader.read<uint64_t>();
+	for (uint64_t i = 0; i < wayCount; i++) {
+		ways.push_back(std::make_pair(reader.read<WayID>(), WayStore::latplon_vector_t()));
+		reader.readArray(ways.back().second);
+		if (ways.size() == 4096 || i + 1 == wayCount) {
+			wayStore.insertLatpLons(ways);
+			ways.clear();
+		}
+	}
+	wayStore.finalize(threadNum);
+}
@@ -33,26 +33,45 @@ std::ostream& operator<<(std::ostream& os, OutputGeometryType geomType)
 
 void OutputObject::writeAttributes(
 	const AttributeStore& attributeStore,
+	vtzero::layer_builder& vtLayer,
+	LayerAttributeCache& cache,
 	vtzero::feature_builder& fbuilder,
 	char zoom
 ) const {
-	auto attr = attributeStore.getUnsafe(attributes);
+	const uint32_t sliceId = attributeStore.zoomSliceId(attributes, zoom);
+	auto cached = cache.sets.find(sliceId);
+	if (cached == cache.sets.end()) {
+		std::vector<vtzero::index_value_pair> properties;
+		auto attr = attributeStore.getZoomSliceUnsafe(attributes, zoom);
 
-	for(auto const &it: attr) {
-		if (it->minzoom > zoom) continue;
+		for(auto const &it: attr) {
+			// Look for key
+			if (cache.keys.size() <= it->keyIndex)
+				cache.keys.resize(it->keyIndex + 1);
+			vtzero::index_value& key = cache.keys[it->keyIndex];
+			if (!key.valid())
+				key = vtLayer.add_key(attributeStore.keyStore.getKeyUnsafe(it->keyIndex));
 
-		// TODO: consider taking a data view that is stable
-		// Look for key
-		const std::string& key = attributeStore.keyStore.getKeyUnsafe(it->keyIndex);
-		
-		if (it->hasStringValue()) {
-			fbuilder.add_property(key, it->stringValue());
-		} else if (it->hasBoolValue()) {
-			fbuilder.add_property(key, it->boolValue());
-		} else if (it->hasFloatValue()) {
-			fbuilder.add_property(key, it->floatValue());
+			vtzero::index_value& value = cache.values[it];
+			if (!value.valid()) {
+				if (it->hasStringValue()) {
+					const PooledString& ps = it->pooledString();
+					value = vtLayer.add_value(vtzero::encoded_property_value(ps.data(), ps.size()));
+				} else if (it->hasBoolValue()) {
+					value = vtLayer.add_value(vtzero::encoded_property_value(it->boolValue()));
+				} else if (it->hasFloatValue()) {
+					value = vtLayer.add_value(vtzero::encoded_property_value(it->floatValue()));
+				}
+			}
+
+			properties.emplace_back(key, value);
 		}
+
+		cached = cache.sets.emplace(sliceId, std::move(properties)).first;
 	}
+
+	for (const auto& property : cached->second)
+		fbuilder.add_property(property);
 }
 
 bool OutputObject::compatible(const OutputObject &other) {
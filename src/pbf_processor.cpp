@@ -19,17 +19,29 @@ std::atomic<uint64_t> blocksProcessed(0), blocksToProcess(0);
 
 // Thread-local so that we can re-use buffers during parsing.
 thread_local PbfReader::PbfReader reader;
+thread_local BlockSignificantTags blockSignificantTags;
+thread_local BlockInternedKeys blockInternedKeys;
 
 PbfProcessor::PbfProcessor(OSMStore &osmStore)
 	: osmStore(osmStore), compactWarningIssued(false)
 { }
 
-bool PbfProcessor::ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const SignificantTags& nodeKeys)
+bool PbfProcessor::ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const BlockSignificantTags& nodeKeys)
 {
 	// ----	Read nodes
 	std::vector<NodeStore::element_t> nodes;		
 	TagMap tags;
 
+	// If the profile has a node_batch_function, we collect the significant
+	// nodes and their tags, and call Lua once for the whole group.
+	const bool batched = output.canProcessNodeBatches();
+	std::vector<TagMap> batchTags;
+	std::vector<OsmLuaProcessing::BatchNode> batch;
+	std::vector<std::pair<NodeStore::element_t, int>> batchCandidates;
+
+	// If the block's string table has none of the significant keys, no node
+	// will reach Lua, and we only need to keep the nodes used by ways.
+	const bool anyPossible = nodeKeys.anyPossible();
 
 	bool isCompactStore = osmStore.isCompactStore();
 	NodeID lastNodeId = 0;
@@ -44,19 +56,47 @@ bool PbfProcessor::ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup
 
 		LatpLon latplon = { int(lat2latp(double(node.lat)/10000000.0)*10000000.0), node.lon };
 
-		tags.reset();
-		// For tagged nodes, call Lua, then save the OutputObject
-		for (int n = node.tagStart; n < node.tagEnd; n += 2) {
-			auto keyIndex = pg.translateNodeKeyValue(n);
-			auto valueIndex = pg.translateNodeKeyValue(n + 1);
-
-			const protozero::data_view& key = pb.stringTable[keyIndex];
-			const protozero::data_view& value = pb.stringTable[valueIndex];
-			tags.addTag(key, value);
+		// Filter on string table indices before building the TagMap
+		const bool significant = anyPossible && node.tagStart < node.tagEnd &&
+			nodeKeys.filter((node.tagEnd - node.tagStart) / 2, [&](size_t i) {
+				return std::make_pair(
+					static_cast<uint32_t>(pg.translateNodeKeyValue(node.tagStart + i * 2)),
+					static_cast<uint32_t>(pg.translateNodeKeyValue(node.tagStart + i * 2 + 1))
+				);
+			});
+
+		if (significant) {
+			if (batched && batchTags.size() == batch.size())
+				batchTags.emplace_back();
+			TagMap& nodeTags = batched ? batchTags[batch.size()] : tags;
+
+			nodeTags.reset();
+			nodeTags.useInternedKeys(blockInternedKeys.keyCount());
+			// For tagged nodes, call Lua, then save the OutputObject
+			for (int n = node.tagStart; n < node.tagEnd; n += 2) {
+				auto keyIndex = pg.translateNodeKeyValue(n);
+				auto valueIndex = pg.translateNodeKeyValue(n + 1);
+
+				const protozero::data_view& key = pb.stringTable[keyIndex];
+				const protozero::data_view& value = pb.stringTable[valueIndex];
+				nodeTags.addTag(key, value, blockInternedKeys.keyHash(keyIndex), blockInternedKeys[keyIndex]);
+			}
+		}
+
+		if (batched) {
+			// Tags are attached once the group has been read, as batchTags may still grow
+			int batchIndex = -1;
+			if (significant) {
+				batchIndex = batch.size();
+				batch.push_back({ static_cast<NodeID>(nodeId), latplon, nullptr });
+			}
+			if (batchIndex >= 0 || osmStore.usedNodes.test(nodeId))
+				batchCandidates.push_back(std::make_pair(std::make_pair(static_cast<NodeID>(nodeId), latplon), batchIndex));
+			continue;
 		}
 
 		bool emitted = false;
-		if (!tags.empty() && nodeKeys.filter(tags)) {
+		if (significant) {
 			emitted = output.setNode(static_cast<NodeID>(nodeId), latplon, tags);
 		}
 
@@ -64,6 +104,20 @@ bool PbfProcessor::ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup
 			nodes.push_back(std::make_pair(static_cast<NodeID>(nodeId), latplon));
 	}
 
+	if (batched) {
+		std::vector<char> emitted;
+		if (!batch.empty()) {
+			for (size_t i = 0; i < batch.size(); i++)
+				batch[i].tags = &batchTags[i];
+			output.setNodeBatch(batch, emitted);
+		}
+
+		for (const auto& candidate : batchCandidates) {
+			if ((candidate.second >= 0 && emitted[candidate.second]) || osmStore.usedNodes.test(candidate.first.first))
+				nodes.push_back(candidate.first);
+		}
+	}
+
 	if (nodes.size() > 0) {
 		osmStore.nodes.insert(nodes);
 	}
@@ -75,7 +129,7 @@ bool PbfProcessor::ReadWays(
 	OsmLuaProcessing &output,
 	PbfReader::PrimitiveGroup& pg,
 	const PbfReader::PrimitiveBlock& pb,
-	const SignificantTags& wayKeys,
+	const BlockSignificantTags& wayKeys,
 	bool locationsOnWays,
 	uint shard,
 	uint effectiveShards
@@ -92,31 +146,48 @@ bool PbfProcessor::ReadWays(
 	LatpLonVec llVec;
 	std::vector<NodeID> nodeVec;
 
-	for (PbfReader::Way pbfWay : pg.ways()) {
-		tags.reset();
-		readTags(pbfWay, pb, tags);
+	// As in ReadNodes: with a way_batch_function, each way keeps its own tags
+	// and node list until Lua has seen the whole group.
+	const bool batched = output.canProcessWayBatches();
+	std::vector<TagMap> batchTags;
+	std::vector<LatpLonVec> batchLlVecs;
+	std::vector<std::vector<NodeID>> batchNodeVecs;
+	std::vector<OsmLuaProcessing::BatchWay> batch;
 
-		if (!osmStore.way_is_used(pbfWay.id) && !wayKeys.filter(tags))
+	for (PbfReader::Way pbfWay : pg.ways()) {
+		if (!osmStore.way_is_used(pbfWay.id) && !tagsSignificant(pbfWay, wayKeys))
 			continue;
 
-		llVec.clear();
-		nodeVec.clear();
+		if (batched && batchTags.size() == batch.size()) {
+			batchTags.emplace_back();
+			batchLlVecs.emplace_back();
+			batchNodeVecs.emplace_back();
+		}
+		TagMap& wayTags = batched ? batchTags[batch.size()] : tags;
+		LatpLonVec& wayLlVec = batched ? batchLlVecs[batch.size()] : llVec;
+		std::vector<NodeID>& wayNodeVec = batched ? batchNodeVecs[batch.size()] : nodeVec;
+
+		wayTags.reset();
+		readTags(pbfWay, pb, blockInternedKeys, wayTags);
+
+		wayLlVec.clear();
+		wayNodeVec.clear();
 
 		WayID wayId = static_cast<WayID>(pbfWay.id);
 		if (wayId >= pow(2,42)) throw std::runtime_error("Way ID negative or too large: "+std::to_string(wayId));
 
 		// Assemble nodelist
 		if (locationsOnWays) {
-			llVec.reserve(pbfWay.lats.size());
+			wayLlVec.reserve(pbfWay.lats.size());
 			for (int k=0; k<pbfWay.lats.size(); k++) {
 				int lat = pbfWay.lats[k];
 				int lon = pbfWay.lons[k];
 				LatpLon ll = { int(lat2latp(double(lat)/10000000.0)*10000000.0), lon };
-				llVec.push_back(ll);
+				wayLlVec.push_back(ll);
 			}
 		} else {
-			llVec.reserve(pbfWay.refs.size());
-			nodeVec.reserve(pbfWay.refs.size());
+			wayLlVec.reserve(pbfWay.refs.size());
+			wayNodeVec.reserve(pbfWay.refs.size());
 
 			bool skipToNext = false;
 
@@ -129,8 +200,8 @@ bool PbfProcessor::ReadWays(
 				}
 
 				try {
-					llVec.push_back(osmStore.nodes.at(static_cast<NodeID>(nodeId)));
-					nodeVec.push_back(nodeId);
+					wayLlVec.push_back(osmStore.nodes.at(static_cast<NodeID>(nodeId)));
+					wayNodeVec.push_back(nodeId);
 				} catch (std::out_of_range &err) {
 					if (osmStore.integrity_enforced()) throw err;
 				}
@@ -139,7 +210,13 @@ bool PbfProcessor::ReadWays(
 			if (skipToNext)
 				continue;
 		}
-		if (llVec.empty()) continue;
+		if (wayLlVec.empty()) continue;
+
+		if (batched) {
+			// llVec and tags are attached once the group has been read
+			batch.push_back({ wayId, nullptr, nullptr });
+			continue;
+		}
 
 		try {
 			bool emitted = output.setWay(static_cast<WayID>(pbfWay.id), llVec, tags);
@@ -159,6 +236,26 @@ bool PbfProcessor::ReadWays(
 
 	}
 
+	if (!batch.empty()) {
+		for (size_t i = 0; i < batch.size(); i++) {
+			batch[i].llVec = &batchLlVecs[i];
+			batch[i].tags = &batchTags[i];
+		}
+
+		std::vector<char> emitted;
+		output.setWayBatch(batch, emitted);
+
+		for (size_t i = 0; i < batch.size(); i++) {
+			const WayID wayId = batch[i].id;
+			if (emitted[i] || osmStore.way_is_used(wayId)) {
+				if (wayStoreRequiresNodes)
+					nodeWays.push_back(std::make_pair(wayId, batchNodeVecs[i]));
+				else
+					llWays.push_back(std::make_pair(wayId, WayStore::latplon_vector_t(batchLlVecs[i].begin(), batchLlVecs[i].end())));
+			}
+		}
+	}
+
 	if (wayStoreRequiresNodes) {
 		osmStore.ways.shard(shard).insertNodes(nodeWays);
 	} else {
@@ -168,22 +265,17 @@ bool PbfProcessor::ReadWays(
 	return true;
 }
 
-bool PbfProcessor::ScanWays(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const SignificantTags& wayKeys) {
+bool PbfProcessor::ScanWays(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const BlockSignificantTags& wayKeys) {
 	// Scan ways to see which nodes we need to save.
 	//
 	// This phase only runs if the Lua script has declared a `way_keys` variable.
 	if (pg.ways().empty())
 		return false;
 
-	TagMap tags;
-
 	// Note: unlike ScanRelations, we don't call into Lua. Instead, we statically inspect
 	// the tags on each way to decide if it will be emitted.
 	for (auto& way : pg.ways()) {
-		tags.reset();
-		readTags(way, pb, tags);
-
-		if (osmStore.way_is_used(way.id) || wayKeys.filter(tags)) {
+		if (osmStore.way_is_used(way.id) || tagsSignificant(way, wayKeys)) {
 			for (const auto id : way.refs) {
 				osmStore.usedNodes.set(id);
 			}
@@ -208,7 +300,7 @@ bool PbfProcessor::ScanRelations(OsmLuaProcessing& output, PbfReader::PrimitiveG
 		bool isAccepted = false;
 		WayID relid = static_cast<WayID>(pbfRelation.id);
 		tags.reset();
-		readTags(pbfRelation, pb, tags);
+		readTags(pbfRelation, pb, blockInternedKeys, tags);
 
 		if (!isMultiPolygon) {
 			if (output.canReadRelations()) {
@@ -322,7 +414,7 @@ bool PbfProcessor::ReadRelations(
 						tags.addTag(key, value);
 					}
 				} else {
-					readTags(pbfRelation, pb, tags);
+					readTags(pbfRelation, pb, blockInternedKeys, tags);
 				}
 
 				if (osmStore.usedRelations.test(pbfRelation.id) || wayKeys.filter(tags))
@@ -360,6 +452,17 @@ bool PbfProcessor::ReadBlock(
 		return true;
 	}
 
+	// Resolve node_keys/way_keys against this block's string table
+	if (phase == ReadPhase::Nodes)
+		blockSignificantTags.resolve(nodeKeys, pb.stringTable);
+	else if (phase == ReadPhase::WayScan || phase == ReadPhase::Ways)
+		blockSignificantTags.resolve(wayKeys, pb.stringTable);
+
+	// Resolve the profile's Key() handles, so Holds/Find can use them
+	// directly, and reset the block's key hashes
+	if (phase != ReadPhase::WayScan)
+		blockInternedKeys.resolve(output.getInternedKeys(), pb.stringTable);
+
 	// Keep count of groups read during this phase.
 	std::size_t read_groups = 0;
 
@@ -385,7 +488,7 @@ bool PbfProcessor::ReadBlock(
 		};
 
 		if(phase == ReadPhase::Nodes) {
-			bool done = ReadNodes(output, pg, pb, nodeKeys);
+			bool done = ReadNodes(output, pg, pb, blockSignificantTags);
 			if(done) { 
 				output_progress();
 				++read_groups;
@@ -394,7 +497,7 @@ bool PbfProcessor::ReadBlock(
 		}
 
 		if(phase == ReadPhase::WayScan) {
-			bool done = ScanWays(output, pg, pb, wayKeys);
+			bool done = ScanWays(output, pg, pb, blockSignificantTags);
 			if(done) { 
 				if (ioMutex.try_lock()) {
 					std::cout << "\r(Scanning for nodes used in ways: " << (100*blocksProcessed.load()/blocksToProcess.load()) << "%)           ";
@@ -419,7 +522,7 @@ bool PbfProcessor::ReadBlock(
 		}
 	
 		if(phase == ReadPhase::Ways) {
-			bool done = ReadWays(output, pg, pb, wayKeys, locationsOnWays, shard, effectiveShards);
+			bool done = ReadWays(output, pg, pb, blockSignificantTags, locationsOnWays, shard, effectiveShards);
 			if(done) { 
 				output_progress();
 				++read_groups;
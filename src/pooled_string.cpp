@@ -1,20 +1,73 @@
 #include "pooled_string.h"
+#include "concurrent_dedup_table.h"
 #include <stdexcept>
-#include <mutex>
+#include <atomic>
 #include <cstring>
+#include <boost/functional/hash.hpp>
 
 namespace PooledStringNS {
-	std::vector<char*> tables;
-	std::mutex mutex;
-
 	const uint8_t ShortString = 0b00;
 	const uint8_t HeapString = 0b10;
 	const uint8_t DataViewString = 0b11;
 
-	// Each thread has its own string table, we only take a lock
-	// to push a new table onto the vector.
+	// Tables are 64K slabs, addressed by a 24-bit index. The index is
+	// split into a chunk of the directory and a position in that chunk, so
+	// the directory never moves and can be read without a lock.
+	const uint32_t TableSize = 65536;
+	const uint32_t DirectoryChunkBits = 12;
+	const uint32_t DirectoryChunkSize = 1 << DirectoryChunkBits;
+	const uint32_t MaxTables = 1 << 24;
+	std::atomic<char**> directory[MaxTables / DirectoryChunkSize];
+	std::atomic<uint32_t> tableCount(0);
+
+	// Each thread fills its own table, so allocating a string is just
+	// bumping its offset.
 	thread_local int64_t tableIndex = -1;
 	thread_local int64_t spaceLeft = -1;
+
+	inline char* table(uint32_t index) {
+		return directory[index >> DirectoryChunkBits].load(std::memory_order_acquire)[index & (DirectoryChunkSize - 1)];
+	}
+
+	void newTable() {
+		const uint32_t index = tableCount.fetch_add(1, std::memory_order_relaxed);
+		if (index >= MaxTables)
+			throw std::runtime_error("PooledString is out of tables");
+
+		std::atomic<char**>& chunk = directory[index >> DirectoryChunkBits];
+		char** entries = chunk.load(std::memory_order_acquire);
+		if (entries == nullptr) {
+			char** newEntries = new char*[DirectoryChunkSize]();
+			if (chunk.compare_exchange_strong(entries, newEntries, std::memory_order_acq_rel))
+				entries = newEntries;
+			else
+				delete[] newEntries;
+		}
+
+		char* buffer = (char*)malloc(TableSize);
+		if (buffer == 0)
+			throw std::runtime_error("PooledString could not malloc");
+		entries[index & (DirectoryChunkSize - 1)] = buffer;
+
+		tableIndex = index;
+		spaceLeft = TableSize;
+	}
+
+	// Long strings are deduplicated by value, so that e.g. a name that is
+	// also used for name:en and name:latin is only stored once.
+	struct ContentHash {
+		size_t operator()(const PooledString& str) const {
+			const char* data = str.data();
+			return boost::hash_range(data, data + str.size());
+		}
+	};
+	struct ContentEqual {
+		bool operator()(const PooledString& a, const PooledString& b) const {
+			const size_t size = a.size();
+			return size == b.size() && memcmp(a.data(), b.data(), size) == 0;
+		}
+	};
+	ConcurrentDedupTable<PooledString, ContentHash, ContentEqual> longStrings;
 }
 
 PooledString::PooledString(const std::string& str) {
@@ -26,35 +79,34 @@ PooledString::PooledString(const std::string& str) {
 		memcpy(storage + 1, str.data(), str.size());
 		memset(storage + 1 + str.size(), 0, 16 - 1 - str.size());
 	} else {
-		memset(storage + 8, 0, 8);
-		storage[0] = 1 << 7;
-
-		if (spaceLeft < 0 || spaceLeft < str.size()) {
-			std::lock_guard<std::mutex> lock(mutex);
-			spaceLeft = 65536;
-			char* buffer = (char*)malloc(spaceLeft);
-			if (buffer == 0)
-				throw std::runtime_error("PooledString could not malloc");
-			tables.push_back(buffer);
-			tableIndex = tables.size() - 1;
-		}
+		const protozero::data_view view(str.data(), str.size());
+		*this = PooledString(&view);
+		ensureStringIsOwned();
+	}
+}
 
-		storage[1] = tableIndex >> 16;
-		storage[2] = tableIndex >> 8;
-		storage[3] = tableIndex;
+void PooledStringNS::PooledString::allocate(const char* str, size_t size) {
+	memset(storage + 8, 0, 8);
+	storage[0] = HeapString << 6;
 
-		uint16_t offset = 65536 - spaceLeft;
-		storage[4] = offset >> 8;
-		storage[5] = offset;
+	if (spaceLeft < 0 || spaceLeft < size)
+		newTable();
 
-		uint16_t length = str.size();
-		storage[6] = length >> 8;
-		storage[7] = length;
+	storage[1] = tableIndex >> 16;
+	storage[2] = tableIndex >> 8;
+	storage[3] = tableIndex;
 
-		memcpy(tables[tableIndex] + offset, str.data(), str.size());
+	uint16_t offset = TableSize - spaceLeft;
+	storage[4] = offset >> 8;
+	storage[5] = offset;
 
-		spaceLeft -= str.size();
-	}
+	uint16_t length = size;
+	storage[6] = length >> 8;
+	storage[7] = length;
+
+	memcpy(table(tableIndex) + offset, str, size);
+
+	spaceLeft -= size;
 }
 
 PooledString::PooledString(const protozero::data_view* str) {
@@ -105,7 +157,7 @@ const char* PooledStringNS::PooledString::data() const {
 	uint32_t tableIndex = (storage[1] << 16) + (storage[2] << 8) + storage[3];
 	uint16_t offset = (storage[4] << 8) + storage[5];
 
-	const char* data = tables[tableIndex] + offset;
+	const char* data = table(tableIndex) + offset;
 	return data;
 }
 
@@ -135,7 +187,7 @@ std::string PooledStringNS::PooledString::toString() const {
 		uint32_t tableIndex = (storage[1] << 16) + (storage[2] << 8) + storage[3];
 		uint16_t offset = (storage[4] << 8) + storage[5];
 
-		char* data = tables[tableIndex] + offset;
+		char* data = table(tableIndex) + offset;
 		rv.append(data, size());
 		return rv;
 	}
@@ -156,7 +208,26 @@ void PooledStringNS::PooledString::ensureStringIsOwned() {
 	if (kind != DataViewString)
 		return;
 
-	*this = PooledString(toString());
+	const size_t mySize = size();
+	if (mySize <= 15) {
+		*this = PooledString(toString());
+		return;
+	}
+	if (mySize >= 65536)
+		throw std::runtime_error("cannot store string longer than 64K");
+
+	// The table's copy still points at the caller's data_view until
+	// it's allocated in this thread's table.
+	const int32_t index = longStrings.add(*this, [](PooledString& stored) {
+		stored.allocate(stored.data(), stored.size());
+	});
+	if (index >= 0) {
+		*this = longStrings[index];
+		return;
+	}
+
+	// Dedup table is full: just store it
+	allocate(data(), mySize);
 }
 
 bool PooledStringNS::PooledString::operator<(const PooledString& other) const {
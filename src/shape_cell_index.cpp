@@ -0,0 +1,113 @@
+#include "shape_cell_index.h"
+#include "coordinates.h"
+#include <algorithm>
+
+namespace geom = boost::geometry;
+
+namespace {
+	Box tileBox(uint8_t z, uint32_t x, uint32_t y) {
+		return Box(
+			Point(tilex2lon(x, z), tiley2latp(y + 1, z)),
+			Point(tilex2lon(x + 1, z), tiley2latp(y, z))
+		);
+	}
+}
+
+ShapeCellIndex::ShapeCellIndex(unsigned int zoom)
+	: zoom_(zoom), levels(0)
+{ }
+
+std::vector<ShapeCellIndex::Cell> ShapeCellIndex::classify(const MultiPolygon& mp) const {
+	std::vector<Cell> out;
+	if (mp.empty()) return out;
+
+	Box shapeBox;
+	geom::envelope(mp, shapeBox);
+	classifyCell(mp, shapeBox, 0, 0, 0, out);
+	return out;
+}
+
+void ShapeCellIndex::classifyCell(const MultiPolygon& mp, const Box& shapeBox, uint8_t z, uint32_t x, uint32_t y, std::vector<Cell>& out) const {
+	const Box cellBox = tileBox(z, x, y);
+	if (!geom::intersects(cellBox, shapeBox)) return;
+
+	Polygon cellPolygon;
+	geom::convert(cellBox, cellPolygon);
+	if (!geom::intersects(cellPolygon, mp)) return;
+
+	// Only a cell within the shape's envelope can be inside it
+	if (geom::covered_by(cellBox, shapeBox) && geom::covered_by(cellPolygon, mp)) {
+		out.push_back({ z, x, y, CellState::Inside });
+		return;
+	}
+
+	if (z == zoom_) {
+		out.push_back({ z, x, y, CellState::Boundary });
+		return;
+	}
+
+	// Clip the shape to (slightly more than) this cell, so that the children
+	// are tested against less geometry
+	MultiPolygon clipped;
+	const MultiPolygon* child = &mp;
+	Box childBox = shapeBox;
+	if (!geom::covered_by(shapeBox, cellBox)) {
+		const double margin = (cellBox.max_corner().x() - cellBox.min_corner().x()) * 0.01;
+		Box clipBox(
+			Point(cellBox.min_corner().x() - margin, cellBox.min_corner().y() - margin),
+			Point(cellBox.max_corner().x() + margin, cellBox.max_corner().y() + margin)
+		);
+		Polygon clipPolygon;
+		geom::convert(clipBox, clipPolygon);
+		geom::intersection(mp, clipPolygon, clipped);
+		if (clipped.empty()) {
+			// Touches the cell without overlapping it: classify from the full shape
+			clipped = mp;
+		}
+		geom::envelope(clipped, childBox);
+		child = &clipped;
+	}
+
+	for (uint32_t dx = 0; dx < 2; dx++)
+		for (uint32_t dy = 0; dy < 2; dy++)
+			classifyCell(*child, childBox, z + 1, x * 2 + dx, y * 2 + dy, out);
+}
+
+void ShapeCellIndex::add(uint id, const std::vector<Cell>& newCells) {
+	for (const auto& cell : newCells) {
+		cells[cellKey(cell.z, cell.x, cell.y)].push_back(std::make_pair(id, cell.state));
+		levels |= 1u << cell.z;
+	}
+}
+
+void ShapeCellIndex::addUnclassified(uint id) {
+	auto it = std::lower_bound(unclassified.begin(), unclassified.end(), id);
+	if (it == unclassified.end() || *it != id)
+		unclassified.insert(it, id);
+}
+
+bool ShapeCellIndex::isUnclassified(uint id) const {
+	return std::binary_search(unclassified.begin(), unclassified.end(), id);
+}
+
+bool ShapeCellIndex::cellFor(const Box& box, uint32_t& x, uint32_t& y) const {
+	const double x1 = lon2tilexf(box.min_corner().x(), zoom_);
+	const double x2 = lon2tilexf(box.max_corner().x(), zoom_);
+	const double y1 = latp2tileyf(box.max_corner().y(), zoom_);
+	const double y2 = latp2tileyf(box.min_corner().y(), zoom_);
+	const double limit = 1u << zoom_;
+	if (x1 < 0 || y1 < 0 || x2 >= limit || y2 >= limit) return false;
+
+	x = x1;
+	y = y1;
+	return x == uint32_t(x2) && y == uint32_t(y2);
+}
+
+void ShapeCellIndex::shapesInCell(uint32_t x, uint32_t y, std::vector<std::pair<uint, CellState>>& out) const {
+	for (unsigned int z = 0; z <= zoom_; z++) {
+		if (!(levels & (1u << z))) continue;
+		auto it = cells.find(cellKey(z, x >> (zoom_ - z), y >> (zoom_ - z)));
+		if (it != cells.end())
+			out.insert(out.end(), it->second.begin(), it->second.end());
+	}
+}
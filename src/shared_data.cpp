@@ -178,6 +178,18 @@ std::vector<bool> LayerDefinition::getSortOrders() {
 	return orders;
 }
 
+std::vector<uint> LayerDefinition::getFeatureLimits(uint zoom) const {
+	std::vector<uint> limits;
+	for (auto &layer : layers) { limits.emplace_back(zoom < layer.featureLimitBelow ? layer.featureLimit : 0); }
+	return limits;
+}
+
+std::vector<std::string> LayerDefinition::getLayerNames() const {
+	std::vector<std::string> names;
+	for (auto &layer : layers) { names.emplace_back(layer.name); }
+	return names;
+}
+
 Value LayerDefinition::serialiseToJSONValue(rapidjson::Document::AllocatorType &allocator) const {
 	Value layerArray(kArrayType);
 	for (auto it = layers.begin(); it != layers.end(); ++it) {
@@ -1,4 +1,5 @@
 #include "shp_mem_tiles.h"
+#include <algorithm>
 #include <iostream>
 #include <mutex>
 
@@ -43,6 +44,62 @@ vector<uint> ShpMemTiles::QueryMatchingGeometries(
 	return ids;
 }
 
+// As above, but for queries (Intersects, CoveredBy) where an object lying
+// within a single index-zoom cell matches every shape that the cell is inside.
+// Only shapes whose boundary crosses the cell get the exact checkQuery.
+vector<uint> ShpMemTiles::QueryMatchingGeometries(
+	const string& layerName,
+	bool once,
+	Box& box,
+	function<bool(const OutputObject& oo)> checkQuery
+) const {
+	auto f = cellIndices.find(layerName);
+	if (f==cellIndices.end()) {
+		if (verbose) cerr << "Couldn't find indexed layer " << layerName << endl;
+		return vector<uint>();
+	}
+	const ShapeCellIndex& cellIndex = f->second;
+
+	uint32_t x, y;
+	if (!cellIndex.cellFor(box, x, y)) {
+		// Spans several cells: use the r-tree
+		return QueryMatchingGeometries(layerName, once, box,
+			[&](const RTree &rtree) {
+				vector<IndexValue> results;
+				rtree.query(geom::index::intersects(box), back_inserter(results));
+				return results;
+			},
+			checkQuery
+		);
+	}
+
+	vector<uint> ids;
+	vector<pair<uint, ShapeCellIndex::CellState>> shapes;
+	cellIndex.shapesInCell(x, y, shapes);
+	for (const auto& shape : shapes) {
+		if (shape.second == ShapeCellIndex::CellState::Inside || checkQuery(indexedGeometries.at(shape.first))) {
+			ids.push_back(shape.first);
+			if (once) return ids;
+		}
+	}
+
+	// Shapes that aren't in the cell index
+	if (cellIndex.hasUnclassified()) {
+		vector<IndexValue> results;
+		indices.at(layerName).query(geom::index::intersects(box), back_inserter(results));
+		for (const auto& it : results) {
+			if (!cellIndex.isUnclassified(it.second)) continue;
+			if (checkQuery(indexedGeometries.at(it.second))) {
+				ids.push_back(it.second);
+				if (once) return ids;
+			}
+		}
+	}
+
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
+
 vector<string> ShpMemTiles::namesOfGeometries(const vector<uint>& ids) const {
 	vector<string> names;
 	for (uint i=0; i<ids.size(); i++) {
@@ -55,6 +112,7 @@ vector<string> ShpMemTiles::namesOfGeometries(const vector<uint>& ids) const {
 
 void ShpMemTiles::CreateNamedLayerIndex(const std::string& layerName) {
 	indices[layerName]=RTree();
+	cellIndices.emplace(layerName, ShapeCellIndex(indexZoom));
 
 	bitIndices[layerName] = std::vector<bool>();
 	bitIndices[layerName].resize((1 << indexZoom) * (1 << indexZoom));
@@ -149,9 +207,25 @@ void ShpMemTiles::StoreGeometry(
 
 	// Add to index
 	if (!isIndexed) return;
+
+	// Classify polygons against the grid before taking the lock, as it's
+	// the expensive part
+	bool classified = false;
+	std::vector<ShapeCellIndex::Cell> cells;
+	if (geomType == POLYGON_) {
+		try {
+			cells = cellIndices.at(layerName).classify(boost::get<MultiPolygon>(geometry));
+			classified = true;
+		} catch (std::exception &e) {
+			if (verbose) cerr << "Couldn't classify shape in layer " << layerName << " against the cell index: " << e.what() << endl;
+		}
+	}
+
 	std::lock_guard<std::mutex> indexLock(indexMutex);
 	uint id = indexedGeometries.size();
 	indices.at(layerName).insert(std::make_pair(box, id));
+	if (classified) { cellIndices.at(layerName).add(id, cells); }
+	else { cellIndices.at(layerName).addUnclassified(id); }
 	if (hasName) { indexedGeometryNames[id] = name; }
 	indexedGeometries.push_back(*oo);
 
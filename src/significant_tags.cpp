@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include "significant_tags.h"
 #include "tag_map.h"
@@ -44,6 +46,19 @@ SignificantTags::SignificantTags(std::vector<std::string> rawTags): enabled_(tru
 		}
 		i++;
 	}
+
+	for (const auto& filter : filters) {
+		if (filter.value.empty()) {
+			anyValueKeys.push_back(filter.key);
+		} else {
+			valueKeys.push_back(filter.key);
+			filterValues.push_back(filter.value);
+		}
+	}
+	for (auto* v : { &anyValueKeys, &valueKeys, &filterValues }) {
+		std::sort(v->begin(), v->end());
+		v->erase(std::unique(v->begin(), v->end()), v->end());
+	}
 }
 
 bool SignificantTags::enabled() const { return enabled_; }
@@ -86,3 +101,75 @@ bool SignificantTags::filter(const TagMap& tags) const {
 
 	return false;
 }
+
+namespace {
+	bool lessThan(const std::string& a, const protozero::data_view& b) {
+		int cmp = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+		return cmp < 0 || (cmp == 0 && a.size() < b.size());
+	}
+
+	bool lessThan(const protozero::data_view& a, const std::string& b) {
+		int cmp = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+		return cmp < 0 || (cmp == 0 && a.size() < b.size());
+	}
+
+	bool contains(const std::vector<std::string>& sorted, const protozero::data_view& value) {
+		if (sorted.empty()) return false;
+		auto it = std::lower_bound(sorted.begin(), sorted.end(), value,
+			[](const std::string& a, const protozero::data_view& b) { return lessThan(a, b); });
+		return it != sorted.end() && !lessThan(value, *it);
+	}
+
+	bool equals(const protozero::data_view& a, const std::string& b) {
+		return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+	}
+}
+
+void BlockSignificantTags::resolve(const SignificantTags& tags, const std::vector<protozero::data_view>& stringTable) {
+	enabled = tags.enabled_;
+	filtersEmpty = tags.filters.empty();
+	accept = filtersEmpty || tags.filters[0].accept;
+	hasSignificantKey = false;
+	keyFlags.assign(stringTable.size(), 0);
+	valuePairs.clear();
+	valueKeyIndices.clear();
+	valueIndices.clear();
+
+	if (!enabled || filtersEmpty)
+		return;
+
+	for (uint32_t i = 0; i < stringTable.size(); i++) {
+		const protozero::data_view& s = stringTable[i];
+		uint8_t flags = 0;
+		if (contains(tags.anyValueKeys, s)) flags |= ANY_VALUE;
+		if (contains(tags.valueKeys, s)) {
+			flags |= HAS_VALUES;
+			valueKeyIndices.push_back(i);
+		}
+		if (contains(tags.filterValues, s)) {
+			flags |= IS_VALUE;
+			valueIndices.push_back(i);
+		}
+		keyFlags[i] = flags;
+		if (flags & (ANY_VALUE | HAS_VALUES))
+			hasSignificantKey = true;
+	}
+
+	// Resolve key=value filters into pairs of string indices. There are
+	// usually very few of these, so the cross product is cheap.
+	for (const uint32_t k : valueKeyIndices) {
+		for (const uint32_t v : valueIndices) {
+			for (const auto& filter : tags.filters) {
+				if (!filter.value.empty() && equals(stringTable[k], filter.key) && equals(stringTable[v], filter.value)) {
+					valuePairs.push_back(uint64_t(k) << 32 | v);
+					break;
+				}
+			}
+		}
+	}
+	std::sort(valuePairs.begin(), valuePairs.end());
+}
+
+bool BlockSignificantTags::matchesValue(uint32_t key, uint32_t value) const {
+	return std::binary_search(valuePairs.begin(), valuePairs.end(), uint64_t(key) << 32 | value);
+}
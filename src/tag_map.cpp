@@ -1,173 +1,234 @@
 #include "tag_map.h"
-#include <boost/functional/hash.hpp>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 
-TagMap::TagMap() {
-	keys.resize(16);
-	key2value.resize(16);
-	values.resize(16);
+uint32_t InternedTagKeys::intern(const std::string& key) {
+	const int32_t existing = find(protozero::data_view(key.data(), key.size()));
+	if (existing >= 0)
+		return existing;
+
+	const uint32_t id = keys.size();
+	keys.push_back(key);
+	sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), key, [&](const std::string& k, uint32_t other) {
+		return k < keys[other];
+	}), id);
+	return id;
 }
 
-void TagMap::reset() {
-	for (int i = 0; i < 16; i++) {
-		keys[i].clear();
-		key2value[i].clear();
-		values[i].clear();
-	}
+int32_t InternedTagKeys::find(const protozero::data_view& key) const {
+	const auto it = std::lower_bound(sorted.begin(), sorted.end(), key, [&](uint32_t id, const protozero::data_view& k) {
+		return protozero::data_view(keys[id].data(), keys[id].size()).compare(k) < 0;
+	});
+	if (it == sorted.end() || protozero::data_view(keys[*it].data(), keys[*it].size()) != key)
+		return -1;
+	return *it;
 }
 
-bool TagMap::empty() const {
-	for (int i = 0; i < keys.size(); i++)
-		if (keys[i].size() > 0)
-			return false;
-
-	return true;
-}
-const std::size_t hashString(const std::string& str) {
-	// This is a pretty crappy hash function in terms of bit
-	// avalanching and distribution of output values.
-	//
-	// But it's very good in terms of speed, which turns out
-	// to be the important measure.
-	std::size_t hash = str.size();
-	if (hash >= 4)
-		hash ^= *(uint32_t*)str.data();
+void BlockInternedKeys::resolve(const InternedTagKeys& keys, const std::vector<protozero::data_view>& stringTable) {
+	this->stringTable = &stringTable;
+	hashes.assign(stringTable.size(), 0);
 
-	return hash;
-}
+	keyCount_ = keys.size();
+	if (keyCount_ == 0)
+		return;
 
-const std::size_t hashString(const char* str, size_t size) {
-	// This is a pretty crappy hash function in terms of bit
-	// avalanching and distribution of output values.
-	//
-	// But it's very good in terms of speed, which turns out
-	// to be the important measure.
-	std::size_t hash = size;
-	if (hash >= 4)
-		hash ^= *(uint32_t*)str;
+	ids.resize(stringTable.size());
+	for (uint32_t i = 0; i < stringTable.size(); i++)
+		ids[i] = keys.find(stringTable[i]);
+}
 
+uint32_t BlockInternedKeys::keyHash(uint32_t stringIndex) const {
+	uint32_t& hash = hashes[stringIndex];
+	if (hash == 0) {
+		const protozero::data_view& key = (*stringTable)[stringIndex];
+		hash = TagMap::hashKey(key.data(), key.size());
+	}
 	return hash;
 }
 
-uint32_t TagMap::ensureString(
-	std::vector<std::vector<const protozero::data_view*>>& vector,
-	const protozero::data_view& value
-) {
-	std::size_t hash = hashString(value.data(), value.size());
+namespace {
+	const size_t InitialIndexSize = 32;
 
-	const uint16_t shard = hash % vector.size();
-	for (int i = 0; i < vector[shard].size(); i++)
-		if (*(vector[shard][i]) == value)
-			return shard << 16 | i;
+	inline uint64_t loadWord(const char* data, size_t size) {
+		// Little-endian load of up to 8 bytes, zero-padded
+		uint64_t word = 0;
+		memcpy(&word, data, size < 8 ? size : 8);
+		return word;
+	}
+}
 
-	vector[shard].push_back(&value);
-	return shard << 16 | (vector[shard].size() - 1);
+TagMap::TagMap(): internedKeyCount(0) {
+	index.resize(InitialIndexSize, Slot{0, 0, 0});
 }
 
+void TagMap::reset() {
+	// Shrink the index if a large object grew it
+	if (index.size() > InitialIndexSize)
+		index.assign(InitialIndexSize, Slot{0, 0, 0});
+	else
+		std::fill(index.begin(), index.end(), Slot{0, 0, 0});
+	keys.clear();
+	values.clear();
 
-void TagMap::addTag(const protozero::data_view& key, const protozero::data_view& value) {
-	uint32_t valueLoc = ensureString(values, value);
-	uint32_t keyLoc = ensureString(keys, key);
+	for (const uint32_t id : internedKeysAdded)
+		internedKeyLocs[id] = -1;
+	internedKeysAdded.clear();
+	internedKeyCount = 0;
+}
 
+void TagMap::useInternedKeys(uint32_t count) {
+	internedKeyCount = count;
+	if (internedKeyLocs.size() < count)
+		internedKeyLocs.resize(count, -1);
+}
 
-	const uint16_t shard = keyLoc >> 16;
-	const uint16_t pos = keyLoc;
-	if (key2value[shard].size() <= pos) {
-		key2value[shard].resize(pos + 1);
-	}
+bool TagMap::empty() const {
+	return keys.empty();
+}
 
-	key2value[shard][pos] = valueLoc;
+uint32_t TagMap::hashKey(const char* key, size_t size) {
+	// Keys are short, and often share a prefix (name:en, name:fr...), so
+	// mix in every 8-byte word, not just the first.
+	uint64_t hash = size * 0x9E3779B97F4A7C15ull;
+	for (size_t i = 0; i < size; i += 8) {
+		hash ^= loadWord(key + i, size - i);
+		hash *= 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 32;
+	}
+	const uint32_t rv = hash;
+	return rv == 0 ? 1 : rv;
 }
 
-int64_t TagMap::getKey(const char* key, size_t size) const {
-	// Return -1 if key not found, else return its keyLoc.
-	std::size_t hash = hashString(key, size);
+uint64_t TagMap::keyPrefix(const char* key, size_t size) {
+	return loadWord(key, size);
+}
 
-	const uint16_t shard = hash % keys.size();
-	for (int i = 0; i < keys[shard].size(); i++) {
-		const protozero::data_view& candidate = *keys[shard][i];
-	  if (candidate.size() != size)
+size_t TagMap::findSlot(const char* key, size_t size, uint32_t hash) const {
+	// Return the slot holding this key, or the empty slot where it belongs
+	const uint64_t prefix = keyPrefix(key, size);
+	const size_t mask = index.size() - 1;
+	for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+		const Slot& candidate = index[slot];
+		if (candidate.hash == 0)
+			return slot;
+		if (candidate.hash != hash || candidate.prefix != prefix)
 			continue;
 
-		if (memcmp(candidate.data(), key, size) == 0)
-			return shard << 16 | i;
+		// Same hash and first 8 bytes: only now touch the string itself
+		const protozero::data_view& existing = *keys[candidate.keyLoc];
+		if (existing.size() == size && (size <= 8 || memcmp(existing.data() + 8, key + 8, size - 8) == 0))
+			return slot;
 	}
+}
 
-	return -1;
+void TagMap::growIndex() {
+	std::vector<Slot> old;
+	old.swap(index);
+	index.assign(old.size() * 2, Slot{0, 0, 0});
+	const size_t mask = index.size() - 1;
+	for (const Slot& slot : old) {
+		if (slot.hash == 0) continue;
+		size_t pos = slot.hash & mask;
+		while (index[pos].hash != 0)
+			pos = (pos + 1) & mask;
+		index[pos] = slot;
+	}
 }
 
-int64_t TagMap::getValue(const char* value, size_t size) const {
-	// Return -1 if value not found, else return its valueLoc.
-	std::size_t hash = hashString(value, size);
+void TagMap::addTag(const protozero::data_view& key, const protozero::data_view& value) {
+	addTag(key, value, hashKey(key.data(), key.size()));
+}
+
+void TagMap::addTag(const protozero::data_view& key, const protozero::data_view& value, uint32_t keyHash, int32_t internedKey) {
+	size_t slot = findSlot(key.data(), key.size(), keyHash);
+	uint32_t keyLoc;
+	if (index[slot].hash != 0) {
+		// Repeated key: the last value wins
+		keyLoc = index[slot].keyLoc;
+		values[keyLoc] = &value;
+	} else {
+		keyLoc = keys.size();
+		keys.push_back(&key);
+		values.push_back(&value);
+		index[slot] = Slot{keyHash, keyLoc, keyPrefix(key.data(), key.size())};
+
+		// Keep the load factor under 1/2, so probe sequences stay short
+		if (keys.size() * 2 > index.size())
+			growIndex();
+	}
 
-	const uint16_t shard = hash % values.size();
-	for (int i = 0; i < values[shard].size(); i++) {
-		const protozero::data_view& candidate = *values[shard][i];
-	  if (candidate.size() != size)
-			continue;
+	if (internedKey < 0)
+		return;
+
+	internedKeyLocs[internedKey] = keyLoc;
+	internedKeysAdded.push_back(internedKey);
+}
+
+int64_t TagMap::getInternedKey(uint32_t id, const InternedTagKeys& keys) const {
+	if (id < internedKeyCount)
+		return internedKeyLocs[id];
 
-		if (memcmp(candidate.data(), value, size) == 0)
-			return shard << 16 | i;
+	const std::string& key = keys[id];
+	return getKey(key.data(), key.size());
+}
+
+int64_t TagMap::getKey(const char* key, size_t size) const {
+	// Return -1 if key not found, else return its keyLoc.
+	const Slot& slot = index[findSlot(key, size, hashKey(key, size))];
+	return slot.hash == 0 ? -1 : int64_t(slot.keyLoc);
+}
+
+int64_t TagMap::getValue(const char* value, size_t size) const {
+	// Return -1 if value not found, else return its valueLoc.
+	for (size_t i = 0; i < values.size(); i++) {
+		const protozero::data_view& candidate = *values[i];
+		if (candidate.size() == size && memcmp(candidate.data(), value, size) == 0)
+			return i;
 	}
 
 	return -1;
 }
 
 const protozero::data_view* TagMap::getValueFromKey(uint32_t keyLoc) const {
-	const uint32_t valueLoc = key2value[keyLoc >> 16][keyLoc & 0xFFFF];
-	return values[valueLoc >> 16][valueLoc & 0xFFFF];
+	return values[keyLoc];
 }
 
 const protozero::data_view* TagMap::getValue(uint32_t valueLoc) const {
-	return values[valueLoc >> 16][valueLoc & 0xFFFF];
+	return values[valueLoc];
 }
 
 boost::container::flat_map<std::string, std::string> TagMap::exportToBoostMap() const {
 	boost::container::flat_map<std::string, std::string> rv;
 
-	for (int i = 0; i < keys.size(); i++) {
-		for (int j = 0; j < keys[i].size(); j++) {
-			uint32_t valueLoc = key2value[i][j];
-			auto key = *keys[i][j];
-			auto value = *values[valueLoc >> 16][valueLoc & 0xFFFF];
-			rv[std::string(key.data(), key.size())] = std::string(value.data(), value.size());
-		}
+	for (size_t i = 0; i < keys.size(); i++) {
+		const protozero::data_view& key = *keys[i];
+		const protozero::data_view& value = *values[i];
+		rv[std::string(key.data(), key.size())] = std::string(value.data(), value.size());
 	}
 
 	return rv;
 }
 
 TagMap::Iterator TagMap::begin() const {
-	size_t shard = 0;
-	while(keys.size() > shard && keys[shard].size() == 0)
-		shard++;
-
-	return Iterator{*this, shard, 0};
+	return Iterator{*this, 0};
 }
 
 TagMap::Iterator TagMap::end() const {
-	return Iterator{*this, keys.size(), 0};
+	return Iterator{*this, keys.size()};
 }
 
 bool TagMap::Iterator::operator!=(const Iterator& other) const {
-	return other.shard != shard || other.offset != offset;
+	return other.offset != offset;
 }
 
 void TagMap::Iterator::operator++() {
 	++offset;
-	if (offset >= map.keys[shard].size()) {
-		offset = 0;
-		shard++;
-		// Advance to the next non-empty shard.
-		while(map.keys.size() > shard && map.keys[shard].size() == 0)
-			shard++;
-	}
 }
 
 Tag TagMap::Iterator::operator*() const {
-	const uint32_t valueLoc = map.key2value[shard][offset];
 	return Tag{
-		*map.keys[shard][offset],
-		*map.getValue(valueLoc)
+		*map.keys[offset],
+		*map.values[offset]
 	};
 }
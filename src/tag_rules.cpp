@@ -0,0 +1,198 @@
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "tag_rules.h"
+#include "tag_map.h"
+#include "rapidjson/document.h"
+
+namespace {
+
+std::string ruleName(size_t i) {
+	return "rule " + std::to_string(i + 1);
+}
+
+TagRuleCondition parseCondition(const std::string& key, const rapidjson::Value& value, size_t i) {
+	TagRuleCondition condition { key, true };
+
+	if (value.IsBool()) {
+		condition.present = value.GetBool();
+	} else if (value.IsString()) {
+		condition.values.push_back(value.GetString());
+	} else if (value.IsArray()) {
+		for (const auto& v : value.GetArray()) {
+			if (!v.IsString())
+				throw std::runtime_error(ruleName(i) + ": values to match for \"" + key + "\" must be strings");
+			condition.values.push_back(v.GetString());
+		}
+	} else {
+		throw std::runtime_error(ruleName(i) + ": \"" + key + "\" must match a string, a list of strings, or true/false");
+	}
+
+	return condition;
+}
+
+TagRuleAttribute parseAttribute(const std::string& key, const rapidjson::Value& spec, size_t i) {
+	TagRuleAttribute attribute { key, TagRuleAttribute::Type::String, "", 0, false, 0 };
+
+	const rapidjson::Value* value = &spec;
+	if (spec.IsObject()) {
+		if (!spec.HasMember("value"))
+			throw std::runtime_error(ruleName(i) + ": attribute \"" + key + "\" has no value");
+		value = &spec["value"];
+		if (spec.HasMember("minzoom")) {
+			if (!spec["minzoom"].IsInt())
+				throw std::runtime_error(ruleName(i) + ": minzoom for attribute \"" + key + "\" must be an integer");
+			attribute.minzoom = spec["minzoom"].GetInt();
+		}
+	}
+
+	if (value->IsString()) {
+		const char* s = value->GetString();
+		if (s[0] == '$') {
+			attribute.type = TagRuleAttribute::Type::Tag;
+			attribute.stringValue = s + 1;
+		} else {
+			attribute.stringValue = s;
+		}
+	} else if (value->IsNumber()) {
+		attribute.type = TagRuleAttribute::Type::Number;
+		attribute.numberValue = value->GetDouble();
+	} else if (value->IsBool()) {
+		attribute.type = TagRuleAttribute::Type::Boolean;
+		attribute.booleanValue = value->GetBool();
+	} else {
+		throw std::runtime_error(ruleName(i) + ": attribute \"" + key + "\" must be a string, number or boolean");
+	}
+
+	return attribute;
+}
+
+TagRule parseRule(const rapidjson::Value& json, size_t i) {
+	if (!json.IsObject())
+		throw std::runtime_error(ruleName(i) + " is not an object");
+
+	TagRule rule;
+	rule.nodes = true;
+	rule.ways = true;
+	rule.area = false;
+	rule.minzoom = -1;
+	rule.zorder = 0;
+	rule.hasZOrder = false;
+	rule.callLua = false;
+
+	if (!json.HasMember("match") || !json["match"].IsObject() || json["match"].MemberCount() == 0)
+		throw std::runtime_error(ruleName(i) + " needs a \"match\" object");
+	for (auto it = json["match"].MemberBegin(); it != json["match"].MemberEnd(); ++it)
+		rule.match.push_back(parseCondition(it->name.GetString(), it->value, i));
+
+	if (json.HasMember("objects")) {
+		if (!json["objects"].IsArray())
+			throw std::runtime_error(ruleName(i) + ": objects must be a list");
+		rule.nodes = false;
+		rule.ways = false;
+		for (const auto& v : json["objects"].GetArray()) {
+			std::string type = v.IsString() ? v.GetString() : "";
+			if (type == "node") rule.nodes = true;
+			else if (type == "way") rule.ways = true;
+			else throw std::runtime_error(ruleName(i) + ": objects must be \"node\" or \"way\"");
+		}
+	}
+
+	if (json.HasMember("layer")) {
+		if (!json["layer"].IsString())
+			throw std::runtime_error(ruleName(i) + ": layer must be a string");
+		rule.layer = json["layer"].GetString();
+	}
+	if (json.HasMember("area")) {
+		if (!json["area"].IsBool())
+			throw std::runtime_error(ruleName(i) + ": area must be true or false");
+		rule.area = json["area"].GetBool();
+	}
+	if (json.HasMember("minzoom")) {
+		if (!json["minzoom"].IsNumber())
+			throw std::runtime_error(ruleName(i) + ": minzoom must be a number");
+		rule.minzoom = json["minzoom"].GetDouble();
+	}
+	if (json.HasMember("zorder")) {
+		if (!json["zorder"].IsNumber())
+			throw std::runtime_error(ruleName(i) + ": zorder must be a number");
+		rule.zorder = json["zorder"].GetDouble();
+		rule.hasZOrder = true;
+	}
+	if (json.HasMember("call_lua")) {
+		if (!json["call_lua"].IsBool())
+			throw std::runtime_error(ruleName(i) + ": call_lua must be true or false");
+		rule.callLua = json["call_lua"].GetBool();
+	}
+
+	if (json.HasMember("attributes")) {
+		if (!json["attributes"].IsObject())
+			throw std::runtime_error(ruleName(i) + ": attributes must be an object");
+		for (auto it = json["attributes"].MemberBegin(); it != json["attributes"].MemberEnd(); ++it)
+			rule.attributes.push_back(parseAttribute(it->name.GetString(), it->value, i));
+	}
+
+	if (rule.layer.empty() && !rule.callLua)
+		throw std::runtime_error(ruleName(i) + " has neither a layer nor call_lua");
+	if (rule.layer.empty() && !rule.attributes.empty())
+		throw std::runtime_error(ruleName(i) + " has attributes but no layer");
+
+	return rule;
+}
+
+bool valueMatches(const std::vector<std::string>& values, const protozero::data_view& value) {
+	for (const auto& candidate : values) {
+		if (candidate.size() == value.size() && memcmp(candidate.data(), value.data(), value.size()) == 0)
+			return true;
+	}
+	return false;
+}
+
+}
+
+TagRules::TagRules() {}
+
+void TagRules::load(const std::string& filename) {
+	std::ifstream in(filename);
+	if (!in) throw std::runtime_error("Couldn't open rules file " + filename);
+	std::stringstream buffer;
+	buffer << in.rdbuf();
+	parse(buffer.str());
+}
+
+void TagRules::parse(const std::string& json) {
+	rapidjson::Document doc;
+	doc.Parse(json.c_str());
+	if (doc.HasParseError()) throw std::runtime_error("Invalid JSON in rules file");
+	if (!doc.IsObject() || !doc.HasMember("rules") || !doc["rules"].IsArray())
+		throw std::runtime_error("Rules file must be an object with a \"rules\" list");
+
+	rules.clear();
+	size_t i = 0;
+	for (const auto& rule : doc["rules"].GetArray()) {
+		rules.push_back(parseRule(rule, i));
+		i++;
+	}
+}
+
+bool TagRules::matches(const TagRule& rule, const TagMap& tags) {
+	for (const auto& condition : rule.match) {
+		int64_t keyLoc = tags.getKey(condition.key.data(), condition.key.size());
+		if (keyLoc < 0) {
+			if (condition.present) return false;
+			continue;
+		}
+		if (!condition.present) return false;
+		if (!condition.values.empty() && !valueMatches(condition.values, *tags.getValueFromKey(keyLoc)))
+			return false;
+	}
+	return true;
+}
+
+void TagRules::matching(const TagMap& tags, bool isWay, std::vector<const TagRule*>& out) const {
+	for (const auto& rule : rules) {
+		if (isWay ? !rule.ways : !rule.nodes) continue;
+		if (matches(rule, tags)) out.push_back(&rule);
+	}
+}
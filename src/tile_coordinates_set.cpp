@@ -1,17 +1,41 @@
 #include "tile_coordinates_set.h"
+#include <algorithm>
 #include <string>
 #include <stdexcept>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+	inline unsigned int lowestSetBit(uint64_t word) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, word);
+		return index;
+#else
+		return __builtin_ctzll(word);
+#endif
+	}
+
+	inline size_t countSetBits(uint64_t word) {
+#ifdef _MSC_VER
+		return __popcnt64(word);
+#else
+		return __builtin_popcountll(word);
+#endif
+	}
+}
 
 PreciseTileCoordinatesSet::PreciseTileCoordinatesSet(unsigned int zoom):
 	zoom_(zoom),
-	tiles((1 << zoom) * (1 << zoom)) {}
+	tiles(((1ull << zoom) * (1ull << zoom) + 63) / 64) {}
 
 bool PreciseTileCoordinatesSet::test(TileCoordinate x, TileCoordinate y) const {
-	uint64_t loc = x * (1 << zoom_) + y;
-	if (loc >= tiles.size())
+	uint64_t loc = x * (1ull << zoom_) + y;
+	if (loc >= (1ull << zoom_) * (1ull << zoom_))
 		return false;
 
-	return tiles[loc];
+	return (tiles[loc / 64] >> (loc % 64)) & 1;
 }
 
 size_t PreciseTileCoordinatesSet::zoom() const {
@@ -20,18 +44,213 @@ size_t PreciseTileCoordinatesSet::zoom() const {
 
 size_t PreciseTileCoordinatesSet::size() const {
 	size_t rv = 0;
-	for (int i = 0; i < tiles.size(); i++)
-		if (tiles[i])
-			rv++;
+	for (const uint64_t word : tiles)
+		rv += countSetBits(word);
 
 	return rv;
 }
 
 void PreciseTileCoordinatesSet::set(TileCoordinate x, TileCoordinate y) {
-	uint64_t loc = x * (1 << zoom_) + y;
-	if (loc >= tiles.size())
+	uint64_t loc = x * (1ull << zoom_) + y;
+	if (loc >= (1ull << zoom_) * (1ull << zoom_))
+		return;
+	tiles[loc / 64] |= 1ull << (loc % 64);
+}
+
+void PreciseTileCoordinatesSet::forEach(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const {
+	const uint64_t width = 1ull << zoom_;
+	const uint64_t begin = std::min<uint64_t>(minX, width) * width;
+	const uint64_t end = std::min<uint64_t>(maxX, width) * width;
+	if (begin >= end)
+		return;
+
+	// Below z3 a word holds more than one row, so mask the words at each end
+	for (uint64_t wordIndex = begin / 64; wordIndex <= (end - 1) / 64; wordIndex++) {
+		uint64_t word = tiles[wordIndex];
+		if (wordIndex == begin / 64)
+			word &= ~0ull << (begin % 64);
+		if (wordIndex == (end - 1) / 64 && end % 64 != 0)
+			word &= ~(~0ull << (end % 64));
+
+		while (word != 0) {
+			const uint64_t loc = wordIndex * 64 + lowestSetBit(word);
+			f(loc / width, loc % width);
+			word &= word - 1;
+		}
+	}
+}
+
+#define SPARSE_BLOCK_BITS 8
+#define SPARSE_BLOCK_WIDTH (1u << SPARSE_BLOCK_BITS)
+#define SPARSE_BLOCK_MASK (SPARSE_BLOCK_WIDTH - 1)
+// An array of this many offsets is as big as the block's bitmap
+#define SPARSE_BLOCK_MAX_OFFSETS (SPARSE_BLOCK_WIDTH * SPARSE_BLOCK_WIDTH / 16)
+
+bool SparseTileCoordinatesSet::Block::test(uint16_t offset) const {
+	if (!bitmap.empty())
+		return (bitmap[offset / 64] >> (offset % 64)) & 1;
+
+	return std::binary_search(offsets.begin(), offsets.end(), offset);
+}
+
+void SparseTileCoordinatesSet::Block::set(uint16_t offset) {
+	if (!bitmap.empty()) {
+		bitmap[offset / 64] |= 1ull << (offset % 64);
+		return;
+	}
+
+	const auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+	if (it != offsets.end() && *it == offset)
 		return;
-	tiles[loc] = true;
+	offsets.insert(it, offset);
+	if (offsets.size() > SPARSE_BLOCK_MAX_OFFSETS)
+		makeBitmap();
+}
+
+size_t SparseTileCoordinatesSet::Block::size() const {
+	if (bitmap.empty())
+		return offsets.size();
+
+	size_t rv = 0;
+	for (const uint64_t word : bitmap)
+		rv += countSetBits(word);
+	return rv;
+}
+
+void SparseTileCoordinatesSet::Block::forEachInRow(TileCoordinate x, const std::function<void(TileCoordinate y)>& f) const {
+	if (bitmap.empty()) {
+		auto it = std::lower_bound(offsets.begin(), offsets.end(), x << SPARSE_BLOCK_BITS);
+		for (; it != offsets.end() && (*it >> SPARSE_BLOCK_BITS) == x; it++)
+			f(*it & SPARSE_BLOCK_MASK);
+		return;
+	}
+
+	const size_t wordsPerRow = SPARSE_BLOCK_WIDTH / 64;
+	for (size_t i = 0; i < wordsPerRow; i++) {
+		uint64_t word = bitmap[x * wordsPerRow + i];
+		while (word != 0) {
+			f(i * 64 + lowestSetBit(word));
+			word &= word - 1;
+		}
+	}
+}
+
+void SparseTileCoordinatesSet::Block::makeBitmap() {
+	bitmap.resize(SPARSE_BLOCK_WIDTH * SPARSE_BLOCK_WIDTH / 64);
+	for (const uint16_t offset : offsets)
+		bitmap[offset / 64] |= 1ull << (offset % 64);
+	std::vector<uint16_t>().swap(offsets);
+}
+
+SparseTileCoordinatesSet::SparseTileCoordinatesSet(unsigned int zoom, const TileCoordinatesSet& covered):
+	zoom_(zoom), covered(covered), scale(1 << (zoom - covered.zoom())) {
+	if (zoom > 20)
+		throw std::out_of_range("SparseTileCoordinatesSet: zoom (" + std::to_string(zoom) + ") must be at most 20");
+	if (zoom <= covered.zoom())
+		throw std::out_of_range("SparseTileCoordinatesSet: zoom (" + std::to_string(zoom) + ") must be greater than covered set's zoom (" + std::to_string(covered.zoom()) + ")");
+}
+
+bool SparseTileCoordinatesSet::test(TileCoordinate x, TileCoordinate y) const {
+	if (covered.test(x / scale, y / scale))
+		return true;
+
+	const auto it = blocks.find(std::make_pair(x >> SPARSE_BLOCK_BITS, y >> SPARSE_BLOCK_BITS));
+	if (it == blocks.end())
+		return false;
+
+	return it->second.test(((x & SPARSE_BLOCK_MASK) << SPARSE_BLOCK_BITS) | (y & SPARSE_BLOCK_MASK));
+}
+
+size_t SparseTileCoordinatesSet::size() const {
+	size_t rv = covered.size() * scale * scale;
+	forEachSet(0, 1u << zoom_, [&](TileCoordinate x, TileCoordinate y) {
+		if (!covered.test(x / scale, y / scale))
+			rv++;
+	});
+	return rv;
+}
+
+size_t SparseTileCoordinatesSet::zoom() const {
+	return zoom_;
+}
+
+void SparseTileCoordinatesSet::set(TileCoordinate x, TileCoordinate y) {
+	if (x >= (1u << zoom_) || y >= (1u << zoom_))
+		return;
+
+	blocks[std::make_pair(x >> SPARSE_BLOCK_BITS, y >> SPARSE_BLOCK_BITS)].set(((x & SPARSE_BLOCK_MASK) << SPARSE_BLOCK_BITS) | (y & SPARSE_BLOCK_MASK));
+}
+
+void SparseTileCoordinatesSet::forEachSet(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const {
+	auto it = blocks.lower_bound(std::make_pair(minX >> SPARSE_BLOCK_BITS, 0u));
+	while (it != blocks.end() && (it->first.first << SPARSE_BLOCK_BITS) < maxX) {
+		// Visit the row of blocks a row of tiles at a time, so that tiles
+		// come out in order of x then y
+		const TileCoordinate blockX = it->first.first;
+		auto rowEnd = it;
+		while (rowEnd != blocks.end() && rowEnd->first.first == blockX)
+			rowEnd++;
+
+		const TileCoordinate startX = std::max(minX, blockX << SPARSE_BLOCK_BITS);
+		const TileCoordinate endX = std::min(maxX, (blockX + 1) << SPARSE_BLOCK_BITS);
+		for (TileCoordinate x = startX; x < endX; x++) {
+			for (auto block = it; block != rowEnd; block++) {
+				const TileCoordinate baseY = block->first.second << SPARSE_BLOCK_BITS;
+				block->second.forEachInRow(x & SPARSE_BLOCK_MASK, [&](TileCoordinate y) {
+					f(x, baseY + y);
+				});
+			}
+		}
+		it = rowEnd;
+	}
+}
+
+void SparseTileCoordinatesSet::forEach(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const {
+	std::vector<std::pair<TileCoordinate, TileCoordinate>> single;
+	forEachSet(minX, maxX, [&](TileCoordinate x, TileCoordinate y) {
+		single.push_back(std::make_pair(x, y));
+	});
+
+	// Merge the individual tiles with those under each row of covered tiles,
+	// skipping individual tiles that are also covered
+	size_t next = 0;
+	auto singlesBefore = [&](TileCoordinate x) {
+		for (; next < single.size() && single[next].first < x; next++)
+			f(single[next].first, single[next].second);
+	};
+
+	std::vector<TileCoordinate> coveredYs;
+	TileCoordinate coveredX = minX / scale;
+	auto flushRow = [&]() {
+		for (TileCoordinate x = std::max(minX, coveredX * scale); x < std::min(maxX, (coveredX + 1) * scale); x++) {
+			singlesBefore(x);
+			size_t c = 0;
+			auto coveredBefore = [&](TileCoordinate y) {
+				for (; c < coveredYs.size() && coveredYs[c] * scale < y; c++)
+					for (TileCoordinate coveredY = coveredYs[c] * scale; coveredY < (coveredYs[c] + 1) * scale; coveredY++)
+						f(x, coveredY);
+			};
+			for (; next < single.size() && single[next].first == x; next++) {
+				const TileCoordinate y = single[next].second;
+				coveredBefore(y + 1);
+				if (c == 0 || (coveredYs[c - 1] + 1) * scale <= y)
+					f(x, y);
+			}
+			coveredBefore(1u << zoom_);
+		}
+		coveredYs.clear();
+	};
+
+	const TileCoordinate coveredMaxX = maxX / scale + (maxX % scale != 0);
+	covered.forEach(minX / scale, coveredMaxX, [&](TileCoordinate x, TileCoordinate y) {
+		if (x != coveredX) {
+			flushRow();
+			coveredX = x;
+		}
+		coveredYs.push_back(y);
+	});
+	flushRow();
+	singlesBefore(maxX);
 }
 
 LossyTileCoordinatesSet::LossyTileCoordinatesSet(unsigned int zoom, const TileCoordinatesSet& underlying) : zoom_(zoom), tiles(underlying), scale(1 << (zoom - underlying.zoom())) {
@@ -55,3 +274,103 @@ void LossyTileCoordinatesSet::set(TileCoordinate x, TileCoordinate y) {
 	throw std::logic_error("LossyTileCoordinatesSet::set() is not implemented; LossyTileCoordinatesSet is read-only");
 }
 
+void LossyTileCoordinatesSet::forEach(TileCoordinate minX, TileCoordinate maxX, const std::function<void(TileCoordinate x, TileCoordinate y)>& f) const {
+	// Each underlying tile covers scale x scale tiles; visit those in the band
+	const TileCoordinate underlyingMaxX = maxX / scale + (maxX % scale != 0);
+	std::vector<TileCoordinate> ys;
+	TileCoordinate underlyingX = minX / scale;
+	auto flushRow = [&]() {
+		for (TileCoordinate x = std::max(minX, underlyingX * scale); x < std::min(maxX, (underlyingX + 1) * scale); x++)
+			for (const TileCoordinate underlyingY : ys)
+				for (TileCoordinate y = underlyingY * scale; y < (underlyingY + 1) * scale; y++)
+					f(x, y);
+		ys.clear();
+	};
+
+	tiles.forEach(minX / scale, underlyingMaxX, [&](TileCoordinate x, TileCoordinate y) {
+		if (x != underlyingX) {
+			flushRow();
+			underlyingX = x;
+		}
+		ys.push_back(y);
+	});
+	flushRow();
+}
+
+
+TileEnumerator::TileEnumerator(
+	const std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+	unsigned int clusterZoom,
+	unsigned int startZoom,
+	unsigned int endZoom,
+	IncludeTile includeTile
+):
+	zooms(zooms), clusterZoom(clusterZoom), startZoom(startZoom), endZoom(endZoom), includeTile(includeTile),
+	lowZoom(0), lowIndex(0), clusterIndex(0) {
+	if (zooms.size() <= endZoom)
+		throw std::out_of_range("TileEnumerator: expected sets up to z" + std::to_string(endZoom) + ", but found " + std::to_string(zooms.size()));
+}
+
+bool TileEnumerator::visible(unsigned int zoom, TileCoordinate x, TileCoordinate y) const {
+	return zooms[zoom]->test(x, y) && includeTile(zoom, x, y);
+}
+
+bool TileEnumerator::next(unsigned int& zoom, TileCoordinates& coordinates) {
+	// Breadth-first below clusterZoom
+	while (lowZoom < clusterZoom && lowZoom <= endZoom) {
+		const uint64_t width = 1ull << lowZoom;
+		while (lowIndex < width * width) {
+			const TileCoordinate x = lowIndex / width;
+			const TileCoordinate y = lowIndex % width;
+			lowIndex++;
+			if (lowZoom >= startZoom && visible(lowZoom, x, y)) {
+				zoom = lowZoom;
+				coordinates = TileCoordinates(x, y);
+				return true;
+			}
+		}
+		lowZoom++;
+		lowIndex = 0;
+	}
+	if (endZoom < clusterZoom)
+		return false;
+
+	// Depth-first within each clusterZoom tile
+	const uint64_t clusterWidth = 1ull << clusterZoom;
+	while (true) {
+		if (stack.empty()) {
+			if (clusterIndex == clusterWidth * clusterWidth)
+				return false;
+
+			const TileCoordinate x = clusterIndex / clusterWidth;
+			const TileCoordinate y = clusterIndex % clusterWidth;
+			clusterIndex++;
+			if (!visible(clusterZoom, x, y))
+				continue;
+
+			stack.push_back({clusterZoom, x, y, 0});
+		} else {
+			Frame& parent = stack.back();
+			if (parent.zoom == endZoom || parent.child == 4) {
+				stack.pop_back();
+				continue;
+			}
+
+			const unsigned int childZoom = parent.zoom + 1;
+			const TileCoordinate x = parent.x * 2 + (parent.child >> 1);
+			const TileCoordinate y = parent.y * 2 + (parent.child & 1);
+			parent.child++;
+			if (!visible(childZoom, x, y))
+				continue;
+
+			stack.push_back({childZoom, x, y, 0});
+		}
+
+		const Frame& tile = stack.back();
+		if (tile.zoom >= startZoom) {
+			zoom = tile.zoom;
+			coordinates = TileCoordinates(tile.x, tile.y);
+			return true;
+		}
+	}
+}
@@ -3,6 +3,7 @@
 #include "tile_data.h"
 #include "coordinates_geom.h"
 #include "leased_store.h"
+#include "index_file.h"
 #include <ciso646>
 
 using namespace std;
@@ -19,9 +20,7 @@ TileDataSource::TileDataSource(size_t threadNum, unsigned int indexZoom, bool in
 	z6OffsetDivisor(indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1),
 	objectsMutex(threadNum * 4),
 	objects(CLUSTER_ZOOM_AREA),
-	lowZoomObjects(CLUSTER_ZOOM_AREA),
 	objectsWithIds(CLUSTER_ZOOM_AREA),
-	lowZoomObjectsWithIds(CLUSTER_ZOOM_AREA),
 	indexZoom(indexZoom),
 	pointStores(threadNum),
 	linestringStores(threadNum),
@@ -53,7 +52,10 @@ TileDataSource::TileDataSource(size_t threadNum, unsigned int indexZoom, bool in
 
 thread_local std::vector<std::tuple<TileCoordinates, OutputObject, uint64_t>>* tlsPendingSmallIndexObjects = nullptr;
 
-void TileDataSource::finalize(size_t threadNum) {
+// Each thread's buffer of large objects, for each source it has added to
+thread_local std::vector<std::pair<const TileDataSource*, PendingLargeObjects*>> tlsPendingLargeObjects;
+
+void TileDataSource::finalize(size_t threadNum, const std::vector<bool>& sortOrders) {
 	uint64_t finalized = 0;
 	for (const auto& vec : pendingSmallIndexObjects) {
 		for (const auto& tuple : vec) {
@@ -64,8 +66,204 @@ void TileDataSource::finalize(size_t threadNum) {
 
 	std::cout << "indexed " << finalized << " contended objects" << std::endl;
 
-	finalizeObjects<OutputObjectXY>(name(), threadNum, indexZoom, objects.begin(), objects.end(), lowZoomObjects);
-	finalizeObjects<OutputObjectXYID>(name(), threadNum, indexZoom, objectsWithIds.begin(), objectsWithIds.end(), lowZoomObjectsWithIds);
+	// Sort each index tile's objects into the order they'll be written in,
+	// so that getObjectsForTile only has to merge them.
+	OutputObjectOrder order { sortOrders };
+	finalizeObjects<OutputObject>(name(), threadNum, indexZoom, objects.begin(), objects.end(), lowZoomObjects, order);
+	finalizeObjects<OutputObjectID>(name(), threadNum, indexZoom, objectsWithIds.begin(), objectsWithIds.end(), lowZoomObjectsWithIds, order);
+
+	// Bulk-load the large objects into the rtrees, which packs them into
+	// fuller, less overlapping nodes than inserting them one by one.
+	std::vector<std::pair<Box, OutputObject>> large;
+	std::vector<std::pair<Box, OutputObjectID>> largeWithIds;
+	for (auto& pending : pendingLargeObjects) {
+		large.insert(large.end(), pending.objects.begin(), pending.objects.end());
+		largeWithIds.insert(largeWithIds.end(), pending.objectsWithIds.begin(), pending.objectsWithIds.end());
+		// Keep the (now empty) buffers: threads may still hold pointers to them
+		std::vector<std::pair<Box, OutputObject>>().swap(pending.objects);
+		std::vector<std::pair<Box, OutputObjectID>>().swap(pending.objectsWithIds);
+	}
+	large.insert(large.end(), boxRtree.begin(), boxRtree.end());
+	largeWithIds.insert(largeWithIds.end(), boxRtreeWithIds.begin(), boxRtreeWithIds.end());
+	boxRtree = decltype(boxRtree)(large.begin(), large.end());
+	boxRtreeWithIds = decltype(boxRtreeWithIds)(largeWithIds.begin(), largeWithIds.end());
+}
+
+namespace {
+	template<typename T> void saveAppendVector(IndexFileWriter& writer, const AppendVectorNS::AppendVector<T>& values) {
+		writer.write<uint64_t>(values.size());
+		for (const auto& chunk : values.vecs)
+			if (!chunk.empty())
+				writer.writeValues(chunk.data(), chunk.size());
+	}
+
+	template<typename T> void loadAppendVector(IndexFileReader& reader, AppendVectorNS::AppendVector<T>& values) {
+		values.clear();
+		reader.readBatches<T>(reader.read<uint64_t>(), [&values](const T* batch, size_t n) {
+			for (size_t i = 0; i < n; i++)
+				values.push_back(batch[i]);
+		});
+	}
+
+	template<typename OO> void saveObjects(IndexFileWriter& writer, const std::vector<Z6Objects<OO>>& objects, const LowZoomIndex<OO>& lowZoom) {
+		for (const auto& tile : objects) {
+			saveAppendVector(writer, tile.xy);
+			saveAppendVector(writer, tile.payloads);
+		}
+		writer.writeArray(lowZoom.objects);
+		writer.writeArray(lowZoom.offsets);
+	}
+
+	template<typename OO> void loadObjects(IndexFileReader& reader, std::vector<Z6Objects<OO>>& objects, LowZoomIndex<OO>& lowZoom) {
+		for (auto& tile : objects) {
+			loadAppendVector(reader, tile.xy);
+			loadAppendVector(reader, tile.payloads);
+			if (tile.xy.size() != tile.payloads.size())
+				throw std::runtime_error("index file has mismatched objects in a z6 tile");
+		}
+		reader.readArray(lowZoom.objects);
+		reader.readArray(lowZoom.offsets);
+		if (lowZoom.offsets.size() != CLUSTER_ZOOM_AREA + 1)
+			throw std::runtime_error("index file has a corrupt low zoom index");
+	}
+
+	template<typename Rtree> void saveRtree(IndexFileWriter& writer, const Rtree& rtree) {
+		writer.write<uint64_t>(rtree.size());
+		for (const auto& entry : rtree) {
+			writer.write(entry.first);
+			writer.write(entry.second);
+		}
+	}
+
+	template<typename Rtree> void loadRtree(IndexFileReader& reader, Rtree& rtree) {
+		using Entry = typename Rtree::value_type;
+		std::vector<Entry> entries;
+		const uint64_t count = reader.read<uint64_t>();
+		entries.reserve(count);
+		for (uint64_t i = 0; i < count; i++) {
+			const Box box = reader.read<Box>();
+			entries.push_back(Entry(box, reader.read<typename Entry::second_type>()));
+		}
+		rtree = Rtree(entries.begin(), entries.end());
+	}
+
+	template<typename Rings> void saveRings(IndexFileWriter& writer, const Rings& rings) {
+		writer.write<uint64_t>(rings.size());
+		for (const auto& ring : rings)
+			writer.writeArray(ring);
+	}
+
+	template<typename Rings> void loadRings(IndexFileReader& reader, Rings& rings) {
+		rings.resize(reader.read<uint64_t>());
+		for (auto& ring : rings)
+			reader.readArray(ring);
+	}
+
+	void saveGeometry(IndexFileWriter& writer, const Point& point) { writer.write(point); }
+	void loadGeometry(IndexFileReader& reader, Point& point) { point = reader.read<Point>(); }
+
+	void saveGeometry(IndexFileWriter& writer, const TileDataSource::linestring_t& ls) { writer.writeArray(ls); }
+	void loadGeometry(IndexFileReader& reader, TileDataSource::linestring_t& ls) { reader.readArray(ls); }
+
+	void saveGeometry(IndexFileWriter& writer, const TileDataSource::multi_linestring_t& mls) { saveRings(writer, mls); }
+	void loadGeometry(IndexFileReader& reader, TileDataSource::multi_linestring_t& mls) { loadRings(reader, mls); }
+
+	void saveGeometry(IndexFileWriter& writer, const TileDataSource::multi_polygon_t& mp) {
+		writer.write<uint64_t>(mp.size());
+		for (const auto& polygon : mp) {
+			writer.writeArray(polygon.outer());
+			saveRings(writer, polygon.inners());
+		}
+	}
+
+	void loadGeometry(IndexFileReader& reader, TileDataSource::multi_polygon_t& mp) {
+		mp.resize(reader.read<uint64_t>());
+		for (auto& polygon : mp) {
+			reader.readArray(polygon.outer());
+			loadRings(reader, polygon.inners());
+		}
+	}
+
+	template<typename Store> void saveStores(IndexFileWriter& writer, const std::vector<Store>& stores) {
+		writer.write<uint64_t>(stores.size());
+		for (const auto& store : stores) {
+			writer.write<uint64_t>(store.size());
+			for (const auto& geometry : store)
+				saveGeometry(writer, geometry);
+		}
+	}
+
+	template<typename Store> void loadStores(IndexFileReader& reader, std::vector<Store>& stores) {
+		stores.clear();
+		stores.resize(reader.read<uint64_t>());
+		for (auto& store : stores) {
+			store.resize(reader.read<uint64_t>());
+			for (auto& geometry : store)
+				loadGeometry(reader, geometry);
+		}
+	}
+}
+
+void TileDataSource::save(IndexFileWriter& writer) const {
+	writer.section("SRC ");
+	writer.writeString(name());
+	writer.write<uint8_t>(shardBits);
+
+	saveObjects(writer, objects, lowZoomObjects);
+	saveObjects(writer, objectsWithIds, lowZoomObjectsWithIds);
+	saveRtree(writer, boxRtree);
+	saveRtree(writer, boxRtreeWithIds);
+
+	saveStores(writer, pointStores);
+	saveStores(writer, linestringStores);
+	saveStores(writer, multilinestringStores);
+	saveStores(writer, multipolygonStores);
+}
+
+void TileDataSource::load(IndexFileReader& reader) {
+	reader.section("SRC ");
+	const std::string savedName = reader.readString();
+	if (savedName != name())
+		throw std::runtime_error("index file has source " + savedName + " where " + name() + " was expected");
+
+	// Generated geometry IDs encode the shard they were stored in
+	shardBits = reader.read<uint8_t>();
+	numShards = 1 << shardBits;
+
+	loadObjects(reader, objects, lowZoomObjects);
+	loadObjects(reader, objectsWithIds, lowZoomObjectsWithIds);
+	loadRtree(reader, boxRtree);
+	loadRtree(reader, boxRtreeWithIds);
+
+	// The stores may now have a different number of shards from the
+	// leases, but nothing more is stored after loading.
+	availablePointStoreLeases.clear();
+	availableLinestringStoreLeases.clear();
+	availableMultiLinestringStoreLeases.clear();
+	availableMultiPolygonStoreLeases.clear();
+	loadStores(reader, pointStores);
+	loadStores(reader, linestringStores);
+	loadStores(reader, multilinestringStores);
+	loadStores(reader, multipolygonStores);
+}
+
+void TileDataSource::addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id) {
+	PendingLargeObjects* pending = nullptr;
+	for (const auto& entry : tlsPendingLargeObjects)
+		if (entry.first == this)
+			pending = entry.second;
+
+	if (pending == nullptr) {
+		std::lock_guard<std::mutex> lock(mutex);
+		pendingLargeObjects.push_back(PendingLargeObjects());
+		pending = &pendingLargeObjects.back();
+		tlsPendingLargeObjects.push_back(std::make_pair(this, pending));
+	}
+
+	if (id == 0 || !includeID)
+		pending->objects.push_back(std::make_pair(envelope, oo));
+	else
+		pending->objectsWithIds.push_back(std::make_pair(envelope, OutputObjectID({oo, id})));
 }
 
 void TileDataSource::addObjectToSmallIndex(const TileCoordinates& index, const OutputObject& oo, uint64_t id) {
@@ -101,26 +299,18 @@ void TileDataSource::addObjectToSmallIndexUnsafe(const TileCoordinates& index, c
 	const size_t z6x = index.x / z6OffsetDivisor;
 	const size_t z6y = index.y / z6OffsetDivisor;
 	const size_t z6index = z6x * CLUSTER_ZOOM_WIDTH + z6y;
+	const Z6XY xy = packZ6XY(index.x - (z6x * z6OffsetDivisor), index.y - (z6y * z6OffsetDivisor));
 
 	if (id == 0 || !includeID)
-		objects[z6index].push_back({
-			oo,
-			(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
-			(Z6Offset)(index.y - (z6y * z6OffsetDivisor))
-		});
+		objects[z6index].push_back(xy, oo);
 	else
-		objectsWithIds[z6index].push_back({
-			oo,
-			(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
-			(Z6Offset)(index.y - (z6y * z6OffsetDivisor)),
-			id
-		});
+		objectsWithIds[z6index].push_back(xy, OutputObjectID({ oo, id }));
 }
 
 void TileDataSource::collectTilesWithObjectsAtZoom(std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms) {
 	// Scan through all shards. Convert to base zoom, then convert to the requested zoom.
-	collectTilesWithObjectsAtZoomTemplate<OutputObjectXY>(indexZoom, objects.begin(), objects.size(), zooms);
-	collectTilesWithObjectsAtZoomTemplate<OutputObjectXYID>(indexZoom, objectsWithIds.begin(), objectsWithIds.size(), zooms);
+	collectTilesWithObjectsAtZoomTemplate<OutputObject>(indexZoom, objects.begin(), objects.size(), zooms);
+	collectTilesWithObjectsAtZoomTemplate<OutputObjectID>(indexZoom, objectsWithIds.begin(), objectsWithIds.size(), zooms);
 }
 
 void addCoveredTilesToOutput(const uint indexZoom, std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms, const Box& box) {
@@ -153,15 +343,76 @@ void TileDataSource::collectTilesWithLargeObjectsAtZoom(std::vector<std::shared_
 		addCoveredTilesToOutput(indexZoom, zooms, result.first);
 }
 
+template<typename OO> void TileDataSource::collectTilesAboveIndexZoomTemplate(
+	std::vector<Z6Objects<OO>>& tiles,
+	unsigned int firstZoom,
+	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+	TileCoordinatesSet& covered
+) {
+	for (size_t i = 0; i < tiles.size(); i++) {
+		const TileCoordinate z6x = i / CLUSTER_ZOOM_WIDTH;
+		const TileCoordinate z6y = i % CLUSTER_ZOOM_WIDTH;
+
+		// Objects in the same index tile are adjacent, so only cover each once
+		int64_t filledX = -1;
+		int64_t filledY = -1;
+		auto payload = tiles[i].payloads.begin();
+		for (auto xyIt = tiles[i].xy.begin(); xyIt != tiles[i].xy.end(); xyIt++, payload++) {
+			const TileCoordinate baseX = z6x * z6OffsetDivisor + z6X(*xyIt);
+			const TileCoordinate baseY = z6y * z6OffsetDivisor + z6Y(*xyIt);
+			const OutputObject& oo = payloadObject(*payload);
+
+			if (oo.geomType == POINT_) {
+				const LatpLon ll = buildNodeGeometry(oo.objectID, TileBbox(TileCoordinates(baseX, baseY), indexZoom, false, false));
+				for (unsigned int zoom = firstZoom; zoom < zooms.size(); zoom++) {
+					// Keep to the index tile, in case of rounding at its edges
+					const TileCoordinate scale = 1 << (zoom - indexZoom);
+					const TileCoordinate x = std::min(std::max(lon2tilex(ll.lon / 10000000.0, zoom), baseX * scale), baseX * scale + scale - 1);
+					const TileCoordinate y = std::min(std::max(latp2tiley(ll.latp / 10000000.0, zoom), baseY * scale), baseY * scale + scale - 1);
+					zooms[zoom]->set(x, y);
+				}
+			} else if (filledX != baseX || filledY != baseY) {
+				filledX = baseX;
+				filledY = baseY;
+				covered.set(baseX, baseY);
+			}
+		}
+	}
+}
+
+void TileDataSource::collectTilesAboveIndexZoom(
+	unsigned int firstZoom,
+	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+	TileCoordinatesSet& covered
+) {
+	if (covered.zoom() != indexZoom)
+		throw std::out_of_range("collectTilesAboveIndexZoom: covered set is z" + std::to_string(covered.zoom()) + ", but index is z" + std::to_string(indexZoom));
+
+	collectTilesAboveIndexZoomTemplate<OutputObject>(objects, firstZoom, zooms, covered);
+	collectTilesAboveIndexZoomTemplate<OutputObjectID>(objectsWithIds, firstZoom, zooms, covered);
+
+	// Large objects cover every index tile their box covers
+	auto addCoveredTiles = [&](const Box& box) {
+		for (TileCoordinate x = box.min_corner().x(); x <= box.max_corner().x(); x++)
+			for (TileCoordinate y = box.min_corner().y(); y <= box.max_corner().y(); y++)
+				covered.set(x, y);
+	};
+	for (auto const &result : boxRtree)
+		addCoveredTiles(result.first);
+	for (auto const &result : boxRtreeWithIds)
+		addCoveredTiles(result.first);
+}
+
 // Copy objects from the tile at dstIndex (in the dataset srcTiles) into output
 void TileDataSource::collectObjectsForTile(
 	uint zoom,
 	TileCoordinates dstIndex,
-	std::vector<OutputObjectID>& output
+	std::vector<OutputObjectID>& output,
+	std::vector<size_t>& runs
 ) {
 	if (zoom < CLUSTER_ZOOM) {
-		collectLowZoomObjectsForTile<OutputObjectXY>(indexZoom, lowZoomObjects, zoom, dstIndex, output);
-		collectLowZoomObjectsForTile<OutputObjectXYID>(indexZoom, lowZoomObjectsWithIds, zoom, dstIndex, output);
+		lowZoomObjects.collect(zoom, dstIndex, output, runs);
+		lowZoomObjectsWithIds.collect(zoom, dstIndex, output, runs);
 		return;
 	}
 
@@ -180,8 +431,8 @@ void TileDataSource::collectObjectsForTile(
 		iEnd = iStart + 1;
 	}
 
-	collectObjectsForTileTemplate<OutputObjectXY>(indexZoom, objects.begin(), iStart, iEnd, zoom, dstIndex, output);
-	collectObjectsForTileTemplate<OutputObjectXYID>(indexZoom, objectsWithIds.begin(), iStart, iEnd, zoom, dstIndex, output);
+	collectObjectsForTileTemplate<OutputObject>(indexZoom, objects.begin(), iStart, iEnd, zoom, dstIndex, output, runs);
+	collectObjectsForTileTemplate<OutputObjectID>(indexZoom, objectsWithIds.begin(), iStart, iEnd, zoom, dstIndex, output, runs);
 }
 
 // Copy objects from the large index into output
@@ -383,43 +634,82 @@ void TileDataSource::reportSize() const {
 
 void populateTilesAtZoom(
 	const std::vector<class TileDataSource *>& sources,
-	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms
+	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+	TileCoordinatesSet* covered
 ) {
-	if (zooms.size() > 15)
-		throw std::out_of_range("populateTilesAtZoom: expected at most z14 zooms (15), but found " + std::to_string(zooms.size()) + " vectors");
+	if (zooms.size() > 21)
+		throw std::out_of_range("populateTilesAtZoom: expected at most z20 zooms (21), but found " + std::to_string(zooms.size()) + " vectors");
 
+	if (zooms.size() > 15 && covered == nullptr)
+		throw std::invalid_argument("populateTilesAtZoom: zooms above z14 need a covered set");
+
+	// Up to z14, tiles come from the index alone
+	std::vector<std::shared_ptr<TileCoordinatesSet>> indexZooms(zooms.begin(), zooms.begin() + std::min<size_t>(zooms.size(), 15));
 	for(size_t i=0; i<sources.size(); i++) {
-		sources[i]->collectTilesWithObjectsAtZoom(zooms);
-		sources[i]->collectTilesWithLargeObjectsAtZoom(zooms);
+		sources[i]->collectTilesWithObjectsAtZoom(indexZooms);
+		sources[i]->collectTilesWithLargeObjectsAtZoom(indexZooms);
+		if (zooms.size() > 15)
+			sources[i]->collectTilesAboveIndexZoom(15, zooms, *covered);
 	}
 }
 
 std::vector<OutputObjectID> TileDataSource::getObjectsForTile(
 	const std::vector<bool>& sortOrders, 
+	const std::vector<uint>& featureLimits,
 	unsigned int zoom,
 	TileCoordinates coordinates
 ) {
+	// The objects of each index tile (or z6 tile, below z6) were sorted in
+	// finalize, so they're collected as runs that only need to be merged.
+	// The large objects come from the rtree in no particular order, and are
+	// sorted into one more run.
+	OutputObjectOrder order { sortOrders };
+	std::vector<OutputObjectID> collected;
+	std::vector<size_t> runs;
+	collectObjectsForTile(zoom, coordinates, collected, runs);
+	const size_t largeStart = collected.size();
+	collectLargeObjectsForTile(zoom, coordinates, collected);
+	if (collected.size() > largeStart) {
+		boost::sort::pdqsort(collected.begin() + largeStart, collected.end(), order);
+		runs.push_back(largeStart);
+	}
+	runs.push_back(collected.size());
+
+	struct Cursor { size_t next, end; };
+	std::vector<Cursor> heap;
+	for (size_t i = 0; i + 1 < runs.size(); i++)
+		if (runs[i] < runs[i + 1])
+			heap.push_back({ runs[i], runs[i + 1] });
+	auto later = [&](const Cursor& x, const Cursor& y) { return order(collected[y.next], collected[x.next]); };
+	std::make_heap(heap.begin(), heap.end(), later);
+
+	// Merge the runs, dropping duplicates (objects in more than one index
+	// tile) and the objects past a layer's feature limit. Once a layer is
+	// full, each run skips the rest of it.
 	std::vector<OutputObjectID> data;
-	collectObjectsForTile(zoom, coordinates, data);
-	collectLargeObjectsForTile(zoom, coordinates, data);
-
-	// Lexicographic comparison, with the order of: layer, geomType, attributes, and objectID.
-	// Note that attributes is preferred to objectID.
-	// It is to arrange objects with the identical attributes continuously.
-	// Such objects will be merged into one object, to reduce the size of output.
-	boost::sort::pdqsort(data.begin(), data.end(), [&sortOrders](const OutputObjectID& x, const OutputObjectID& y) -> bool {
-		if (x.oo.layer < y.oo.layer) return true;
-		if (x.oo.layer > y.oo.layer) return false;
-		if (x.oo.z_order < y.oo.z_order) return  sortOrders[x.oo.layer];
-		if (x.oo.z_order > y.oo.z_order) return !sortOrders[x.oo.layer];
-		if (x.oo.geomType < y.oo.geomType) return true;
-		if (x.oo.geomType > y.oo.geomType) return false;
-		if (x.oo.attributes < y.oo.attributes) return true;
-		if (x.oo.attributes > y.oo.attributes) return false;
-		if (x.oo.objectID < y.oo.objectID) return true;
-		return false;
-	});
-	data.erase(unique(data.begin(), data.end()), data.end());
+	data.reserve(collected.size());
+	std::vector<uint> layerCounts(featureLimits.size(), 0);
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), later);
+		Cursor& cursor = heap.back();
+		const OutputObjectID& object = collected[cursor.next++];
+		const uint layer = object.oo.layer;
+		const uint limit = featureLimits[layer];
+
+		if ((limit == 0 || layerCounts[layer] < limit) && (data.empty() || !(data.back() == object))) {
+			data.push_back(object);
+			layerCounts[layer]++;
+		}
+		if (limit > 0 && layerCounts[layer] >= limit)
+			cursor.next = std::partition_point(collected.begin() + cursor.next, collected.begin() + cursor.end, [layer](const OutputObjectID& x) {
+				return x.oo.layer <= layer;
+			}) - collected.begin();
+
+		if (cursor.next < cursor.end)
+			std::push_heap(heap.begin(), heap.end(), later);
+		else
+			heap.pop_back();
+	}
 	return data;
 }
 
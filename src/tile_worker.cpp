@@ -96,6 +96,7 @@ void writeMultiLinestring(
 	const AttributeStore& attributeStore,
 	const SharedData& sharedData,
 	vtzero::layer_builder& vtLayer,
+	LayerAttributeCache& attributeCache,
 	const TileBbox& bbox,
 	const OutputObjectID& oo,
 	unsigned zoom,
@@ -159,7 +160,7 @@ void writeMultiLinestring(
 
 	if (hadLine) {
 		// add the properties
-		oo.oo.writeAttributes(attributeStore, fbuilder, zoom);
+		oo.oo.writeAttributes(attributeStore, vtLayer, attributeCache, fbuilder, zoom);
 		// call commit() when you are done
 		fbuilder.commit();
 	}
@@ -204,6 +205,7 @@ void writeMultiPolygon(
 	const AttributeStore& attributeStore,
 	const SharedData& sharedData,
 	vtzero::layer_builder& vtLayer,
+	LayerAttributeCache& attributeCache,
 	const TileBbox& bbox,
 	const OutputObjectID& oo,
 	unsigned zoom,
@@ -251,7 +253,7 @@ void writeMultiPolygon(
 
 	if (hadPoly) {
 		// add the properties
-		oo.oo.writeAttributes(attributeStore, fbuilder, zoom);
+		oo.oo.writeAttributes(attributeStore, vtLayer, attributeCache, fbuilder, zoom);
 		// call commit() when you are done
 		fbuilder.commit();
 	}
@@ -268,7 +270,8 @@ void ProcessObjects(
 	bool combinePolygons,
 	unsigned zoom,
 	const TileBbox &bbox,
-	vtzero::layer_builder& vtLayer
+	vtzero::layer_builder& vtLayer,
+	LayerAttributeCache& attributeCache
 ) {
 
 	for (auto jt = ooSameLayerBegin; jt != ooSameLayerEnd; ++jt) {
@@ -282,7 +285,7 @@ void ProcessObjects(
 			LatpLon pos = source->buildNodeGeometry(oo.oo.objectID, bbox);
 			pair<int,int> xy = bbox.scaleLatpLon(pos.latp/10000000.0, pos.lon/10000000.0);
 			fbuilder.add_point(xy.first, xy.second);
-			oo.oo.writeAttributes(attributeStore, fbuilder, zoom);
+			oo.oo.writeAttributes(attributeStore, vtLayer, attributeCache, fbuilder, zoom);
 			fbuilder.commit();
 		} else {
 			Geometry g;
@@ -326,9 +329,9 @@ void ProcessObjects(
 			}
 
 			if (oo.oo.geomType == LINESTRING_ || oo.oo.geomType == MULTILINESTRING_)
-				writeMultiLinestring(attributeStore, sharedData, vtLayer, bbox, oo, zoom, simplifyLevel, boost::get<MultiLinestring>(g));
+				writeMultiLinestring(attributeStore, sharedData, vtLayer, attributeCache, bbox, oo, zoom, simplifyLevel, boost::get<MultiLinestring>(g));
 			else if (oo.oo.geomType == POLYGON_)
-				writeMultiPolygon(attributeStore, sharedData, vtLayer, bbox, oo, zoom, simplifyLevel, boost::get<MultiPolygon>(g));
+				writeMultiPolygon(attributeStore, sharedData, vtLayer, attributeCache, bbox, oo, zoom, simplifyLevel, boost::get<MultiPolygon>(g));
 		}
 	}
 }
@@ -383,6 +386,9 @@ void ProcessLayer(
 	//TileCoordinate tileX = index.x;
 	TileCoordinate tileY = index.y;
 
+	// Key/value indices in vtLayer, shared by all its sub-layers
+	LayerAttributeCache attributeCache;
+
 	// Loop through sub-layers
 	std::time_t start = std::time(0);
 	for (auto mt = ltx.begin(); mt != ltx.end(); ++mt) {
@@ -406,13 +412,11 @@ void ProcessLayer(
 		}
 
 		for (size_t i=0; i<sources.size(); i++) {
-			// Loop through output objects
+			// Loop through output objects (already cut to the layer's feature limit)
 			auto ooListSameLayer = getObjectsAtSubLayer(data[i], layerNum);
-			auto end = ooListSameLayer.second;
-			if (ld.featureLimit>0 && end-ooListSameLayer.first>ld.featureLimit && zoom<ld.featureLimitBelow) end = ooListSameLayer.first+ld.featureLimit;
 			ProcessObjects(sources[i], attributeStore, 
-				ooListSameLayer.first, end, sharedData, 
-				simplifyLevel, filterArea, zoom < ld.combinePolygonsBelow, zoom, bbox, vtLayer);
+				ooListSameLayer.first, ooListSameLayer.second, sharedData, 
+				simplifyLevel, filterArea, zoom < ld.combinePolygonsBelow, zoom, bbox, vtLayer, attributeCache);
 		}
 	}
 	if (verbose && std::time(0)-start>3) {
@@ -22,7 +22,6 @@
 #include <boost/variant.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/asio/thread_pool.hpp>
-#include <boost/sort/sort.hpp>
 
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
@@ -43,10 +42,12 @@
 #include "coordinates.h"
 #include "coordinates_geom.h"
 #include "significant_tags.h"
+#include "tag_rules.h"
 
 #include "attribute_store.h"
 #include "output_object.h"
 #include "osm_lua_processing.h"
+#include "lua_profiler.h"
 #include "mbtiles.h"
 
 #include "options_parser.h"
@@ -55,6 +56,7 @@
 #include "geojson_processor.h"
 #include "shp_processor.h"
 #include "tile_worker.h"
+#include "index_file.h"
 #include "osm_mem_tiles.h"
 #include "shp_mem_tiles.h"
 
@@ -96,6 +98,8 @@ int main(const int argc, const char* argv[]) {
 	if (options.showHelp) { OptionsParser::showHelp(); return 0; }
 
 	verbose = options.verbose;
+	if (options.profileLua)
+		LuaProfiler::enable();
 
 	vector<string> bboxElements = parseBox(options.bbox);
 
@@ -118,6 +122,20 @@ int main(const int argc, const char* argv[]) {
 	}
 
 
+	// ----	Open the saved index (if there is one)
+
+	IndexFileHeader indexHeader;
+	std::unique_ptr<IndexFileReader> indexReader;
+	if (!options.loadIndex.empty()) {
+		try {
+			indexReader.reset(new IndexFileReader(options.loadIndex));
+			indexHeader.read(*indexReader);
+		} catch (std::runtime_error &err) {
+			cerr << err.what() << endl;
+			return 1;
+		}
+	}
+
 	// ----	Read bounding box from first .pbf (if there is one)
 
 	bool hasClippingBox = false;
@@ -148,6 +166,13 @@ int main(const int argc, const char* argv[]) {
 				maxLat = std::max(maxLat, localMaxLat);
 			}
 		}
+
+	} else if (indexReader && indexHeader.hasClippingBox) {
+		hasClippingBox = true;
+		minLon = indexHeader.minLon;
+		minLat = indexHeader.minLat;
+		maxLon = indexHeader.maxLon;
+		maxLat = indexHeader.maxLat;
 	}
 
 	if (hasClippingBox) {
@@ -172,6 +197,19 @@ int main(const int argc, const char* argv[]) {
 		cerr << "Couldn't find expected details in JSON file." << endl;
 		return -1;
 	}
+	// ----	Read tag rules
+
+	TagRules tagRules;
+	if (!options.rulesFile.empty()) {
+		try {
+			tagRules.load(options.rulesFile);
+		} catch (std::runtime_error &err) {
+			cerr << err.what() << endl;
+			return -1;
+		}
+		cout << "Read " << tagRules.getRules().size() << " tag rules from " << options.rulesFile << endl;
+	}
+
 	if (hasClippingBox) {
 		cout << "Bounding box " << clippingBox.min_corner().x() << ", " << latp2lat(clippingBox.min_corner().y()) << ", " << 
 		                           clippingBox.max_corner().x() << ", " << latp2lat(clippingBox.max_corner().y()) << endl;
@@ -241,87 +279,143 @@ int main(const int argc, const char* argv[]) {
 
 	class LayerDefinition layers(config.layers);
 
+	const auto& rules = tagRules.getRules();
+	for (size_t i = 0; i < rules.size(); i++) {
+		if (!rules[i].layer.empty() && layers.layerMap.count(rules[i].layer) == 0) {
+			cerr << "rule " << (i + 1) << " in " << options.rulesFile << ": layer \"" << rules[i].layer << "\" doesn't exist" << endl;
+			return -1;
+		}
+	}
+
 	const unsigned int indexZoom = std::min(config.baseZoom, 14u);
 	class OsmMemTiles osmMemTiles(options.threadNum, indexZoom, config.includeID, *nodeStore, *wayStore);
 	class ShpMemTiles shpMemTiles(options.threadNum, indexZoom);
 	osmMemTiles.open();
 	shpMemTiles.open();
 
-	OsmLuaProcessing osmLuaProcessing(osmStore, config, layers, options.luaFile, 
-		shpMemTiles, osmMemTiles, attributeStore, options.osm.materializeGeometries);
-
-	// ---- Load external sources (shp/geojson)
+	if (indexReader) {
+		// ----	Load a saved index, instead of reading the sources
+		if (indexHeader.indexZoom != indexZoom || indexHeader.layerNames != layers.getLayerNames() || indexHeader.sortOrders != layers.getSortOrders()) {
+			cerr << "Index " << options.loadIndex << " was saved with a different base zoom, different layers or different z_order directions" << endl;
+			return 1;
+		}
 
-	{
-		ShpProcessor shpProcessor(clippingBox, options.threadNum, shpMemTiles, osmLuaProcessing);
-		GeoJSONProcessor geoJSONProcessor(clippingBox, options.threadNum, shpMemTiles, osmLuaProcessing);
-		for (size_t layerNum=0; layerNum<layers.layers.size(); layerNum++) {
-			LayerDef &layer = layers.layers[layerNum];
-			if(layer.indexed) { shpMemTiles.CreateNamedLayerIndex(layer.name); }
-
-			if (layer.source.size()>0) {
-				if (!hasClippingBox) {
-					cerr << "Can't read shapefiles unless a bounding box is provided." << endl;
-					exit(EXIT_FAILURE);
-				} else if (ends_with(layer.source, "json") || ends_with(layer.source, "jsonl") || ends_with(layer.source, "JSON") || ends_with(layer.source, "JSONL") || ends_with(layer.source, "jsonseq") || ends_with(layer.source, "JSONSEQ")) {
-					cout << "Reading GeoJSON " << layer.name << endl;
-					geoJSONProcessor.read(layers.layers[layerNum], layerNum);
-				} else {
-					cout << "Reading shapefile " << layer.name << endl;
-					shpProcessor.read(layers.layers[layerNum], layerNum);
+		cout << "Loading index " << options.loadIndex << endl;
+		try {
+			attributeStore.load(*indexReader);
+			shpMemTiles.load(*indexReader);
+			osmMemTiles.load(*indexReader);
+			OsmMemTiles::loadReferencedGeometries(*indexReader, *nodeStore, *wayStore, options.threadNum);
+		} catch (std::runtime_error &err) {
+			cerr << err.what() << endl;
+			return 1;
+		}
+		shpMemTiles.reportSize();
+	} else {
+		OsmLuaProcessing osmLuaProcessing(osmStore, config, layers, options.luaFile, 
+			shpMemTiles, osmMemTiles, attributeStore, options.osm.materializeGeometries, &tagRules);
+
+		// ---- Load external sources (shp/geojson)
+
+		{
+			ShpProcessor shpProcessor(clippingBox, options.threadNum, shpMemTiles, osmLuaProcessing);
+			GeoJSONProcessor geoJSONProcessor(clippingBox, options.threadNum, shpMemTiles, osmLuaProcessing);
+			for (size_t layerNum=0; layerNum<layers.layers.size(); layerNum++) {
+				LayerDef &layer = layers.layers[layerNum];
+				if(layer.indexed) { shpMemTiles.CreateNamedLayerIndex(layer.name); }
+
+				if (layer.source.size()>0) {
+					if (!hasClippingBox) {
+						cerr << "Can't read shapefiles unless a bounding box is provided." << endl;
+						exit(EXIT_FAILURE);
+					} else if (ends_with(layer.source, "json") || ends_with(layer.source, "jsonl") || ends_with(layer.source, "JSON") || ends_with(layer.source, "JSONL") || ends_with(layer.source, "jsonseq") || ends_with(layer.source, "JSONSEQ")) {
+						cout << "Reading GeoJSON " << layer.name << endl;
+						geoJSONProcessor.read(layers.layers[layerNum], layerNum);
+					} else {
+						cout << "Reading shapefile " << layer.name << endl;
+						shpProcessor.read(layers.layers[layerNum], layerNum);
+					}
 				}
 			}
 		}
-	}
-	shpMemTiles.reportSize();
+		shpMemTiles.reportSize();
 
-	// ----	Read significant node/way tags
-	const SignificantTags significantNodeTags = osmLuaProcessing.GetSignificantNodeKeys();
-	const SignificantTags significantWayTags = osmLuaProcessing.GetSignificantWayKeys();
+		// ----	Read significant node/way tags
+		const SignificantTags significantNodeTags = osmLuaProcessing.GetSignificantNodeKeys();
+		const SignificantTags significantWayTags = osmLuaProcessing.GetSignificantWayKeys();
 
-	// ----	Read all PBFs
-	
-	PbfProcessor pbfProcessor(osmStore);
-	std::vector<bool> sortOrders = layers.getSortOrders();
+		// ----	Read all PBFs
+
+		PbfProcessor pbfProcessor(osmStore);
 
-	for (auto inputFile : options.inputFiles) {
-		cout << "Reading .pbf " << inputFile << endl;
-		ifstream infile(inputFile, ios::in | ios::binary);
-		if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
+		for (auto inputFile : options.inputFiles) {
+			cout << "Reading .pbf " << inputFile << endl;
+			ifstream infile(inputFile, ios::in | ios::binary);
+			if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
 		
-		const bool hasSortTypeThenID = PbfHasOptionalFeature(inputFile, OptionSortTypeThenID);
-		int ret = pbfProcessor.ReadPbfFile(
-			nodeStore->shards(),
-			hasSortTypeThenID,
-			significantNodeTags,
-			significantWayTags,
-			options.threadNum,
-			[&]() {
-				thread_local std::pair<std::string, std::shared_ptr<ifstream>> pbfStream;
-				if (pbfStream.first != inputFile) {
-					pbfStream = std::make_pair(inputFile, std::make_shared<ifstream>(inputFile, ios::in | ios::binary));
-				}
-				return pbfStream.second;
-			},
-			[&]() {
-				thread_local std::pair<std::string, std::shared_ptr<OsmLuaProcessing>> osmLuaProcessing;
-				if (osmLuaProcessing.first != inputFile) {
-					osmLuaProcessing = std::make_pair(inputFile, std::make_shared<OsmLuaProcessing>(osmStore, config, layers, options.luaFile, shpMemTiles, osmMemTiles, attributeStore, options.osm.materializeGeometries));
-				}
-				return osmLuaProcessing.second;
-			},
-			*nodeStore,
-			*wayStore
-		);
-		if (ret != 0) return ret;
-	} 
-	attributeStore.finalize();
+			const bool hasSortTypeThenID = PbfHasOptionalFeature(inputFile, OptionSortTypeThenID);
+			int ret = pbfProcessor.ReadPbfFile(
+				nodeStore->shards(),
+				hasSortTypeThenID,
+				significantNodeTags,
+				significantWayTags,
+				options.threadNum,
+				[&]() {
+					thread_local std::pair<std::string, std::shared_ptr<ifstream>> pbfStream;
+					if (pbfStream.first != inputFile) {
+						pbfStream = std::make_pair(inputFile, std::make_shared<ifstream>(inputFile, ios::in | ios::binary));
+					}
+					return pbfStream.second;
+				},
+				[&]() {
+					thread_local std::pair<std::string, std::shared_ptr<OsmLuaProcessing>> osmLuaProcessing;
+					if (osmLuaProcessing.first != inputFile) {
+						osmLuaProcessing = std::make_pair(inputFile, std::make_shared<OsmLuaProcessing>(osmStore, config, layers, options.luaFile, shpMemTiles, osmMemTiles, attributeStore, options.osm.materializeGeometries, &tagRules));
+					}
+					return osmLuaProcessing.second;
+				},
+				*nodeStore,
+				*wayStore
+			);
+			if (ret != 0) return ret;
+		} 
+		if (options.profileLua)
+			LuaProfiler::report(cout);
+		attributeStore.finalize();
+	}
 	osmMemTiles.reportSize();
 	attributeStore.reportSize();
 
 	// ----	Initialise SharedData
 
 	SourceList sources = {&osmMemTiles, &shpMemTiles};
+	std::vector<bool> sortOrders = layers.getSortOrders();
+	if (!indexReader) {
+		for (auto source : sources) {
+			source->finalize(options.threadNum, sortOrders);
+		}
+	}
+
+	// ----	Save the index, if required
+
+	if (!options.saveIndex.empty()) {
+		cout << "Saving index " << options.saveIndex << endl;
+		try {
+			IndexFileWriter indexWriter(options.saveIndex);
+			IndexFileHeader header { hasClippingBox, minLon, minLat, maxLon, maxLat, indexZoom, layers.getLayerNames(), sortOrders };
+			header.write(indexWriter);
+			attributeStore.save(indexWriter);
+			shpMemTiles.save(indexWriter);
+			osmMemTiles.save(indexWriter);
+			osmMemTiles.saveReferencedGeometries(indexWriter);
+			indexWriter.close();
+		} catch (std::runtime_error &err) {
+			cerr << err.what() << endl;
+			return 1;
+		}
+		if (options.outputFile.empty()) return 0;
+	}
+
 	class SharedData sharedData(config, layers);
 	sharedData.outputFile = options.outputFile;
 	sharedData.outputMode = options.outputMode;
@@ -347,9 +441,6 @@ int main(const int argc, const char* argv[]) {
 	// Loop through tiles
 	std::atomic<uint64_t> tilesWritten(0);
 
-	for (auto source : sources) {
-		source->finalize(options.threadNum);
-	}
 	// tiles by zoom level
 
 	// The clipping bbox check is expensive - as an optimization, compute the set of
@@ -374,7 +465,6 @@ int main(const int argc, const char* argv[]) {
 		sharedData.pmtiles.isSparse = false;
 	}
 
-	std::deque<std::pair<unsigned int, TileCoordinates>> tileCoordinates;
 	std::vector<std::shared_ptr<TileCoordinatesSet>> zoomResults;
 	zoomResults.reserve(sharedData.config.endZoom + 1);
 
@@ -383,13 +473,23 @@ int main(const int argc, const char* argv[]) {
 		zoomResults.emplace_back(std::make_shared<PreciseTileCoordinatesSet>(zoom));
 	}
 
+	// Add SparseTileCoordinatesSet for z15..z20. Tiles under the z14 tiles
+	// in coveredZ14 (those with lines, polygons or large objects) are
+	// included wholesale; only the tiles that points fall in are stored.
+	std::shared_ptr<TileCoordinatesSet> coveredZ14;
+	if (sharedData.config.endZoom >= 15)
+		coveredZ14 = std::make_shared<PreciseTileCoordinatesSet>(14);
+	for (uint zoom = 15u; zoom <= std::min(20u, sharedData.config.endZoom); zoom++) {
+		zoomResults.emplace_back(std::make_shared<SparseTileCoordinatesSet>(zoom, *coveredZ14));
+	}
+
 	{
 #ifdef CLOCK_MONOTONIC
 		timespec start, end;
 		clock_gettime(CLOCK_MONOTONIC, &start);
 #endif
 		std::cout << "collecting tiles" << std::flush;
-		populateTilesAtZoom(sources, zoomResults);
+		populateTilesAtZoom(sources, zoomResults, coveredZ14.get());
 #ifdef CLOCK_MONOTONIC
 		clock_gettime(CLOCK_MONOTONIC, &end);
 		uint64_t tileNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
@@ -398,11 +498,25 @@ int main(const int argc, const char* argv[]) {
 	}
 
 	// Add LossyTileCoordinatesSet, if needed
-	for (uint zoom = 15u; zoom <= sharedData.config.endZoom; zoom++) {
-		zoomResults.emplace_back(std::make_shared<LossyTileCoordinatesSet>(zoom, *zoomResults[14]));
+	for (uint zoom = 21u; zoom <= sharedData.config.endZoom; zoom++) {
+		zoomResults.emplace_back(std::make_shared<LossyTileCoordinatesSet>(zoom, *zoomResults[20]));
 	}
 
+	// Tiles outside the clipping box are skipped, along with their children
+	auto isInClippingBox = [&](unsigned int zoom, TileCoordinate x, TileCoordinate y) {
+		if (!hasClippingBox)
+			return true;
+
+		if (zoom >= 6 && coveredZ6Tiles.test(x / (1 << (zoom - 6)), y / (1 << (zoom - 6))))
+			return true;
+
+		return boost::geometry::intersects(TileBbox(TileCoordinates(x, y), zoom, false, false).getTileBox(), clippingBox);
+	};
+
+	// Count the tiles to be written, for progress output. They're generated
+	// again, in order, as they're written.
 	std::cout << ", filtering tiles:" << std::flush;
+	uint64_t totalTiles = 0;
 	for (uint zoom=sharedData.config.startZoom; zoom <= sharedData.config.endZoom; zoom++) {
 		std::cout << " z" << std::to_string(zoom) << std::flush;
 #ifdef CLOCK_MONOTONIC
@@ -410,164 +524,124 @@ int main(const int argc, const char* argv[]) {
 		clock_gettime(CLOCK_MONOTONIC, &start);
 #endif
 
-		const auto& zoomResult = zoomResults[zoom];
-		int numTiles = 0;
-		for (int x = 0; x < 1 << zoom; x++) {
-			for (int y = 0; y < 1 << zoom; y++) {
-				if (!zoomResult->test(x, y))
-					continue;
-			
-				if (hasClippingBox) {
-					bool isInAWhollyCoveredZ6Tile = false;
-					if (zoom >= 6) {
-						TileCoordinate z6x = x / (1 << (zoom - 6));
-						TileCoordinate z6y = y / (1 << (zoom - 6));
-						isInAWhollyCoveredZ6Tile = coveredZ6Tiles.test(z6x, z6y);
-					}
-
-					if(!isInAWhollyCoveredZ6Tile && !boost::geometry::intersects(TileBbox(TileCoordinates(x, y), zoom, false, false).getTileBox(), clippingBox)) 
-						continue;
-				}
-
-				tileCoordinates.push_back(std::make_pair(zoom, TileCoordinates(x, y)));
-				numTiles++;
+		// Scan the set's bitmap in parallel, in bands of rows
+		const TileCoordinatesSet& zoomResult = *zoomResults[zoom];
+		const TileCoordinate width = 1 << zoom;
+		const TileCoordinate bandWidth = std::max<TileCoordinate>(1, width / (options.threadNum * 4));
+		std::atomic<uint64_t> numTiles(0);
+		{
+			boost::asio::thread_pool countPool(options.threadNum);
+			for (TileCoordinate minX = 0; minX < width; minX += bandWidth) {
+				boost::asio::post(countPool, [&, minX]() {
+					uint64_t bandTiles = 0;
+					zoomResult.forEach(minX, std::min(width, minX + bandWidth), [&](TileCoordinate x, TileCoordinate y) {
+						if (isInClippingBox(zoom, x, y))
+							bandTiles++;
+					});
+					numTiles += bandTiles;
+				});
 			}
+			countPool.join();
 		}
+		totalTiles += numTiles;
 
 		std::cout << " (" << numTiles;
 #ifdef CLOCK_MONOTONIC
 		clock_gettime(CLOCK_MONOTONIC, &end);
 		uint64_t tileNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
 		std::cout << ", " << (uint32_t)(tileNs / 1e6) << "ms";
-
 #endif
 		std::cout << ")" << std::flush;
 	}
-	zoomResults.clear();
 
 	std::cout << std::endl;
 
-	// Cluster tiles: breadth-first for z0..z5, depth-first for z6
-	const size_t baseZoom = config.baseZoom;
-	boost::sort::block_indirect_sort(
-		tileCoordinates.begin(), tileCoordinates.end(), 
-		[baseZoom](auto const &a, auto const &b) {
-			const auto aZoom = a.first;
-			const auto bZoom = b.first;
-			const auto aX = a.second.x;
-			const auto aY = a.second.y;
-			const auto bX = b.second.x;
-			const auto bY = b.second.y;
-			const bool aLowZoom = aZoom < CLUSTER_ZOOM;
-			const bool bLowZoom = bZoom < CLUSTER_ZOOM;
-
-			// Breadth-first for z0..5
-			if (aLowZoom != bLowZoom)
-				return aLowZoom;
-
-			if (aLowZoom && bLowZoom) {
-				if (aZoom != bZoom)
-					return aZoom < bZoom;
-
-				if (aX != bX)
-					return aX < bX;
-
-				return aY < bY;
-			}
-
-			for (size_t z = CLUSTER_ZOOM; z <= baseZoom; z++) {
-				// Translate both a and b to zoom z, compare.
-				// First, sanity check: can we translate it to this zoom?
-				if (aZoom < z || bZoom < z) {
-					return aZoom < bZoom;
+	// Cluster tiles: breadth-first for z0..z5, depth-first for z6. Each worker
+	// takes the next batch of tiles from the enumerator when it's ready.
+	TileEnumerator tileEnumerator(zoomResults, CLUSTER_ZOOM, sharedData.config.startZoom, sharedData.config.endZoom, isInClippingBox);
+	std::mutex tileEnumeratorMutex;
+
+	// Each layer's feature limit at each zoom, applied as tiles' objects are collected
+	std::vector<std::vector<uint>> featureLimits;
+	for (uint zoom = 0; zoom <= sharedData.config.endZoom; zoom++)
+		featureLimits.push_back(layers.getFeatureLimits(zoom));
+
+	for (uint32_t thread = 0; thread < options.threadNum; thread++) {
+		boost::asio::post(pool, [&]() {
+			std::vector<std::pair<unsigned int, TileCoordinates>> batch;
+			while (true) {
+				// Compute how many tiles should be assigned to this batch --
+				// higher-zoom tiles are cheaper to compute, lower-zoom tiles more expensive.
+				batch.clear();
+				{
+					std::lock_guard<std::mutex> lock(tileEnumeratorMutex);
+					size_t weight = 0;
+					unsigned int zoom;
+					TileCoordinates coords;
+					while (weight < 1000 && tileEnumerator.next(zoom, coords)) {
+						batch.push_back(std::make_pair(zoom, coords));
+						if (zoom > 12)
+							weight++;
+						else if (zoom > 11)
+							weight += 10;
+						else if (zoom > 10)
+							weight += 100;
+						else
+							weight += 1000;
+					}
 				}
+				if (batch.empty())
+					break;
 
-				const auto aXz = aX / (1 << (aZoom - z));
-				const auto aYz = aY / (1 << (aZoom - z));
-				const auto bXz = bX / (1 << (bZoom - z));
-				const auto bYz = bY / (1 << (bZoom - z));
-
-				if (aXz != bXz)
-					return aXz < bXz;
-
-				if (aYz != bYz)
-					return aYz < bYz;
-			}
+				std::vector<std::string> tileTimings;
+				for (const auto& tile : batch) {
+					unsigned int zoom = tile.first;
+					TileCoordinates coords = tile.second;
 
-			return false;
-		}, 
-		options.threadNum);
-
-	std::size_t batchSize = 0;
-	for(std::size_t startIndex = 0; startIndex < tileCoordinates.size(); startIndex += batchSize) {
-		// Compute how many tiles should be assigned to this batch --
-		// higher-zoom tiles are cheaper to compute, lower-zoom tiles more expensive.
-		batchSize = 0;
-		size_t weight = 0;
-		while (weight < 1000 && startIndex + batchSize < tileCoordinates.size()) {
-			const auto& zoom = tileCoordinates[startIndex + batchSize].first;
-			if (zoom > 12)
-				weight++;
-			else if (zoom > 11)
-				weight += 10;
-			else if (zoom > 10)
-				weight += 100;
-			else
-				weight += 1000;
-
-			batchSize++;
-		}
+#ifdef CLOCK_MONOTONIC
+					timespec start, end;
+					if (options.logTileTimings)
+						clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
 
-		boost::asio::post(pool, [=, &tileCoordinates, &pool, &sharedData, &sources, &attributeStore, &io_mutex, &tilesWritten]() {
-			std::vector<std::string> tileTimings;
-			std::size_t endIndex = std::min(tileCoordinates.size(), startIndex + batchSize);
-			for(std::size_t i = startIndex; i < endIndex; ++i) {
-				unsigned int zoom = tileCoordinates[i].first;
-				TileCoordinates coords = tileCoordinates[i].second;
+					std::vector<std::vector<OutputObjectID>> data;
+					for (auto source : sources) {
+						data.emplace_back(source->getObjectsForTile(sortOrders, featureLimits[zoom], zoom, coords));
+					}
+					outputProc(sharedData, sources, attributeStore, data, coords, zoom);
 
 #ifdef CLOCK_MONOTONIC
-				timespec start, end;
-				if (options.logTileTimings)
-					clock_gettime(CLOCK_MONOTONIC, &start);
+					if (options.logTileTimings) {
+						clock_gettime(CLOCK_MONOTONIC, &end);
+						uint64_t tileNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
+						std::string output = "z" + std::to_string(zoom) + "/" + std::to_string(coords.x) + "/" + std::to_string(coords.y) + " took " + std::to_string(tileNs/1e6) + " ms";
+						tileTimings.push_back(output);
+					}
 #endif
-
-				std::vector<std::vector<OutputObjectID>> data;
-				for (auto source : sources) {
-					data.emplace_back(source->getObjectsForTile(sortOrders, zoom, coords));
 				}
-				outputProc(sharedData, sources, attributeStore, data, coords, zoom);
 
-#ifdef CLOCK_MONOTONIC
 				if (options.logTileTimings) {
-					clock_gettime(CLOCK_MONOTONIC, &end);
-					uint64_t tileNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
-					std::string output = "z" + std::to_string(zoom) + "/" + std::to_string(coords.x) + "/" + std::to_string(coords.y) + " took " + std::to_string(tileNs/1e6) + " ms";
-					tileTimings.push_back(output);
+					const std::lock_guard<std::mutex> lock(io_mutex);
+					std::cout << std::endl;
+					for (const auto& output : tileTimings)
+						std::cout << output << std::endl;
 				}
-#endif
-			}
-
-			if (options.logTileTimings) {
-				const std::lock_guard<std::mutex> lock(io_mutex);
-				std::cout << std::endl;
-				for (const auto& output : tileTimings)
-					std::cout << output << std::endl;
-			}
 
-			tilesWritten += (endIndex - startIndex); 
-
-			if (io_mutex.try_lock()) {
-				// Show progress grouped by z6 (or lower)
-				size_t z = tileCoordinates[startIndex].first;
-				size_t x = tileCoordinates[startIndex].second.x;
-				size_t y = tileCoordinates[startIndex].second.y;
-				if (z > CLUSTER_ZOOM) {
-					x = x / (1 << (z - CLUSTER_ZOOM));
-					y = y / (1 << (z - CLUSTER_ZOOM));
-					z = CLUSTER_ZOOM;
+				tilesWritten += batch.size();
+
+				if (io_mutex.try_lock()) {
+					// Show progress grouped by z6 (or lower)
+					size_t z = batch.front().first;
+					size_t x = batch.front().second.x;
+					size_t y = batch.front().second.y;
+					if (z > CLUSTER_ZOOM) {
+						x = x / (1 << (z - CLUSTER_ZOOM));
+						y = y / (1 << (z - CLUSTER_ZOOM));
+						z = CLUSTER_ZOOM;
+					}
+					cout << "z" << z << "/" << x << "/" << y << ", writing tile " << tilesWritten.load() << " of " << totalTiles << "               \r" << std::flush;
+					io_mutex.unlock();
 				}
-				cout << "z" << z << "/" << x << "/" << y << ", writing tile " << tilesWritten.load() << " of " << tileCoordinates.size() << "               \r" << std::flush;
-				io_mutex.unlock();
 			}
 		});
 	}
@@ -1,7 +1,9 @@
 #include <iostream>
 #include <algorithm>
+#include <thread>
 #include "external/minunit.h"
 #include "attribute_store.h"
+#include "index_file.h"
 
 MU_TEST(test_attribute_store) {
 	AttributeStore store;
@@ -93,9 +95,165 @@ MU_TEST(test_attribute_store_reuses) {
 
 }
 
+MU_TEST(test_attribute_store_zoom_slices) {
+	AttributeStore store;
+	store.reset();
+
+	AttributeSet s1;
+	store.addAttribute(s1, "str1", std::string("someval"), 0);
+	store.addAttribute(s1, "str2", std::string("otherval"), 10);
+	store.addAttribute(s1, "float1", (float)42.0, 12);
+	const auto s1Index = store.add(s1);
+
+	AttributeSet s2;
+	store.addAttribute(s2, "str1", std::string("someval"), 0);
+	const auto s2Index = store.add(s2);
+
+	AttributeSet s3;
+	store.addAttribute(s3, "str2", std::string("otherval"), 10);
+	const auto s3Index = store.add(s3);
+
+	store.finalize();
+
+	// Sets are packed by finalize, but read back the same
+	mu_check(store.size() == 3);
+	mu_check(store.getUnsafe(s1Index).size() == 3);
+	mu_check(store.getUnsafe(s2Index).size() == 1);
+	mu_check(store.getUnsafe(s2Index)[0]->stringValue() == "someval");
+	mu_check(store.getZoomSliceUnsafe(s2Index, 0).size() == 1);
+
+	mu_check(store.getZoomSliceUnsafe(s1Index, 9).size() == 1);
+	mu_check(store.getZoomSliceUnsafe(s1Index, 10).size() == 2);
+	mu_check(store.getZoomSliceUnsafe(s1Index, 11).size() == 2);
+	mu_check(store.getZoomSliceUnsafe(s1Index, 14).size() == 3);
+	mu_check(store.getZoomSliceUnsafe(s1Index, 14)[2]->minzoom == 12);
+
+	// Below z10, s1 has the same visible attributes as s2
+	mu_check(store.zoomSliceId(s1Index, 9) == s2Index);
+	mu_check(store.zoomSliceId(s2Index, 9) == s2Index);
+	mu_check(store.zoomSliceId(s1Index, 10) != s2Index);
+	mu_check(store.zoomSliceId(s1Index, 10) != s1Index);
+	mu_check(store.zoomSliceId(s1Index, 12) == s1Index);
+
+	// Below z10, s3 has no visible attributes
+	mu_check(store.getZoomSliceUnsafe(s3Index, 9).empty());
+	mu_check(store.zoomSliceId(s3Index, 9) != s3Index);
+	mu_check(store.zoomSliceId(s3Index, 10) == s3Index);
+}
+
+MU_TEST(test_attribute_store_save_load) {
+	const std::string filename = "test.attribute_store.index";
+	std::vector<AttributeIndex> indexes;
+	{
+		AttributeStore store;
+		store.reset();
+
+		AttributeSet s1;
+		store.addAttribute(s1, "str1", std::string("someval"), 0);
+		store.addAttribute(s1, "str2", std::string("a very long string"), 14);
+		store.addAttribute(s1, "bool1", true, 3);
+		store.addAttribute(s1, "float1", (float)42.5, 4);
+		indexes.push_back(store.add(s1));
+
+		AttributeSet s2;
+		store.addAttribute(s2, "str1", std::string("otherval"), 10);
+		indexes.push_back(store.add(s2));
+
+		store.finalize();
+		IndexFileWriter writer(filename);
+		store.save(writer);
+		writer.close();
+	}
+
+	AttributeStore store;
+	store.reset();
+	IndexFileReader reader(filename);
+	store.load(reader);
+	remove(filename.c_str());
+
+	mu_check(store.getUnsafe(indexes[0]).size() == 4);
+	mu_check(store.getZoomSliceUnsafe(indexes[0], 3).size() == 2);
+	mu_check(store.getZoomSliceUnsafe(indexes[0], 14)[3]->stringValue() == "a very long string");
+	mu_check(store.getZoomSliceUnsafe(indexes[0], 14)[1]->boolValue());
+	mu_check(store.getZoomSliceUnsafe(indexes[0], 14)[2]->floatValue() == 42.5);
+	mu_check(store.getUnsafe(indexes[1]).size() == 1);
+	mu_check(store.getUnsafe(indexes[1])[0]->stringValue() == "otherval");
+	mu_check(store.getUnsafe(indexes[1])[0]->minzoom == 10);
+}
+
+MU_TEST(test_attribute_store_save_load_threads) {
+	const std::string filename = "test.attribute_store.threads.index";
+	const int threadCount = 8;
+	const int n = 20000;
+	std::vector<std::vector<AttributeIndex>> indexes(threadCount, std::vector<AttributeIndex>(n));
+	std::vector<uint32_t> sliceIds(n);
+	{
+		AttributeStore store;
+		store.reset();
+
+		// Every thread adds the same sets in the same order, so that adds
+		// race and leave gaps in the pair and set tables
+		std::atomic<int> ready(0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < threadCount; t++) {
+			threads.emplace_back([&, t]() {
+				ready++;
+				while (ready < threadCount) {}
+				for (int j = 0; j < n; j++) {
+					AttributeSet set;
+					store.addAttribute(set, "name", std::string("n") + std::to_string(j), 0);
+					store.addAttribute(set, "rank", (float)(j % 30), 0);
+					if (j % 3 == 0)
+						store.addAttribute(set, "ref", std::string("r") + std::to_string(j % 1000), 12);
+					indexes[t][j] = store.add(set);
+				}
+			});
+		}
+		for (auto& thread : threads)
+			thread.join();
+
+		store.finalize();
+		for (int i = 0; i < n; i++)
+			sliceIds[i] = store.zoomSliceId(indexes[0][i], 10);
+
+		IndexFileWriter writer(filename);
+		store.save(writer);
+		writer.close();
+	}
+
+	AttributeStore store;
+	store.reset();
+	IndexFileReader reader(filename);
+	store.load(reader);
+	remove(filename.c_str());
+
+	mu_check(store.size() == n);
+	for (int i = 0; i < n; i++) {
+		for (int t = 1; t < threadCount; t++)
+			mu_check(indexes[t][i] == indexes[0][i]);
+
+		const auto pairs = store.getUnsafe(indexes[0][i]);
+		mu_check(pairs.size() == (i % 3 == 0 ? 3 : 2));
+		for (const auto* pair : pairs) {
+			const std::string& key = store.keyStore.getKey(pair->keyIndex);
+			if (key == "name")
+				mu_check(pair->stringValue() == std::string("n") + std::to_string(i));
+			else if (key == "rank")
+				mu_check(pair->floatValue() == i % 30);
+			else
+				mu_check(key == "ref" && pair->stringValue() == std::string("r") + std::to_string(i % 1000) && pair->minzoom == 12);
+		}
+		mu_check(store.zoomSliceId(indexes[0][i], 10) == sliceIds[i]);
+		mu_check(store.getZoomSliceUnsafe(indexes[0][i], 10).size() == 2);
+	}
+}
+
 MU_TEST_SUITE(test_suite_attribute_store) {
 	MU_RUN_TEST(test_attribute_store);
 	MU_RUN_TEST(test_attribute_store_reuses);
+	MU_RUN_TEST(test_attribute_store_zoom_slices);
+	MU_RUN_TEST(test_attribute_store_save_load);
+	MU_RUN_TEST(test_attribute_store_save_load_threads);
 }
 
 int main() {
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "external/minunit.h"
+#include "concurrent_dedup_table.h"
+
+struct StringHash {
+	size_t operator()(const std::string& s) const { return std::hash<std::string>()(s); }
+};
+
+// A deliberately bad hash, so that many entries have the same hash
+struct CollidingHash {
+	size_t operator()(const std::string& s) const { return std::hash<std::string>()(s) % 1000; }
+};
+
+MU_TEST(test_concurrent_dedup_table) {
+	ConcurrentDedupTable<std::string, StringHash> strs;
+
+	mu_check(strs.size() == 0);
+	mu_check(!strs.full());
+	mu_check(strs.find("foo") == -1);
+	mu_check(strs.add("foo") == 0);
+	mu_check(strs.find("foo") == 0);
+	mu_check(strs.size() == 1);
+	mu_check(strs.add("foo") == 0);
+	mu_check(strs.size() == 1);
+	mu_check(strs.add("bar") == 1);
+	mu_check(strs.add("aardvark") == 2);
+	mu_check(strs.add("bar") == 1);
+	mu_check(strs.size() == 3);
+
+	mu_check(strs[0] == "foo");
+	mu_check(strs.at(1) == "bar");
+	mu_check(strs[2] == "aardvark");
+
+	bool threw = false;
+	try {
+		strs.at(3);
+	} catch (std::out_of_range&) {
+		threw = true;
+	}
+	mu_check(threw);
+}
+
+MU_TEST(test_concurrent_dedup_table_max_size) {
+	ConcurrentDedupTable<std::string, StringHash> strs(2);
+
+	mu_check(strs.add("foo") == 0);
+	mu_check(strs.add("bar") == 1);
+	mu_check(strs.full());
+	mu_check(strs.add("baz") == -1);
+	mu_check(strs.add("foo") == 0);
+	mu_check(strs.size() == 2);
+}
+
+MU_TEST(test_concurrent_dedup_table_prepare) {
+	ConcurrentDedupTable<std::string, StringHash> strs;
+	int prepared = 0;
+	auto prepare = [&](std::string& s) { prepared++; };
+
+	strs.add("foo", prepare);
+	strs.add("foo", prepare);
+	strs.add("bar", prepare);
+	mu_check(prepared == 2);
+}
+
+MU_TEST(test_concurrent_dedup_table_unlisted) {
+	ConcurrentDedupTable<std::string, StringHash> strs;
+
+	mu_check(strs.add("foo") == 0);
+	mu_check(strs.addUnlisted("foo", [](std::string&) {}) == 1);
+	mu_check(strs.addUnlisted("bar", [](std::string&) {}) == 2);
+	mu_check(strs[1] == "foo");
+	mu_check(strs.at(2) == "bar");
+	mu_check(strs.allocated() == 3);
+	mu_check(strs.size() == 1);
+
+	// Unlisted entries are never found
+	mu_check(strs.find("foo") == 0);
+	mu_check(strs.find("bar") == -1);
+	mu_check(strs.add("bar") == 3);
+}
+
+MU_TEST(test_concurrent_dedup_table_grows) {
+	ConcurrentDedupTable<std::string, CollidingHash> strs;
+
+	for (int i = 0; i < 100000; i++)
+		mu_check(strs.add(std::to_string(i)) == i);
+	for (int i = 0; i < 100000; i++) {
+		mu_check(strs.find(std::to_string(i)) == i);
+		mu_check(strs[i] == std::to_string(i));
+	}
+	mu_check(strs.size() == 100000);
+}
+
+MU_TEST(test_concurrent_dedup_table_threads) {
+	ConcurrentDedupTable<std::string, StringHash> strs;
+	const int threadCount = 8;
+	const int n = 50000;
+	std::vector<std::vector<int32_t>> indexes(threadCount);
+
+	// Every thread adds the same strings, in different orders
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threadCount; t++) {
+		threads.emplace_back([&, t]() {
+			indexes[t].resize(n);
+			for (int i = 0; i < n; i++) {
+				const int j = (i * 7919 + t * 104729) % n;
+				indexes[t][j] = strs.add(std::to_string(j));
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	mu_check(strs.size() == n);
+	for (int i = 0; i < n; i++) {
+		const int32_t index = indexes[0][i];
+		mu_check(index >= 0);
+		mu_check(strs[index] == std::to_string(i));
+		for (int t = 1; t < threadCount; t++)
+			mu_check(indexes[t][i] == index);
+	}
+}
+
+MU_TEST_SUITE(test_suite_concurrent_dedup_table) {
+	MU_RUN_TEST(test_concurrent_dedup_table);
+	MU_RUN_TEST(test_concurrent_dedup_table_max_size);
+	MU_RUN_TEST(test_concurrent_dedup_table_prepare);
+	MU_RUN_TEST(test_concurrent_dedup_table_unlisted);
+	MU_RUN_TEST(test_concurrent_dedup_table_grows);
+	MU_RUN_TEST(test_concurrent_dedup_table_threads);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_concurrent_dedup_table);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -108,6 +108,25 @@ MU_TEST(test_options_parser) {
 		mu_check(!opts.osm.shardStores);
 	}
 
+	// --save-index doesn't need an output
+	{
+		std::vector<std::string> args = {"--input", "ontario.pbf", "--save-index", "ontario.index"};
+		auto opts = parse(args);
+		mu_check(opts.saveIndex == "ontario.index");
+		mu_check(opts.outputFile.empty());
+	}
+
+	// --load-index replaces the input, and always uses unsharded stores
+	{
+		std::vector<std::string> args = {"--output", "foo.mbtiles", "--load-index", "ontario.index", "--store", "/tmp/store"};
+		auto opts = parse(args);
+		mu_check(opts.loadIndex == "ontario.index");
+		mu_check(opts.inputFiles.size() == 0);
+		mu_check(!opts.osm.shardStores);
+	}
+
+	ASSERT_THROWS("--load-index can't be used with input files", "--input", "foo", "--output", "bar", "--load-index", "foo.index");
+	ASSERT_THROWS("--load-index can't be used with --save-index", "--output", "bar", "--load-index", "foo.index", "--save-index", "bar.index");
 	ASSERT_THROWS("Couldn't open .json config", "--input", "foo", "--output", "bar", "--config", "nonexistent-config.json");
 	ASSERT_THROWS("Couldn't open .lua script", "--input", "foo", "--output", "bar", "--process", "nonexistent-script.lua");
 }
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include "external/minunit.h"
+#include "osm_lua_processing.h"
+#include "node_stores.h"
+#include "way_stores.h"
+#include "tag_rules.h"
+
+bool verbose = false;
+
+const std::string profileFile = "test.osm_lua_processing.lua";
+
+MU_TEST(test_batch_call_lua_rule) {
+	// Both objects go to Lua, which adds a layer of its own
+	{
+		std::ofstream profile(profileFile);
+		profile << R"LUA(
+function node_batch_function(batch)
+	for i = 1, batch:size() do
+		batch:select(i)
+		Layer("lua", false)
+	end
+end
+)LUA";
+	}
+
+	TagRules tagRules;
+	tagRules.parse(R"JSON({
+		"rules": [ { "match": { "amenity": "cafe" }, "layer": "rules", "call_lua": true } ]
+	})JSON");
+
+	Config config;
+	config.baseZoom = 14;
+	for (const std::string name : {"rules", "lua"})
+		config.layers.addLayer(name, 0, 14, 0, 0, 0, 0, 0, 0, 0, true, 0, 0, "", {}, false, false, "", "");
+	LayerDefinition layers(config.layers);
+
+	BinarySearchNodeStore nodeStore;
+	BinarySearchWayStore wayStore;
+	OSMStore osmStore(nodeStore, wayStore);
+	AttributeStore attributeStore;
+	OsmMemTiles osmMemTiles(1, 14, false, nodeStore, wayStore);
+	ShpMemTiles shpMemTiles(1, 14);
+	osmMemTiles.open();
+	shpMemTiles.open();
+
+	OsmLuaProcessing processing(osmStore, config, layers, profileFile, shpMemTiles, osmMemTiles, attributeStore, true, &tagRules);
+	mu_check(processing.canProcessNodeBatches());
+
+	const protozero::data_view amenity("amenity"), cafe("cafe");
+	TagMap tags;
+	tags.addTag(amenity, cafe);
+	const LatpLon ll { 437300000, 74200000 };
+	const std::vector<OsmLuaProcessing::BatchNode> nodes {
+		{ 1, ll, &tags },
+		{ 2, ll, &tags }
+	};
+
+	// Each node's geometry is stored once, and shared by its two outputs
+	const NodeID before = osmMemTiles.storePoint(Point(0, 0));
+	std::vector<char> emitted;
+	processing.setNodeBatch(nodes, emitted);
+	mu_check(emitted == std::vector<char>({ true, true }));
+
+	const std::vector<bool> sortOrders = layers.getSortOrders();
+	osmMemTiles.finalize(1, sortOrders);
+	const std::vector<OutputObjectID> objects = osmMemTiles.getObjectsForTile(sortOrders, layers.getFeatureLimits(14), 14, latpLon2index(ll, 14));
+	mu_check(objects.size() == 4);
+	for (uint layer = 0; layer < 2; layer++) {
+		std::vector<NodeID> ids;
+		for (const auto& object : objects)
+			if (object.oo.layer == layer)
+				ids.push_back(object.oo.objectID);
+		std::sort(ids.begin(), ids.end());
+		mu_check(ids == std::vector<NodeID>({ before + 1, before + 2 }));
+	}
+
+	remove(profileFile.c_str());
+}
+
+MU_TEST_SUITE(test_suite_osm_lua_processing) {
+	MU_RUN_TEST(test_batch_call_lua_rule);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_osm_lua_processing);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
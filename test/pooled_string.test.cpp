@@ -1,4 +1,6 @@
 #include <iostream>
+#include <thread>
+#include <vector>
 #include "external/minunit.h"
 #include "pooled_string.h"
 
@@ -46,8 +48,53 @@ MU_TEST(test_pooled_string) {
 	mu_check(stdShortString != stdLongString);
 }
 
+MU_TEST(test_pooled_string_dedup) {
+	// Equal long strings share storage
+	std::string longString("this string is stored only once");
+	PooledString a(longString);
+	PooledString b(longString);
+	mu_check(a == b);
+	mu_check(a.data() == b.data());
+
+	protozero::data_view view = { longString.data(), longString.size() };
+	PooledString c(&view);
+	c.ensureStringIsOwned();
+	mu_check(c.data() == a.data());
+	mu_check(c.toString() == longString);
+
+	PooledString d("this string is stored only twice");
+	mu_check(d != a);
+	mu_check(d.data() != a.data());
+}
+
+MU_TEST(test_pooled_string_threads) {
+	const int threadCount = 8;
+	const int n = 20000;
+	std::vector<std::vector<PooledString>> strings(threadCount);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threadCount; t++) {
+		threads.emplace_back([&, t]() {
+			for (int i = 0; i < n; i++)
+				strings[t].push_back(PooledString("a string that is long enough to pool " + std::to_string(i)));
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	for (int i = 0; i < n; i++) {
+		const std::string expected = "a string that is long enough to pool " + std::to_string(i);
+		for (int t = 0; t < threadCount; t++) {
+			mu_check(strings[t][i].toString() == expected);
+			mu_check(strings[t][i] == strings[0][i]);
+		}
+	}
+}
+
 MU_TEST_SUITE(test_suite_pooled_string) {
 	MU_RUN_TEST(test_pooled_string);
+	MU_RUN_TEST(test_pooled_string_dedup);
+	MU_RUN_TEST(test_pooled_string_threads);
 }
 
 int main() {
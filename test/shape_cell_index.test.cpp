@@ -0,0 +1,121 @@
+#include <iostream>
+#include <algorithm>
+#include "external/minunit.h"
+#include "shape_cell_index.h"
+#include "coordinates.h"
+
+namespace geom = boost::geometry;
+
+MultiPolygon square(double x1, double y1, double x2, double y2) {
+	MultiPolygon mp;
+	Polygon p;
+	geom::convert(Box(Point(x1, y1), Point(x2, y2)), p);
+	mp.push_back(p);
+	return mp;
+}
+
+ShapeCellIndex::CellState stateOf(const ShapeCellIndex& index, uint id, const Point& p, bool& found) {
+	uint32_t x, y;
+	found = false;
+	if (!index.cellFor(Box(p, p), x, y))
+		return ShapeCellIndex::CellState::Boundary;
+
+	std::vector<std::pair<uint, ShapeCellIndex::CellState>> shapes;
+	index.shapesInCell(x, y, shapes);
+	for (const auto& shape : shapes) {
+		if (shape.first == id) {
+			found = true;
+			return shape.second;
+		}
+	}
+	return ShapeCellIndex::CellState::Boundary;
+}
+
+MU_TEST(test_classify_square) {
+	ShapeCellIndex index(8);
+
+	// About 10 degrees square, so many z8 cells are wholly inside
+	MultiPolygon mp = square(0.1, 0.1, 10.1, 10.1);
+	std::vector<ShapeCellIndex::Cell> cells = index.classify(mp);
+	mu_check(!cells.empty());
+
+	// Inside cells are stored at coarser zooms than the boundary
+	bool coarseInside = false;
+	for (const auto& cell : cells) {
+		if (cell.state == ShapeCellIndex::CellState::Boundary)
+			mu_check(cell.z == 8);
+		else if (cell.z < 8)
+			coarseInside = true;
+	}
+	mu_check(coarseInside);
+
+	index.add(1, cells);
+
+	bool found;
+	mu_check(stateOf(index, 1, Point(5, 5), found) == ShapeCellIndex::CellState::Inside);
+	mu_check(found);
+
+	stateOf(index, 1, Point(0.1, 5), found);
+	mu_check(found);
+
+	stateOf(index, 1, Point(-5, 5), found);
+	mu_check(!found);
+
+	stateOf(index, 1, Point(20, 20), found);
+	mu_check(!found);
+}
+
+MU_TEST(test_classify_hole) {
+	ShapeCellIndex index(8);
+
+	MultiPolygon mp = square(0.1, 0.1, 10.1, 10.1);
+	Ring hole;
+	geom::convert(Box(Point(3, 3), Point(7, 7)), hole);
+	std::reverse(hole.begin(), hole.end());
+	mp[0].inners().push_back(hole);
+	geom::correct(mp);
+
+	index.add(1, index.classify(mp));
+
+	bool found;
+	stateOf(index, 1, Point(5, 5), found);
+	mu_check(!found);
+	mu_check(stateOf(index, 1, Point(1.5, 1.5), found) == ShapeCellIndex::CellState::Inside);
+	mu_check(found);
+}
+
+MU_TEST(test_cell_for) {
+	ShapeCellIndex index(8);
+	uint32_t x, y;
+
+	mu_check(index.cellFor(Box(Point(0.01, 0.01), Point(0.02, 0.02)), x, y));
+	mu_check(x == lon2tilex(0.01, 8));
+	mu_check(y == latp2tiley(0.02, 8));
+
+	// Spans several cells
+	mu_check(!index.cellFor(Box(Point(0.01, 0.01), Point(5, 5)), x, y));
+}
+
+MU_TEST(test_unclassified) {
+	ShapeCellIndex index(8);
+	mu_check(!index.hasUnclassified());
+	index.addUnclassified(3);
+	index.addUnclassified(1);
+	mu_check(index.hasUnclassified());
+	mu_check(index.isUnclassified(1));
+	mu_check(!index.isUnclassified(2));
+	mu_check(index.isUnclassified(3));
+}
+
+MU_TEST_SUITE(test_suite_shape_cell_index) {
+	MU_RUN_TEST(test_classify_square);
+	MU_RUN_TEST(test_classify_hole);
+	MU_RUN_TEST(test_cell_for);
+	MU_RUN_TEST(test_unclassified);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_shape_cell_index);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -105,10 +105,75 @@ MU_TEST(test_significant_tags) {
 	}
 }
 
+MU_TEST(test_block_significant_tags) {
+	const std::vector<protozero::data_view> stringTable = {
+		"", "building", "yes", "name", "Some name", "power", "tower", "line"
+	};
+	const uint32_t building = 1, yes = 2, name = 3, nameValue = 4, power = 5, tower = 6, line = 7;
+	std::vector<std::pair<uint32_t, uint32_t>> tags;
+	auto tag = [&](size_t i) { return tags[i]; };
+
+	// Default-reject: accepts anything with a matched tag
+	{
+		std::vector<std::string> defaultReject{"building", "power=tower"};
+		SignificantTags significant(defaultReject);
+		BlockSignificantTags block;
+		block.resolve(significant, stringTable);
+		mu_check(block.anyPossible());
+
+		tags = { { name, nameValue } };
+		mu_check(!block.filter(tags.size(), tag));
+
+		tags = { { name, nameValue }, { building, yes } };
+		mu_check(block.filter(tags.size(), tag));
+
+		tags = { { power, line } };
+		mu_check(!block.filter(tags.size(), tag));
+
+		tags = { { power, tower } };
+		mu_check(block.filter(tags.size(), tag));
+	}
+
+	// No significant key in the string table: no object can pass
+	{
+		std::vector<std::string> defaultReject{"amenity"};
+		SignificantTags significant(defaultReject);
+		BlockSignificantTags block;
+		block.resolve(significant, stringTable);
+		mu_check(!block.anyPossible());
+	}
+
+	// Default-accept: accepts anything with an unmatched tag
+	{
+		std::vector<std::string> defaultAccept{"~building"};
+		SignificantTags significant(defaultAccept);
+		BlockSignificantTags block;
+		block.resolve(significant, stringTable);
+		mu_check(block.anyPossible());
+
+		tags = { { building, yes } };
+		mu_check(!block.filter(tags.size(), tag));
+
+		tags = { { building, yes }, { name, nameValue } };
+		mu_check(block.filter(tags.size(), tag));
+	}
+
+	// Disabled: accepts everything
+	{
+		SignificantTags significant;
+		BlockSignificantTags block;
+		block.resolve(significant, stringTable);
+		mu_check(block.anyPossible());
+		tags = {};
+		mu_check(block.filter(tags.size(), tag));
+	}
+}
+
 MU_TEST_SUITE(test_suite_significant_tags) {
 	MU_RUN_TEST(test_parse_filter);
 	MU_RUN_TEST(test_significant_tags);
 	MU_RUN_TEST(test_invalid_significant_tags);
+	MU_RUN_TEST(test_block_significant_tags);
 }
 
 int main() {
@@ -0,0 +1,130 @@
+#include <iostream>
+#include "external/minunit.h"
+#include "tag_map.h"
+
+MU_TEST(test_interned_tag_keys) {
+	InternedTagKeys keys;
+	mu_check(keys.size() == 0);
+	mu_check(keys.find(protozero::data_view("highway")) == -1);
+
+	mu_check(keys.intern("highway") == 0);
+	mu_check(keys.intern("building") == 1);
+	mu_check(keys.intern("amenity") == 2);
+	mu_check(keys.intern("highway") == 0);
+	mu_check(keys.size() == 3);
+
+	mu_check(keys[1] == "building");
+	mu_check(keys.find(protozero::data_view("amenity")) == 2);
+	mu_check(keys.find(protozero::data_view("building")) == 1);
+	mu_check(keys.find(protozero::data_view("highway")) == 0);
+	mu_check(keys.find(protozero::data_view("name")) == -1);
+}
+
+MU_TEST(test_tag_map_interned_keys) {
+	InternedTagKeys keys;
+	keys.intern("highway");
+	keys.intern("name");
+
+	std::vector<protozero::data_view> stringTable = {
+		protozero::data_view(""),
+		protozero::data_view("name"),
+		protozero::data_view("Main Street"),
+		protozero::data_view("highway"),
+		protozero::data_view("primary"),
+		protozero::data_view("surface"),
+		protozero::data_view("asphalt")
+	};
+	BlockInternedKeys blockKeys;
+	blockKeys.resolve(keys, stringTable);
+	mu_check(blockKeys.keyCount() == 2);
+	mu_check(blockKeys[1] == 1);
+	mu_check(blockKeys[3] == 0);
+	mu_check(blockKeys[5] == -1);
+
+	// Interned after the block was resolved
+	const uint32_t surface = keys.intern("surface");
+	const uint32_t building = keys.intern("building");
+
+	TagMap tags;
+	tags.reset();
+	tags.useInternedKeys(blockKeys.keyCount());
+	tags.addTag(stringTable[3], stringTable[4], blockKeys.keyHash(3), blockKeys[3]);
+	tags.addTag(stringTable[5], stringTable[6], blockKeys.keyHash(5), blockKeys[5]);
+
+	int64_t loc = tags.getInternedKey(0, keys);
+	mu_check(loc >= 0);
+	mu_check(*tags.getValueFromKey(loc) == protozero::data_view("primary"));
+	mu_check(tags.getInternedKey(1, keys) == -1);
+
+	// Falls back to the key's string
+	loc = tags.getInternedKey(surface, keys);
+	mu_check(loc >= 0);
+	mu_check(*tags.getValueFromKey(loc) == protozero::data_view("asphalt"));
+	mu_check(tags.getInternedKey(building, keys) == -1);
+
+	// Reset clears the interned keys, and tags added without IDs are
+	// found by string
+	tags.reset();
+	mu_check(tags.getInternedKey(0, keys) == -1);
+	tags.addTag(stringTable[1], stringTable[2]);
+	loc = tags.getInternedKey(1, keys);
+	mu_check(loc >= 0);
+	mu_check(*tags.getValueFromKey(loc) == protozero::data_view("Main Street"));
+}
+
+MU_TEST(test_tag_map) {
+	// Many keys with a shared prefix, as with name:* tags
+	std::vector<std::string> strings;
+	strings.reserve(400);
+	for (int i = 0; i < 200; i++) {
+		strings.push_back("name:" + std::to_string(i));
+		strings.push_back("value " + std::to_string(i));
+	}
+	std::vector<protozero::data_view> views;
+	for (const auto& str : strings)
+		views.push_back(protozero::data_view(str.data(), str.size()));
+
+	TagMap tags;
+	for (int round = 0; round < 2; round++) {
+		tags.reset();
+		mu_check(tags.empty());
+		const int n = round == 0 ? 200 : 5;
+		for (int i = 0; i < n; i++)
+			tags.addTag(views[i * 2], views[i * 2 + 1]);
+		mu_check(!tags.empty());
+
+		for (int i = 0; i < n; i++) {
+			const std::string key = "name:" + std::to_string(i);
+			const int64_t loc = tags.getKey(key.data(), key.size());
+			mu_check(loc >= 0);
+			mu_check(tags.getValueFromKey(loc)->to_string() == "value " + std::to_string(i));
+		}
+		mu_check(tags.getKey("name", 4) == -1);
+		mu_check(tags.getKey("name:200", 8) == -1);
+
+		size_t count = 0;
+		for (const Tag& tag : tags) {
+			count++;
+			mu_check(tag.key.size() > 5);
+		}
+		mu_check(count == n);
+	}
+
+	// A repeated key keeps the last value
+	protozero::data_view other("other value");
+	tags.addTag(views[0], other);
+	mu_check(tags.getValueFromKey(tags.getKey("name:0", 6))->to_string() == "other value");
+	mu_check(tags.exportToBoostMap().size() == 5);
+}
+
+MU_TEST_SUITE(test_suite_tag_map) {
+	MU_RUN_TEST(test_tag_map);
+	MU_RUN_TEST(test_interned_tag_keys);
+	MU_RUN_TEST(test_tag_map_interned_keys);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tag_map);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
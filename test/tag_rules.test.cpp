@@ -0,0 +1,146 @@
+#include <iostream>
+#include "external/minunit.h"
+#include "tag_rules.h"
+#include "tag_map.h"
+
+const std::string rulesJson = R"JSON({
+	"rules": [
+		{ "match": { "highway": ["motorway", "trunk"] }, "objects": ["way"],
+		  "layer": "transportation", "minzoom": 4,
+		  "attributes": { "class": "$highway", "ramp": { "value": false, "minzoom": 12 }, "lanes": 2 } },
+		{ "match": { "amenity": "cafe", "name": true }, "layer": "poi" },
+		{ "match": { "building": true, "location": false }, "objects": ["way"], "layer": "building", "area": true, "call_lua": true }
+	]
+})JSON";
+
+MU_TEST(test_parse_rules) {
+	TagRules rules;
+	rules.parse(rulesJson);
+	mu_check(rules.getRules().size() == 3);
+
+	const TagRule& road = rules.getRules()[0];
+	mu_check(road.layer == "transportation");
+	mu_check(!road.nodes);
+	mu_check(road.ways);
+	mu_check(road.minzoom == 4);
+	mu_check(!road.callLua);
+	mu_check(road.match.size() == 1);
+	mu_check(road.match[0].values.size() == 2);
+	mu_check(road.attributes.size() == 3);
+	mu_check(road.attributes[0].type == TagRuleAttribute::Type::Tag);
+	mu_check(road.attributes[0].stringValue == "highway");
+	mu_check(road.attributes[1].type == TagRuleAttribute::Type::Boolean);
+	mu_check(road.attributes[1].minzoom == 12);
+	mu_check(road.attributes[2].type == TagRuleAttribute::Type::Number);
+	mu_check(road.attributes[2].numberValue == 2);
+
+	const TagRule& cafe = rules.getRules()[1];
+	mu_check(cafe.nodes);
+	mu_check(cafe.ways);
+	mu_check(cafe.minzoom < 0);
+
+	const TagRule& building = rules.getRules()[2];
+	mu_check(building.area);
+	mu_check(building.callLua);
+	mu_check(!building.match[1].present);
+}
+
+MU_TEST(test_invalid_rules) {
+	const std::vector<std::string> invalid = {
+		"not json",
+		"[]",
+		R"({ "rules": [ { "layer": "poi" } ] })",
+		R"({ "rules": [ { "match": { "amenity": 1 }, "layer": "poi" } ] })",
+		R"({ "rules": [ { "match": { "amenity": "cafe" } } ] })",
+		R"({ "rules": [ { "match": { "amenity": "cafe" }, "objects": ["relation"], "layer": "poi" } ] })",
+		R"({ "rules": [ { "match": { "amenity": "cafe" }, "objects": "node", "layer": "poi" } ] })",
+		R"({ "rules": [ { "match": { "amenity": "cafe" }, "layer": "poi", "area": "yes" } ] })",
+		R"({ "rules": [ { "match": { "amenity": "cafe" }, "layer": "poi", "minzoom": "12" } ] })",
+		R"({ "rules": [ { "match": { "amenity": "cafe" }, "layer": "poi", "zorder": [1] } ] })",
+		R"({ "rules": [ { "match": { "amenity": "cafe" }, "layer": "poi", "call_lua": 1 } ] })",
+		R"({ "rules": [ { "match": { "amenity": "cafe" }, "layer": "poi", "attributes": { "class": { "value": "cafe", "minzoom": 12.5 } } } ] })"
+	};
+
+	for (const auto& json : invalid) {
+		bool threw = false;
+		try {
+			TagRules rules;
+			rules.parse(json);
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		mu_check(threw);
+	}
+}
+
+MU_TEST(test_matching_rules) {
+	TagRules rules;
+	rules.parse(rulesJson);
+
+	const protozero::data_view highway("highway"), motorway("motorway"), primary("primary");
+	const protozero::data_view amenity("amenity"), cafe("cafe"), name("name"), nameValue("Some name");
+	const protozero::data_view building("building"), yes("yes"), location("location"), underground("underground");
+
+	std::vector<const TagRule*> out;
+
+	{
+		TagMap map;
+		map.addTag(highway, motorway);
+		rules.matching(map, true, out);
+		mu_check(out.size() == 1);
+		mu_check(out[0]->layer == "transportation");
+
+		// Only ways
+		out.clear();
+		rules.matching(map, false, out);
+		mu_check(out.empty());
+	}
+
+	{
+		TagMap map;
+		map.addTag(highway, primary);
+		out.clear();
+		rules.matching(map, true, out);
+		mu_check(out.empty());
+	}
+
+	{
+		// All keys must match
+		TagMap map;
+		map.addTag(amenity, cafe);
+		out.clear();
+		rules.matching(map, false, out);
+		mu_check(out.empty());
+
+		map.addTag(name, nameValue);
+		rules.matching(map, false, out);
+		mu_check(out.size() == 1);
+		mu_check(out[0]->layer == "poi");
+	}
+
+	{
+		// Absent keys
+		TagMap map;
+		map.addTag(building, yes);
+		out.clear();
+		rules.matching(map, true, out);
+		mu_check(out.size() == 1);
+
+		map.addTag(location, underground);
+		out.clear();
+		rules.matching(map, true, out);
+		mu_check(out.empty());
+	}
+}
+
+MU_TEST_SUITE(test_suite_tag_rules) {
+	MU_RUN_TEST(test_parse_rules);
+	MU_RUN_TEST(test_invalid_rules);
+	MU_RUN_TEST(test_matching_rules);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tag_rules);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -1,4 +1,7 @@
 #include <iostream>
+#include <algorithm>
+#include <random>
+#include <tuple>
 #include "external/minunit.h"
 #include "tile_coordinates_set.h"
 
@@ -47,8 +50,150 @@ MU_TEST(test_tile_coordinates_set) {
 	}
 }
 
+MU_TEST(test_sparse_tile_coordinates_set) {
+	PreciseTileCoordinatesSet z14(14);
+	SparseTileCoordinatesSet z20(20, z14);
+	mu_check(z20.zoom() == 20);
+	mu_check(z20.size() == 0);
+	mu_check(!z20.test(1000000, 1000000));
+
+	z20.set(1000000, 1000000);
+	z20.set(1000000, 1000000);
+	z20.set(5, 1000000);
+	mu_check(z20.size() == 2);
+	mu_check(z20.test(1000000, 1000000));
+	mu_check(z20.test(5, 1000000));
+	mu_check(!z20.test(1000000, 1000001));
+	mu_check(!z20.test(1000001, 1000000));
+
+	// Out of range tiles are ignored
+	z20.set(1u << 20, 0);
+	mu_check(z20.size() == 2);
+
+	// Enough tiles in a block to make it a bitmap
+	for (TileCoordinate x = 0; x < 64; x++)
+		for (TileCoordinate y = 0; y < 64; y++)
+			z20.set(x * 2, y * 2);
+	mu_check(z20.size() == 2 + 64 * 64);
+	mu_check(z20.test(0, 0));
+	mu_check(z20.test(126, 126));
+	mu_check(!z20.test(1, 0));
+	mu_check(!z20.test(128, 0));
+	z20.set(1, 0);
+	mu_check(z20.test(1, 0));
+	mu_check(z20.size() == 3 + 64 * 64);
+
+	// Covered z14 tiles include all the z20 tiles under them, without
+	// storing them, and aren't counted twice with tiles set singly
+	z14.set(0, 0);
+	z14.set(3, 3);
+	mu_check(z20.size() == 2 * 64 * 64 + 2 + (64 * 64 - 32 * 32));
+	mu_check(z20.test(63, 63));
+	mu_check(z20.test(192, 255));
+	mu_check(!z20.test(191, 255));
+	mu_check(!z20.test(256, 192));
+	mu_check(z20.test(126, 126));
+	mu_check(!z20.test(127, 126));
+}
+
+MU_TEST(test_tile_coordinates_set_for_each) {
+	std::mt19937 rng(7);
+	for (unsigned int zoom = 0; zoom <= 8; zoom++) {
+		PreciseTileCoordinatesSet precise(zoom);
+		for (int i = 0; i < 100; i++)
+			precise.set(rng() % (1u << zoom), rng() % (1u << zoom));
+		LossyTileCoordinatesSet lossy(zoom + 2, precise);
+		SparseTileCoordinatesSet sparse(zoom + 4, precise);
+		for (int i = 0; i < 1000; i++)
+			sparse.set(rng() % (1u << (zoom + 4)), rng() % (1u << (zoom + 4)));
+
+		for (const TileCoordinatesSet* set : std::vector<const TileCoordinatesSet*>{&precise, &lossy, &sparse}) {
+			const TileCoordinate width = 1u << set->zoom();
+			std::vector<std::pair<TileCoordinate, TileCoordinate>> expected, actual;
+			for (TileCoordinate x = 0; x < width; x++)
+				for (TileCoordinate y = 0; y < width; y++)
+					if (set->test(x, y))
+						expected.push_back(std::make_pair(x, y));
+			mu_check(expected.size() == set->size());
+
+			// Visit in uneven bands of rows, which needn't line up with words
+			for (TileCoordinate minX = 0; minX < width; minX += 3)
+				set->forEach(minX, std::min(width, minX + 3), [&](TileCoordinate x, TileCoordinate y) {
+					actual.push_back(std::make_pair(x, y));
+				});
+			mu_check(actual == expected);
+		}
+	}
+}
+
+MU_TEST(test_tile_enumerator) {
+	// Random tiles at z8, with their parents, and a lossy z9
+	std::vector<std::shared_ptr<TileCoordinatesSet>> zooms;
+	for (unsigned int zoom = 0; zoom <= 8; zoom++)
+		zooms.push_back(std::make_shared<PreciseTileCoordinatesSet>(zoom));
+	zooms.push_back(std::make_shared<LossyTileCoordinatesSet>(9, *zooms[8]));
+
+	std::mt19937 rng(42);
+	for (int i = 0; i < 2000; i++) {
+		TileCoordinate x = rng() % 256, y = rng() % 256;
+		for (int zoom = 8; zoom >= 0; zoom--) {
+			zooms[zoom]->set(x, y);
+			x /= 2;
+			y /= 2;
+		}
+	}
+
+	// Leave out the west half of the world
+	auto includeTile = [](unsigned int zoom, TileCoordinate x, TileCoordinate y) {
+		return zoom == 0 || x >= (1u << (zoom - 1));
+	};
+
+	typedef std::tuple<unsigned int, TileCoordinate, TileCoordinate> Tile;
+	std::vector<Tile> expected;
+	for (unsigned int zoom = 2; zoom <= 9; zoom++)
+		for (TileCoordinate x = 0; x < (1u << zoom); x++)
+			for (TileCoordinate y = 0; y < (1u << zoom); y++)
+				if (zooms[zoom]->test(x, y) && includeTile(zoom, x, y))
+					expected.push_back(Tile(zoom, x, y));
+
+	// Breadth-first below z6, then depth-first
+	std::sort(expected.begin(), expected.end(), [](const Tile& a, const Tile& b) {
+		const unsigned int aZoom = std::get<0>(a), bZoom = std::get<0>(b);
+		if ((aZoom < 6) != (bZoom < 6))
+			return aZoom < 6;
+		if (aZoom < 6)
+			return a < b;
+
+		for (unsigned int z = 6; z <= 9; z++) {
+			if (aZoom < z || bZoom < z)
+				return aZoom < bZoom;
+			const TileCoordinate aX = std::get<1>(a) >> (aZoom - z), aY = std::get<2>(a) >> (aZoom - z);
+			const TileCoordinate bX = std::get<1>(b) >> (bZoom - z), bY = std::get<2>(b) >> (bZoom - z);
+			if (aX != bX)
+				return aX < bX;
+			if (aY != bY)
+				return aY < bY;
+		}
+		return false;
+	});
+
+	TileEnumerator enumerator(zooms, 6, 2, 9, includeTile);
+	std::vector<Tile> actual;
+	unsigned int zoom;
+	TileCoordinates coords;
+	while (enumerator.next(zoom, coords))
+		actual.push_back(Tile(zoom, coords.x, coords.y));
+
+	mu_check(!expected.empty());
+	mu_check(actual == expected);
+	mu_check(!enumerator.next(zoom, coords));
+}
+
 MU_TEST_SUITE(test_suite_tile_coordinates_set) {
 	MU_RUN_TEST(test_tile_coordinates_set);
+	MU_RUN_TEST(test_sparse_tile_coordinates_set);
+	MU_RUN_TEST(test_tile_coordinates_set_for_each);
+	MU_RUN_TEST(test_tile_enumerator);
 }
 
 int main() {
@@ -0,0 +1,201 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "external/minunit.h"
+#include "tile_data.h"
+
+bool verbose = false;
+
+class TestTileDataSource : public TileDataSource {
+public:
+	TestTileDataSource(size_t threadNum, unsigned int indexZoom): TileDataSource(threadNum, indexZoom, false) {}
+	std::string name() const override { return "test"; }
+};
+
+MU_TEST(test_z6xy) {
+	for (unsigned int x = 0; x < 256; x++) {
+		for (unsigned int y = 0; y < 256; y++) {
+			const Z6XY xy = packZ6XY(x, y);
+			mu_check(z6X(xy) == x);
+			mu_check(z6Y(xy) == y);
+		}
+	}
+	mu_check(packZ6XY(0, 1) == 1);
+	mu_check(packZ6XY(1, 0) == 2);
+	mu_check(packZ6XY(255, 255) == 0xffff);
+}
+
+MU_TEST(test_z6_tile_range) {
+	// Every tile at a zoom between z6 and the index zoom is a contiguous run
+	// of codes holding exactly the index tiles under it
+	for (uint32_t width = 1; width <= 256; width *= 2) {
+		for (unsigned int x = 0; x < 256; x += width) {
+			for (unsigned int y = 0; y < 256; y += width * 3) {
+				uint32_t first, last;
+				z6TileRange(x, y, width, first, last);
+				mu_check(last - first == width * width);
+				for (uint32_t code = first; code < last; code++) {
+					mu_check(z6X(code) >= x && z6X(code) < x + width);
+					mu_check(z6Y(code) >= y && z6Y(code) < y + width);
+				}
+			}
+		}
+	}
+}
+
+MU_TEST(test_z6_objects_sort) {
+	std::vector<bool> sortOrders{true, false};
+	OutputObjectOrder order{sortOrders};
+	std::mt19937 rng(3);
+
+	for (size_t threads : {1, 4}) {
+		Z6Objects<OutputObject> tile;
+		std::vector<std::pair<Z6XY, OutputObject>> expected;
+		for (int i = 0; i < 20000; i++) {
+			// Few distinct codes, so that many objects share each one
+			const Z6XY xy = packZ6XY(rng() % 16, rng() % 16 * 16);
+			OutputObject oo(POINT_, rng() % 2, i, rng() % 10, 0);
+			oo.setZOrder((int)(rng() % 20) - 10);
+			tile.push_back(xy, oo);
+			expected.push_back(std::make_pair(xy, oo));
+		}
+		tile.sort(threads, order);
+		std::sort(expected.begin(), expected.end(), [&](const std::pair<Z6XY, OutputObject>& a, const std::pair<Z6XY, OutputObject>& b) {
+			if (a.first != b.first)
+				return a.first < b.first;
+			return order(a.second, b.second);
+		});
+
+		// objectIDs are unique, so the order is total
+		mu_check(tile.size() == expected.size());
+		for (size_t i = 0; i < expected.size(); i++) {
+			mu_check(tile.xy[i] == expected[i].first);
+			mu_check(tile.payloads[i] == expected[i].second);
+		}
+	}
+}
+
+MU_TEST(test_get_objects_for_tile) {
+	std::vector<bool> sortOrders{true, false, true, false};
+	OutputObjectOrder order{sortOrders};
+	std::mt19937 rng(42);
+
+	TestTileDataSource source(1, 14);
+	// Objects in a few z14 tiles of z6 tile (32, 21), some in two tiles, and
+	// some large ones
+	const TileCoordinate baseX = 32 << 8, baseY = 21 << 8;
+	for (int i = 0; i < 20000; i++) {
+		OutputObject oo(POINT_, rng() % 4, i % 5000, rng() % 50, rng() % 15);
+		oo.setZOrder((int)(rng() % 100) - 50);
+		TileCoordinates index(baseX + rng() % 8, baseY + rng() % 8);
+		source.addObjectToSmallIndex(index, oo, 0);
+		if (i % 7 == 0)
+			source.addObjectToSmallIndex(TileCoordinates(index.x + 1, index.y), oo, 0);
+		if (i % 500 == 0)
+			source.addObjectToLargeIndex(Box(Point(baseX, baseY), Point(baseX + 5 + rng() % 50, baseY + 3)), oo, 0);
+	}
+	source.finalize(1, sortOrders);
+
+	for (unsigned int zoom : {0u, 3u, 5u, 6u, 9u, 12u, 14u}) {
+		const TileCoordinates tile((baseX + 2) >> (14 - zoom), (baseY + 2) >> (14 - zoom));
+
+		// What getObjectsForTile used to do: sort everything, and drop duplicates
+		std::vector<OutputObjectID> all;
+		std::vector<size_t> runs;
+		source.collectObjectsForTile(zoom, tile, all, runs);
+		source.collectLargeObjectsForTile(zoom, tile, all);
+		boost::sort::pdqsort(all.begin(), all.end(), order);
+		all.erase(std::unique(all.begin(), all.end()), all.end());
+		mu_check(!all.empty());
+
+		std::vector<uint> layerSizes(4);
+		for (const auto& o : all)
+			layerSizes[o.oo.layer]++;
+
+		// No limits, and limits on either side of, and at, a layer's size
+		std::vector<std::vector<uint>> featureLimits{
+			{0, 0, 0, 0},
+			{0, 7, 0, 100},
+			{layerSizes[0], layerSizes[1] - 1, layerSizes[2] + 1, 1}
+		};
+		for (const auto& limits : featureLimits) {
+			std::vector<OutputObjectID> expected;
+			std::vector<uint> counts(4);
+			for (const auto& o : all)
+				if (limits[o.oo.layer] == 0 || counts[o.oo.layer]++ < limits[o.oo.layer])
+					expected.push_back(o);
+
+			// Objects that tie in the order may come out either way round
+			const std::vector<OutputObjectID> actual = source.getObjectsForTile(sortOrders, limits, zoom, tile);
+			mu_check(actual.size() == expected.size());
+			if (actual.size() != expected.size())
+				continue;
+			for (size_t i = 0; i < actual.size(); i++)
+				mu_check(!order(actual[i], expected[i]) && !order(expected[i], actual[i]));
+		}
+	}
+}
+
+// The objects collected for tile z/x/y from a low zoom index
+std::vector<OutputObjectID> collectLowZoom(const LowZoomIndex<OutputObject>& index, unsigned int zoom, TileCoordinate x, TileCoordinate y) {
+	std::vector<OutputObjectID> output;
+	std::vector<size_t> runs;
+	index.collect(zoom, TileCoordinates(x, y), output, runs);
+	return output;
+}
+
+MU_TEST(test_low_zoom_index) {
+	// Index zoom 14: buckets are z6 tiles
+	std::vector<std::vector<OutputObject>> byZ6(CLUSTER_ZOOM_AREA);
+	byZ6[37 * CLUSTER_ZOOM_WIDTH + 21].push_back(OutputObject(POINT_, 0, 1, 0, 0));
+	byZ6[37 * CLUSTER_ZOOM_WIDTH + 21].push_back(OutputObject(POINT_, 0, 2, 0, 3));
+	byZ6[0].push_back(OutputObject(POINT_, 0, 3, 0, 0));
+
+	LowZoomIndex<OutputObject> index;
+	index.build(byZ6, 14);
+
+	mu_check(collectLowZoom(index, 0, 0, 0).size() == 2);
+	mu_check(collectLowZoom(index, 2, 2, 1).size() == 1);
+	mu_check(collectLowZoom(index, 3, 4, 2).size() == 2);
+	mu_check(collectLowZoom(index, 5, 18, 10).size() == 2);
+	mu_check(collectLowZoom(index, 5, 18, 11).size() == 0);
+	mu_check(collectLowZoom(index, 5, 0, 0).size() == 1);
+	mu_check(collectLowZoom(index, 5, 0, 0)[0].oo.objectID == 3);
+}
+
+MU_TEST(test_low_zoom_index_low_basezoom) {
+	// Index zoom 4: buckets are z4 tiles, still indexed by x*64 + y
+	std::vector<std::vector<OutputObject>> byZ6(CLUSTER_ZOOM_AREA);
+	byZ6[9 * CLUSTER_ZOOM_WIDTH + 5].push_back(OutputObject(POINT_, 0, 1, 0, 0));
+	byZ6[0 * CLUSTER_ZOOM_WIDTH + 1].push_back(OutputObject(POINT_, 0, 2, 0, 0));
+
+	LowZoomIndex<OutputObject> index;
+	index.build(byZ6, 4);
+
+	mu_check(collectLowZoom(index, 0, 0, 0).size() == 2);
+	mu_check(collectLowZoom(index, 1, 1, 0).size() == 1);
+	mu_check(collectLowZoom(index, 2, 2, 1).size() == 1);
+	mu_check(collectLowZoom(index, 3, 4, 2).size() == 1);
+	mu_check(collectLowZoom(index, 4, 9, 5).size() == 1);
+	mu_check(collectLowZoom(index, 4, 9, 5)[0].oo.objectID == 1);
+	mu_check(collectLowZoom(index, 4, 9, 6).size() == 0);
+	mu_check(collectLowZoom(index, 4, 5, 9).size() == 0);
+	mu_check(collectLowZoom(index, 4, 0, 1).size() == 1);
+	mu_check(collectLowZoom(index, 4, 0, 1)[0].oo.objectID == 2);
+}
+
+MU_TEST_SUITE(test_suite_tile_data) {
+	MU_RUN_TEST(test_z6xy);
+	MU_RUN_TEST(test_z6_tile_range);
+	MU_RUN_TEST(test_z6_objects_sort);
+	MU_RUN_TEST(test_get_objects_for_tile);
+	MU_RUN_TEST(test_low_zoom_index);
+	MU_RUN_TEST(test_low_zoom_index_low_basezoom);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tile_data);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}